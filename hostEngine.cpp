@@ -0,0 +1,393 @@
+// *********************************************************************
+// hostEngine: vectorized host pruning
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "hostEngine.h"
+
+#if FPOINT_IS_DOUBLE && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HOST_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HOST_X86_SIMD 0
+#endif
+
+// block[r][pc] = (or *=) sum over c of rows[r*stride + c] * modelT[c][pc]
+// for the count site rows of one child; block rows are PADDED_CHARACTERS
+// wide, spare is one more such row of scratch.
+typedef void (*BlockProduct)(const fpoint* rows, long stride, int count, const fpoint* modelT, fpoint* block,
+                             fpoint* spare, bool first, int characters);
+
+// Kernels are templates over the state count: FIXED is 4, 20 or 61 for the
+// specialized instantiations (loop bounds become constants and the reduction
+// over child characters is fully unrolled) and 0 for the generic ones.
+// STATE_LOOP expands the loop body once for each case; the dead one is
+// dropped at compile time.
+#define STATE_LOOP(c, characters, ...)                                          \
+    if (FIXED)                                                                  \
+    {                                                                           \
+        _Pragma("GCC unroll 64")                                                \
+        for (c = 0; c < FIXED; c++) { __VA_ARGS__ }                             \
+    }                                                                           \
+    else                                                                        \
+    {                                                                           \
+        for (c = 0; c < (characters); c++) { __VA_ARGS__ }                      \
+    }
+
+// Portable kernel
+// *********************************************************************
+template <int FIXED>
+static void BlockProductGeneric(const fpoint* rows, long stride, int count, const fpoint* modelT, fpoint* block,
+                                fpoint* spare, bool first, int characters)
+{
+    const int chars = FIXED ? FIXED : characters;
+    const int padded = PADDED_CHARACTERS(chars);
+    fpoint* sum = spare;
+    int r, c, pc;
+    for (r = 0; r < count; r++)
+    {
+        const fpoint* row = rows + r*stride;
+        fpoint* out = block + r*padded;
+        for (pc = 0; pc < padded; pc++) sum[pc] = 0.;
+        STATE_LOOP(c, chars,
+            const fpoint a = row[c];
+            const fpoint* m = modelT + c*padded;
+            for (pc = 0; pc < padded; pc++) sum[pc] += a * m[pc];
+        )
+        if (first) for (pc = 0; pc < padded; pc++) out[pc] = sum[pc];
+        else       for (pc = 0; pc < padded; pc++) out[pc] *= sum[pc];
+    }
+}
+
+#if HOST_X86_SIMD
+
+// AVX2: 4 sites x 8 parent characters per step, 8 independent FMA chains
+// *********************************************************************
+#define AVX2_STORE(ptr, acc) \
+    _mm256_store_pd((ptr), first ? (acc) : _mm256_mul_pd(_mm256_load_pd(ptr), (acc)))
+
+template <int FIXED>
+__attribute__((target("avx2,fma")))
+static void BlockProductAvx2(const fpoint* rows, long stride, int count, const fpoint* modelT, fpoint* block,
+                             fpoint* /* spare */, bool first, int characters)
+{
+    const int chars = FIXED ? FIXED : characters;
+    const int padded = PADDED_CHARACTERS(chars);
+    int r = 0, c, pc;
+    for (; r + 4 <= count; r += 4)
+    {
+        const double* a0 = rows + r*stride;
+        const double* a1 = a0 + stride;
+        const double* a2 = a1 + stride;
+        const double* a3 = a2 + stride;
+        double* out = block + r*padded;
+        for (pc = 0; pc < padded; pc += 8)
+        {
+            __m256d s00 = _mm256_setzero_pd(), s01 = _mm256_setzero_pd();
+            __m256d s10 = _mm256_setzero_pd(), s11 = _mm256_setzero_pd();
+            __m256d s20 = _mm256_setzero_pd(), s21 = _mm256_setzero_pd();
+            __m256d s30 = _mm256_setzero_pd(), s31 = _mm256_setzero_pd();
+            STATE_LOOP(c, chars,
+                const double* m = modelT + c*padded + pc;
+                __m256d m0 = _mm256_load_pd(m);
+                __m256d m1 = _mm256_load_pd(m + 4);
+                __m256d b = _mm256_broadcast_sd(a0 + c);
+                s00 = _mm256_fmadd_pd(b, m0, s00); s01 = _mm256_fmadd_pd(b, m1, s01);
+                b = _mm256_broadcast_sd(a1 + c);
+                s10 = _mm256_fmadd_pd(b, m0, s10); s11 = _mm256_fmadd_pd(b, m1, s11);
+                b = _mm256_broadcast_sd(a2 + c);
+                s20 = _mm256_fmadd_pd(b, m0, s20); s21 = _mm256_fmadd_pd(b, m1, s21);
+                b = _mm256_broadcast_sd(a3 + c);
+                s30 = _mm256_fmadd_pd(b, m0, s30); s31 = _mm256_fmadd_pd(b, m1, s31);
+            )
+            AVX2_STORE(out + pc, s00);                  AVX2_STORE(out + pc + 4, s01);
+            AVX2_STORE(out + padded + pc, s10);         AVX2_STORE(out + padded + pc + 4, s11);
+            AVX2_STORE(out + 2*padded + pc, s20);       AVX2_STORE(out + 2*padded + pc + 4, s21);
+            AVX2_STORE(out + 3*padded + pc, s30);       AVX2_STORE(out + 3*padded + pc + 4, s31);
+        }
+    }
+    for (; r < count; r++)
+    {
+        const double* a0 = rows + r*stride;
+        double* out = block + r*padded;
+        for (pc = 0; pc < padded; pc += 8)
+        {
+            __m256d s00 = _mm256_setzero_pd(), s01 = _mm256_setzero_pd();
+            STATE_LOOP(c, chars,
+                const double* m = modelT + c*padded + pc;
+                __m256d b = _mm256_broadcast_sd(a0 + c);
+                s00 = _mm256_fmadd_pd(b, _mm256_load_pd(m), s00);
+                s01 = _mm256_fmadd_pd(b, _mm256_load_pd(m + 4), s01);
+            )
+            AVX2_STORE(out + pc, s00); AVX2_STORE(out + pc + 4, s01);
+        }
+    }
+}
+
+// AVX-512: 4 sites x 16 parent characters per step, 8-wide tail
+// *********************************************************************
+#define AVX512_STORE(ptr, acc) \
+    _mm512_store_pd((ptr), first ? (acc) : _mm512_mul_pd(_mm512_load_pd(ptr), (acc)))
+
+template <int FIXED>
+__attribute__((target("avx512f")))
+static void BlockProductAvx512(const fpoint* rows, long stride, int count, const fpoint* modelT, fpoint* block,
+                               fpoint* /* spare */, bool first, int characters)
+{
+    const int chars = FIXED ? FIXED : characters;
+    const int padded = PADDED_CHARACTERS(chars);
+    int r = 0, c, pc;
+    for (; r + 4 <= count; r += 4)
+    {
+        const double* a0 = rows + r*stride;
+        const double* a1 = a0 + stride;
+        const double* a2 = a1 + stride;
+        const double* a3 = a2 + stride;
+        double* out = block + r*padded;
+        for (pc = 0; pc + 16 <= padded; pc += 16)
+        {
+            __m512d s00 = _mm512_setzero_pd(), s01 = _mm512_setzero_pd();
+            __m512d s10 = _mm512_setzero_pd(), s11 = _mm512_setzero_pd();
+            __m512d s20 = _mm512_setzero_pd(), s21 = _mm512_setzero_pd();
+            __m512d s30 = _mm512_setzero_pd(), s31 = _mm512_setzero_pd();
+            STATE_LOOP(c, chars,
+                const double* m = modelT + c*padded + pc;
+                __m512d m0 = _mm512_load_pd(m);
+                __m512d m1 = _mm512_load_pd(m + 8);
+                __m512d b = _mm512_set1_pd(a0[c]);
+                s00 = _mm512_fmadd_pd(b, m0, s00); s01 = _mm512_fmadd_pd(b, m1, s01);
+                b = _mm512_set1_pd(a1[c]);
+                s10 = _mm512_fmadd_pd(b, m0, s10); s11 = _mm512_fmadd_pd(b, m1, s11);
+                b = _mm512_set1_pd(a2[c]);
+                s20 = _mm512_fmadd_pd(b, m0, s20); s21 = _mm512_fmadd_pd(b, m1, s21);
+                b = _mm512_set1_pd(a3[c]);
+                s30 = _mm512_fmadd_pd(b, m0, s30); s31 = _mm512_fmadd_pd(b, m1, s31);
+            )
+            AVX512_STORE(out + pc, s00);                AVX512_STORE(out + pc + 8, s01);
+            AVX512_STORE(out + padded + pc, s10);       AVX512_STORE(out + padded + pc + 8, s11);
+            AVX512_STORE(out + 2*padded + pc, s20);     AVX512_STORE(out + 2*padded + pc + 8, s21);
+            AVX512_STORE(out + 3*padded + pc, s30);     AVX512_STORE(out + 3*padded + pc + 8, s31);
+        }
+        for (; pc < padded; pc += 8)
+        {
+            __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+            __m512d s2 = _mm512_setzero_pd(), s3 = _mm512_setzero_pd();
+            STATE_LOOP(c, chars,
+                __m512d m0 = _mm512_load_pd(modelT + c*padded + pc);
+                s0 = _mm512_fmadd_pd(_mm512_set1_pd(a0[c]), m0, s0);
+                s1 = _mm512_fmadd_pd(_mm512_set1_pd(a1[c]), m0, s1);
+                s2 = _mm512_fmadd_pd(_mm512_set1_pd(a2[c]), m0, s2);
+                s3 = _mm512_fmadd_pd(_mm512_set1_pd(a3[c]), m0, s3);
+            )
+            AVX512_STORE(out + pc, s0);                 AVX512_STORE(out + padded + pc, s1);
+            AVX512_STORE(out + 2*padded + pc, s2);      AVX512_STORE(out + 3*padded + pc, s3);
+        }
+    }
+    for (; r < count; r++)
+    {
+        const double* a0 = rows + r*stride;
+        double* out = block + r*padded;
+        for (pc = 0; pc < padded; pc += 8)
+        {
+            __m512d s0 = _mm512_setzero_pd();
+            STATE_LOOP(c, chars,
+                s0 = _mm512_fmadd_pd(_mm512_set1_pd(a0[c]), _mm512_load_pd(modelT + c*padded + pc), s0);
+            )
+            AVX512_STORE(out + pc, s0);
+        }
+    }
+}
+
+#endif // HOST_X86_SIMD
+
+// Dispatch
+// *********************************************************************
+HostIsa HostDetectIsa()
+{
+#if HOST_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return HOST_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return HOST_ISA_AVX2;
+#endif
+    return HOST_ISA_GENERIC;
+}
+
+const char* HostIsaName(HostIsa isa)
+{
+    switch (isa)
+    {
+        case HOST_ISA_AVX2:     return "avx2";
+        case HOST_ISA_AVX512:   return "avx512";
+        default:                return "generic";
+    }
+}
+
+int HostParseIsa(const char* name)
+{
+    if (strcmp(name, "generic") == 0) return HOST_ISA_GENERIC;
+    if (strcmp(name, "avx2") == 0) return HOST_ISA_AVX2;
+    if (strcmp(name, "avx512") == 0) return HOST_ISA_AVX512;
+    return -1;
+}
+
+template <int FIXED>
+static BlockProduct SelectForStates(HostIsa isa)
+{
+#if HOST_X86_SIMD
+    if (isa == HOST_ISA_AVX512) return BlockProductAvx512<FIXED>;
+    if (isa == HOST_ISA_AVX2) return BlockProductAvx2<FIXED>;
+#endif
+    return BlockProductGeneric<FIXED>;
+}
+
+static BlockProduct SelectBlockProduct(HostIsa isa, int characters)
+{
+    HostIsa best = HostDetectIsa();
+    if (isa > best) isa = best;
+    switch (characters)     // the counts of KernelSpecialized (oclKernel.h)
+    {
+        case 4:     return SelectForStates<4>(isa);
+        case 20:    return SelectForStates<20>(isa);
+        case 61:    return SelectForStates<61>(isa);
+        default:    return SelectForStates<0>(isa);
+    }
+}
+
+// Driver
+// *********************************************************************
+bool HostPruningBegin(HostPruning* job, const Tree* tree, fpoint* partials, const fpoint* models,
+                      int* scalings, long sites, int characters, int categories, fpoint uflowThresh, HostIsa isa)
+{
+    const int padded = PADDED_CHARACTERS(characters);
+    const long modelTSize = (long)characters*padded;
+    long node;
+    int c, pc;
+
+    job->tree = tree;
+    job->partials = partials;
+    job->scalings = scalings;
+    job->sites = sites;
+    job->characters = characters;
+    job->padded = padded;
+    job->categories = categories;
+    job->product = (void*)SelectBlockProduct(isa, characters);
+    job->uflowThresh = uflowThresh;
+
+    // transpose and pad every branch model once: modelT[c][pc] = model[pc][c]
+    const long modelCount = (long)tree->nodeCount*categories;
+    if (posix_memalign((void**)&job->modelsT, 64, sizeof(fpoint)*modelCount*modelTSize))
+    {
+        job->modelsT = NULL;
+        return false;
+    }
+    for (node = 0; node < modelCount; node++)     // (node, category) pairs
+    {
+        const fpoint* m = models + node*characters*characters;
+        fpoint* mt = job->modelsT + node*modelTSize;
+        for (c = 0; c < characters; c++)
+        {
+            for (pc = 0; pc < characters; pc++) mt[c*padded+pc] = m[pc*characters+c];
+            for (; pc < padded; pc++) mt[c*padded+pc] = 0.;
+        }
+    }
+    return true;
+}
+
+void HostPruneSites(const HostPruning* job, long node, long siteStart, long siteEnd, fpoint* block)
+{
+    const Tree* tree = job->tree;
+    const long sites = job->sites;
+    const int characters = job->characters, padded = job->padded, categories = job->categories;
+    const int width = categories*characters;
+    const long modelTSize = (long)characters*padded;
+    BlockProduct product = (BlockProduct)job->product;
+    fpoint* partials = job->partials;
+    int* scalings = job->scalings;
+    fpoint* parent = partials + NodePartialsOffset(tree, node, sites, characters, categories);
+    fpoint* spare = block + (long)categories*SITE_BLOCK*padded;
+    long site;
+    int pc, child, category;
+
+    for (site = siteStart; site < siteEnd; site += SITE_BLOCK)
+    {
+        int count = (siteEnd - site < SITE_BLOCK) ? (int)(siteEnd - site) : SITE_BLOCK;
+
+        // one parent block per category stays resident while every child
+        // is folded in; a tip's rows serve every category while in L1
+        for (child = tree->childStart[node]; child < tree->childStart[node+1]; child++)
+        {
+            long childNode = tree->children[child];
+            bool tip = childNode < tree->tipCount;
+            const fpoint* rows = partials + NodePartialsOffset(tree, childNode, sites, characters, categories)
+                               + site*(tip ? characters : width);
+            for (category = 0; category < categories; category++)
+                product(rows + (tip ? 0 : category*characters), tip ? characters : width, count,
+                        job->modelsT + (childNode*categories + category)*modelTSize,
+                        block + (long)category*SITE_BLOCK*padded, spare, child == tree->childStart[node], characters);
+        }
+
+        int r;
+        for (r = 0; r < count; r++)
+        {
+            int scaling = 0;
+            for (child = tree->childStart[node]; child < tree->childStart[node+1]; child++)
+                scaling += scalings[tree->children[child]*sites + site + r];
+
+            fpoint siteMax = 0.;
+            for (category = 0; category < categories; category++)
+            {
+                const fpoint* row = block + ((long)category*SITE_BLOCK + r)*padded;
+                for (pc = 0; pc < characters; pc++)
+                    if (row[pc] > siteMax) siteMax = row[pc];
+            }
+            int shift = SiteExponentShift(siteMax, job->uflowThresh);
+            for (category = 0; category < categories; category++)
+            {
+                const fpoint* row = block + ((long)category*SITE_BLOCK + r)*padded;
+                fpoint* out = parent + (site + r)*width + category*characters;
+                if (shift == 0) memcpy(out, row, sizeof(fpoint)*characters);
+                else for (pc = 0; pc < characters; pc++) out[pc] = ldexp(row[pc], shift);
+            }
+            scalings[node*sites + site + r] = scaling + shift;
+        }
+    }
+}
+
+void HostPruningEnd(HostPruning* job)
+{
+    free(job->modelsT);
+    job->modelsT = NULL;
+}
+
+fpoint* HostAllocBlock(int characters, int categories)
+{
+    void* block;
+    if (posix_memalign(&block, 64, sizeof(fpoint)*HOST_BLOCK_VALUES(characters, categories))) return NULL;
+    return (fpoint*)block;
+}
+
+bool FirstLoopHostFast(const Tree* tree, fpoint* partials, const fpoint* models, int* scalings,
+                       long sites, int characters, int categories, fpoint uflowThresh, HostIsa isa)
+{
+    HostPruning job;
+    if (!HostPruningBegin(&job, tree, partials, models, scalings, sites, characters, categories, uflowThresh, isa))
+        return false;
+    fpoint* block = HostAllocBlock(characters, categories);
+    if (!block)
+    {
+        HostPruningEnd(&job);
+        return false;
+    }
+
+    long node;
+    for (node = tree->tipCount; node < tree->nodeCount; node++)
+        HostPruneSites(&job, node, 0, sites, block);
+
+    free(block);
+    HostPruningEnd(&job);
+    return true;
+}
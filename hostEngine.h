@@ -0,0 +1,72 @@
+// *********************************************************************
+// hostEngine: vectorized host pruning
+//
+// Each child contribution is treated as the matrix product
+// (sites x characters) . (characters x characters)^T.  Models are repacked
+// transposed with the parent-character dimension padded to a whole number
+// of cache lines, sites are swept in L1-sized blocks, and the inner
+// product runs on FMA intrinsics picked at runtime from the CPU features.
+// Nucleotide (4), amino-acid (20) and codon (61) state counts get their own
+// fully unrolled instantiations; any other count uses the generic ones.
+// FirstLoopHost (oclFirstLoop_gold.cpp) stays as the scalar reference.
+// *********************************************************************
+
+#ifndef HOSTENGINE_H
+#define HOSTENGINE_H
+
+#include "oclFirstLoop.h"
+
+// Parent characters padded to 64 bytes (8 doubles): 4 -> 8, 20 -> 24, 61 -> 64
+#define PADDED_CHARACTERS(characters)   (((characters) + 7) & ~7)
+// Sites per cache block: product block + child rows stay in L1
+#define SITE_BLOCK          32
+
+enum HostIsa
+{
+    HOST_ISA_GENERIC = 0,   // portable blocked loops, left to the compiler
+    HOST_ISA_AVX2,          // 256-bit FMA
+    HOST_ISA_AVX512         // 512-bit FMA
+};
+
+// Best instruction set the running CPU supports for fpoint
+HostIsa HostDetectIsa();
+const char* HostIsaName(HostIsa isa);
+// Parse "generic", "avx2" or "avx512"; returns -1 on anything else
+int HostParseIsa(const char* name);
+
+// Same contract as FirstLoopHost: fills every internal node's partials and
+// scalings from the tips.  Requests for an ISA the CPU (or fpoint) cannot
+// use fall back to the next narrower one.  false when the repacked models
+// or the scratch block could not be allocated.
+bool FirstLoopHostFast(const Tree* tree, fpoint* partials, const fpoint* models, int* scalings,
+                       long sites, int characters, int categories, fpoint uflowThresh, HostIsa isa);
+
+// Pieces of FirstLoopHostFast for schedulers that split the work up
+// (hostThreads.cpp): Begin repacks the models, PruneSites computes one
+// node over [siteStart, siteEnd) using a caller-owned scratch block from
+// HostAllocBlock, End frees the repacked models.  Begin returns false,
+// with nothing to free, when the repacked models could not be allocated.
+struct HostPruning
+{
+    const Tree* tree;
+    fpoint*     partials;
+    int*        scalings;
+    long        sites;
+    int         characters, padded;
+    int         categories;
+    fpoint*     modelsT;
+    void*       product;
+    fpoint      uflowThresh;
+};
+
+bool HostPruningBegin(HostPruning* job, const Tree* tree, fpoint* partials, const fpoint* models,
+                      int* scalings, long sites, int characters, int categories, fpoint uflowThresh, HostIsa isa);
+void HostPruneSites(const HostPruning* job, long node, long siteStart, long siteEnd, fpoint* block);
+void HostPruningEnd(HostPruning* job);
+
+// 64-byte aligned scratch for the block products (SITE_BLOCK rows per rate
+// category plus one spare row, PADDED_CHARACTERS wide); NULL on failure
+#define HOST_BLOCK_VALUES(characters, categories)   (((long)(categories)*SITE_BLOCK + 1)*PADDED_CHARACTERS(characters))
+fpoint* HostAllocBlock(int characters, int categories);
+
+#endif
@@ -0,0 +1,392 @@
+// *********************************************************************
+// hostThreads: multi-threaded host pruning
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hostThreads.h"
+
+// The site chunks [chunkStart, chunkEnd) of one ready node: a deque holds
+// one entry per node, however many chunks it has, so its size follows the
+// nodes that are ready rather than the whole job
+struct HostTask
+{
+    int     node;
+    long    chunkStart, chunkEnd;
+};
+
+// Owner pushes and takes at the tail, thieves take from the head; one
+// chunk per take.  The entries grow on demand.
+struct HostDeque
+{
+    pthread_mutex_t lock;
+    HostTask*       tasks;
+    long            capacity;
+    long            head, tail;
+    long            chunks;             // queued, for thieves to skip empty deques unlocked
+};
+
+struct HostJob
+{
+    HostPruning     pruning;
+    int*            pendingChildren;    // internal children not finished yet
+    int*            pendingChunks;      // site chunks of the node not finished yet
+    int             nodesLeft;          // 0 when done, or when a push failed
+    long            chunksPerNode;
+    long            queued;             // chunks in the deques, for idle workers
+    bool            failed;
+};
+
+struct HostWorker
+{
+    HostThreadPool* pool;
+    int             index;
+};
+
+struct HostThreadPool
+{
+    int             size;
+    pthread_t*      threads;
+    HostWorker*     workers;
+    HostDeque*      deques;
+    fpoint**        blocks;             // per-worker scratch block
+    long            blockValues;        // fpoints the blocks are sized for
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start, done;
+    int             generation;
+    int             busy;
+    bool            shutdown;
+    HostJob*        job;
+
+    pthread_mutex_t idleLock;           // idle workers wait on ready for queued chunks
+    pthread_cond_t  ready;
+    int             sleepers;
+};
+
+// Idle workers
+// *********************************************************************
+// Wake up to count sleeping workers (every one when count < 0), after
+// chunks were queued or the job ended
+static void WakeWorkers(HostThreadPool* pool, long count)
+{
+    pthread_mutex_lock(&pool->idleLock);
+    if (count < 0 || count >= pool->sleepers) pthread_cond_broadcast(&pool->ready);
+    else while (count-- > 0) pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+// Sleep until chunks are queued or the job ends
+static void WaitForTasks(HostThreadPool* pool, HostJob* job)
+{
+    pthread_mutex_lock(&pool->idleLock);
+    pool->sleepers++;
+    while (__sync_fetch_and_add(&job->queued, 0) == 0 && __sync_fetch_and_add(&job->nodesLeft, 0) > 0)
+        pthread_cond_wait(&pool->ready, &pool->idleLock);
+    pool->sleepers--;
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+// Deque operations
+// *********************************************************************
+// Unlocked hint for thieves, rechecked under the lock
+static bool DequeEmpty(const HostDeque* deque)
+{
+    return __atomic_load_n(&deque->chunks, __ATOMIC_RELAXED) == 0;
+}
+
+static bool PopTask(HostDeque* deque, HostTask* task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        HostTask* newest = &deque->tasks[deque->tail - 1];
+        task->node = newest->node;
+        task->chunkStart = newest->chunkStart++;
+        if (newest->chunkStart == newest->chunkEnd) deque->tail--;
+        __atomic_fetch_sub(&deque->chunks, 1, __ATOMIC_RELAXED);
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool StealTask(HostDeque* deque, HostTask* task)
+{
+    if (DequeEmpty(deque)) return false;
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        HostTask* oldest = &deque->tasks[deque->head];
+        task->node = oldest->node;
+        task->chunkStart = --oldest->chunkEnd;
+        if (oldest->chunkStart == oldest->chunkEnd) deque->head++;
+        __atomic_fetch_sub(&deque->chunks, 1, __ATOMIC_RELAXED);
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Queue every site chunk of a node whose children are all done; false
+// when the deque could not grow
+static bool PushNode(HostThreadPool* pool, HostDeque* deque, int node)
+{
+    HostJob* job = pool->job;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head == deque->tail) deque->head = deque->tail = 0;
+    if (deque->tail == deque->capacity)
+    {
+        long capacity = deque->capacity ? 2 * deque->capacity : 64;
+        HostTask* tasks = (HostTask*)realloc(deque->tasks, sizeof(HostTask) * capacity);
+        if (!tasks)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+    }
+    HostTask* task = &deque->tasks[deque->tail++];
+    task->node = node;
+    task->chunkStart = 0;
+    task->chunkEnd = job->chunksPerNode;
+    __atomic_fetch_add(&deque->chunks, job->chunksPerNode, __ATOMIC_RELAXED);
+    __sync_add_and_fetch(&job->queued, job->chunksPerNode);
+    pthread_mutex_unlock(&deque->lock);
+    WakeWorkers(pool, job->chunksPerNode);
+    return true;
+}
+
+// Stop every worker after a failed push
+static void FailJob(HostThreadPool* pool, HostJob* job)
+{
+    job->failed = true;
+    __sync_lock_test_and_set(&job->nodesLeft, 0);
+    WakeWorkers(pool, -1);
+}
+
+// Worker loop: run own tasks newest first, steal oldest from the others,
+// and sleep while nothing is queued
+// *********************************************************************
+static void RunJob(HostThreadPool* pool, int index)
+{
+    HostJob* job = pool->job;
+    const Tree* tree = job->pruning.tree;
+    const long sites = job->pruning.sites;
+    HostDeque* own = &pool->deques[index];
+    fpoint* block = pool->blocks[index];
+    HostTask task;
+
+    while (__sync_fetch_and_add(&job->nodesLeft, 0) > 0)
+    {
+        if (!PopTask(own, &task))
+        {
+            bool stolen = false;
+            int k;
+            for (k = 1; k < pool->size && !stolen; k++)
+                stolen = StealTask(&pool->deques[(index + k) % pool->size], &task);
+            if (!stolen)
+            {
+                WaitForTasks(pool, job);
+                continue;
+            }
+        }
+        __sync_sub_and_fetch(&job->queued, 1);
+
+        long siteStart = task.chunkStart * SITES_PER_TASK;
+        HostPruneSites(&job->pruning, task.node, siteStart,
+                       (siteStart + SITES_PER_TASK < sites) ? siteStart + SITES_PER_TASK : sites, block);
+
+        if (__sync_sub_and_fetch(&job->pendingChunks[task.node], 1) == 0)
+        {
+            int parent = tree->parent[task.node];
+            if (parent >= 0 && __sync_sub_and_fetch(&job->pendingChildren[parent], 1) == 0 &&
+                !PushNode(pool, own, parent))
+                FailJob(pool, job);
+            else if (__sync_sub_and_fetch(&job->nodesLeft, 1) == 0)
+                WakeWorkers(pool, -1);
+        }
+    }
+}
+
+static void* WorkerMain(void* arg)
+{
+    HostWorker* worker = (HostWorker*)arg;
+    HostThreadPool* pool = worker->pool;
+    int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        RunJob(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Pool
+// *********************************************************************
+HostThreadPool* HostThreadPoolCreate(int threads)
+{
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+
+    HostThreadPool* pool = (HostThreadPool*)calloc(1, sizeof(HostThreadPool));
+    if (!pool) return NULL;
+    pool->threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    pool->workers = (HostWorker*)calloc(threads, sizeof(HostWorker));
+    pool->deques = (HostDeque*)calloc(threads, sizeof(HostDeque));
+    pool->blocks = (fpoint**)calloc(threads, sizeof(fpoint*));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_mutex_init(&pool->idleLock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    if (!pool->threads || !pool->workers || !pool->deques || !pool->blocks)
+    {
+        HostThreadPoolDestroy(pool);
+        return NULL;
+    }
+
+    // worker 0 is whichever thread calls FirstLoopHostThreaded; size
+    // counts the workers started so far, for Destroy to join
+    int i;
+    for (i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (i > 0 && pthread_create(&pool->threads[i], NULL, WorkerMain, &pool->workers[i]) != 0)
+        {
+            pthread_mutex_destroy(&pool->deques[i].lock);
+            HostThreadPoolDestroy(pool);
+            return NULL;
+        }
+        pool->size = i + 1;
+    }
+    return pool;
+}
+
+void HostThreadPoolDestroy(HostThreadPool* pool)
+{
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 1; i < pool->size; i++) pthread_join(pool->threads[i], NULL);
+    for (i = 0; i < pool->size; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+        free(pool->blocks[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->idleLock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool->blocks);
+    free(pool);
+}
+
+int HostThreadPoolSize(const HostThreadPool* pool)
+{
+    return pool->size;
+}
+
+// Driver
+// *********************************************************************
+bool FirstLoopHostThreaded(HostThreadPool* pool, const Tree* tree, fpoint* partials, const fpoint* models,
+                           int* scalings, long sites, int characters, int categories, fpoint uflowThresh,
+                           HostIsa isa)
+{
+    HostJob job;
+    int node, i, k;
+
+    // scratch blocks are sized by the padded state count and the rate
+    // categories; regrow them when that grows
+    if (HOST_BLOCK_VALUES(characters, categories) > pool->blockValues)
+    {
+        pool->blockValues = 0;
+        for (i = 0; i < pool->size; i++)
+        {
+            free(pool->blocks[i]);
+            pool->blocks[i] = HostAllocBlock(characters, categories);
+            if (!pool->blocks[i]) return false;
+        }
+        pool->blockValues = HOST_BLOCK_VALUES(characters, categories);
+    }
+
+    if (!HostPruningBegin(&job.pruning, tree, partials, models, scalings, sites, characters, categories, uflowThresh,
+                          isa))
+        return false;
+    job.chunksPerNode = (sites + SITES_PER_TASK - 1) / SITES_PER_TASK;
+    job.nodesLeft = tree->nodeCount - tree->tipCount;
+    job.queued = 0;
+    job.failed = false;
+    job.pendingChildren = (int*)calloc(tree->nodeCount, sizeof(int));
+    job.pendingChunks = (int*)malloc(sizeof(int) * tree->nodeCount);
+    if (!job.pendingChildren || !job.pendingChunks)
+    {
+        free(job.pendingChildren);
+        free(job.pendingChunks);
+        HostPruningEnd(&job.pruning);
+        return false;
+    }
+    for (node = tree->tipCount; node < tree->nodeCount; node++)
+    {
+        job.pendingChunks[node] = (int)job.chunksPerNode;
+        for (k = tree->childStart[node]; k < tree->childStart[node+1]; k++)
+            if (tree->children[k] >= tree->tipCount) job.pendingChildren[node]++;
+    }
+    for (i = 0; i < pool->size; i++) pool->deques[i].head = pool->deques[i].tail = pool->deques[i].chunks = 0;
+
+    // nodes whose children are all tips are ready; deal them out round-robin
+    pool->job = &job;
+    for (node = tree->tipCount, i = 0; node < tree->nodeCount && !job.failed; node++)
+        if (job.pendingChildren[node] == 0 && !PushNode(pool, &pool->deques[i++ % pool->size], node))
+            job.failed = true;
+
+    if (!job.failed)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = pool->size - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        RunJob(pool, 0);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pool->job = NULL;
+
+    free(job.pendingChildren);
+    free(job.pendingChunks);
+    HostPruningEnd(&job.pruning);
+    return !job.failed;
+}
@@ -0,0 +1,37 @@
+// *********************************************************************
+// hostThreads: multi-threaded host pruning
+//
+// A persistent pthread pool runs the hostEngine kernels over
+// (node, site chunk) tasks.  Every worker owns a deque of ready nodes: it
+// takes a chunk of its own newest node and, when empty, steals one of the
+// oldest node of another worker; with nothing queued anywhere it sleeps
+// until a node becomes ready.  A node's chunks are queued as soon as its
+// last child finishes, so independent subtrees proceed concurrently.
+// Each chunk is computed the same way whichever thread runs it, so
+// results do not depend on the thread count.
+// *********************************************************************
+
+#ifndef HOSTTHREADS_H
+#define HOSTTHREADS_H
+
+#include "hostEngine.h"
+
+// Sites per task: four SITE_BLOCKs, roughly an L2's worth of child rows
+#define SITES_PER_TASK      (4 * SITE_BLOCK)
+
+struct HostThreadPool;
+
+// threads <= 0 uses every online core.  The calling thread counts as one
+// of the workers, so a pool of 1 runs everything inline.  NULL when the
+// pool or its threads could not be created.
+HostThreadPool* HostThreadPoolCreate(int threads);
+void HostThreadPoolDestroy(HostThreadPool* pool);
+int HostThreadPoolSize(const HostThreadPool* pool);
+
+// Same contract as FirstLoopHostFast; false when the pruning or the
+// scheduler ran out of memory, with partials and scalings incomplete
+bool FirstLoopHostThreaded(HostThreadPool* pool, const Tree* tree, fpoint* partials, const fpoint* models,
+                           int* scalings, long sites, int characters, int categories, fpoint uflowThresh,
+                           HostIsa isa);
+
+#endif
@@ -0,0 +1,373 @@
+// *********************************************************************
+// oclAlignment: FASTA / PHYLIP alignment loader
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "oclAlignment.h"
+
+// Alphabets
+// *********************************************************************
+// Nucleotides as bit masks A=1 C=2 G=4 T=8, amino acids as 20-bit masks;
+// 0 marks a character that is not part of the alphabet.
+static unsigned int nucleotideMask[256];
+static unsigned int aminoAcidMask[256];
+// Sense codon index of every nucleotide triple (A,C,G,T order), -1 for stops
+static int codonState[64];
+
+static void InitAlphabets()
+{
+    static bool ready = false;
+    if (ready) return;
+    const char* nucleotides = "ACGT";
+    const char* aminoAcids = "ARNDCQEGHILKMFPSTWYV";
+    int i, state = 0;
+
+    memset(nucleotideMask, 0, sizeof(nucleotideMask));
+    memset(aminoAcidMask, 0, sizeof(aminoAcidMask));
+    for (i = 0; i < 4; i++) nucleotideMask[(int)nucleotides[i]] = 1u << i;
+    nucleotideMask['U'] = 8;
+    nucleotideMask['R'] = 1|4;  nucleotideMask['Y'] = 2|8;  nucleotideMask['S'] = 2|4;
+    nucleotideMask['W'] = 1|8;  nucleotideMask['K'] = 4|8;  nucleotideMask['M'] = 1|2;
+    nucleotideMask['B'] = 2|4|8; nucleotideMask['D'] = 1|4|8; nucleotideMask['H'] = 1|2|8;
+    nucleotideMask['V'] = 1|2|4;
+    nucleotideMask['N'] = nucleotideMask['?'] = nucleotideMask['-'] = nucleotideMask['.'] = 15;
+
+    for (i = 0; i < 20; i++) aminoAcidMask[(int)aminoAcids[i]] = 1u << i;
+    aminoAcidMask['B'] = aminoAcidMask['N'] | aminoAcidMask['D'];
+    aminoAcidMask['Z'] = aminoAcidMask['Q'] | aminoAcidMask['E'];
+    aminoAcidMask['J'] = aminoAcidMask['I'] | aminoAcidMask['L'];
+    aminoAcidMask['X'] = aminoAcidMask['?'] = aminoAcidMask['-'] = aminoAcidMask['.'] = aminoAcidMask['*'] = (1u << 20) - 1;
+
+    for (i = 'A'; i <= 'Z'; i++)
+    {
+        nucleotideMask[i - 'A' + 'a'] = nucleotideMask[i];
+        aminoAcidMask[i - 'A' + 'a'] = aminoAcidMask[i];
+    }
+
+    // TAA, TAG and TGA are the stops of the universal code
+    for (i = 0; i < 64; i++)
+        codonState[i] = (i == 48 || i == 50 || i == 56) ? -1 : state++;
+    ready = true;
+}
+
+static inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Translation of one site into one partial row
+// *********************************************************************
+// Returns the number of compatible states (0 = not in the alphabet or a
+// stop codon).  residues points at 1 (or 3, for codons) characters.
+static int TranslateSite(const char* residues, int characters, fpoint* row)
+{
+    int c;
+    for (c = 0; c < characters; c++) row[c] = 0.;
+    if (characters == 61)
+    {
+        unsigned int m0 = nucleotideMask[(unsigned char)residues[0]];
+        unsigned int m1 = nucleotideMask[(unsigned char)residues[1]];
+        unsigned int m2 = nucleotideMask[(unsigned char)residues[2]];
+        int a, b, d, states = 0;
+        for (a = 0; a < 4; a++) if (m0 >> a & 1)
+            for (b = 0; b < 4; b++) if (m1 >> b & 1)
+                for (d = 0; d < 4; d++) if (m2 >> d & 1)
+                {
+                    int state = codonState[16*a + 4*b + d];
+                    if (state >= 0)
+                    {
+                        row[state] = 1.;
+                        states++;
+                    }
+                }
+        return states;
+    }
+    unsigned int mask = (characters == 4) ? nucleotideMask[(unsigned char)residues[0]]
+                                          : aminoAcidMask[(unsigned char)residues[0]];
+    int states = 0;
+    for (c = 0; c < characters; c++)
+        if (mask >> c & 1)
+        {
+            row[c] = 1.;
+            states++;
+        }
+    return states;
+}
+
+// Tip lookup by name
+// *********************************************************************
+struct TipName
+{
+    const char* name;
+    int         tip;
+};
+
+static int CompareTipNames(const void* a, const void* b)
+{
+    return strcmp(((const TipName*)a)->name, ((const TipName*)b)->name);
+}
+
+// Binary search for a name that is not NUL-terminated; -1 if absent
+static int FindTip(const TipName* names, int count, const char* name, size_t length)
+{
+    int low = 0, high = count - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        int order = strncmp(names[mid].name, name, length);
+        if (order == 0 && names[mid].name[length] != '\0') order = 1;
+        if (order == 0) return names[mid].tip;
+        if (order < 0) low = mid + 1;
+        else high = mid - 1;
+    }
+    return -1;
+}
+
+// Open
+// *********************************************************************
+static void AlignmentError(const char* path, const char* what, long sequence)
+{
+    if (sequence >= 0) printf("Error in alignment %s, sequence %ld: %s\n", path, sequence + 1, what);
+    else printf("Error in alignment %s: %s\n", path, what);
+}
+
+Alignment* OpenAlignment(const char* path, int characters)
+{
+    if (characters != 4 && characters != 20 && characters != 61)
+    {
+        printf("Alignments need 4 (nucleotide), 20 (amino acid) or 61 (codon) characters, not %d\n", characters);
+        return NULL;
+    }
+    InitAlphabets();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        AlignmentError(path, "cannot open file", -1);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        AlignmentError(path, "empty or unreadable file", -1);
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        AlignmentError(path, "mmap failed", -1);
+        return NULL;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    Alignment* alignment = (Alignment*)calloc(1, sizeof(Alignment));
+    alignment->path = path;
+    alignment->data = (const char*)data;
+    alignment->size = info.st_size;
+    alignment->characters = characters;
+
+    const char* p = alignment->data;
+    const char* end = p + alignment->size;
+    while (p < end && IsSpace(*p)) p++;
+    alignment->fasta = (p < end && *p == '>');
+
+    if (alignment->fasta)
+    {
+        // count the records (lines starting with '>'), and size the first one
+        const char* record = p;
+        while (record < end)
+        {
+            const char* header = (const char*)memchr(record, '\n', end - record);
+            const char* line = header;
+            while (line && line + 1 < end && line[1] != '>')
+                line = (const char*)memchr(line + 1, '\n', end - line - 1);
+            const char* next = (line && line + 1 < end) ? line + 1 : end;
+            if (alignment->sequenceCount++ == 0 && header)
+            {
+                const char* body;
+                for (body = header; body < next; body++)
+                    if (!IsSpace(*body)) alignment->columnCount++;
+            }
+            record = next;
+        }
+    }
+    else
+    {
+        // the mapping is not NUL-terminated, so scan a copy of the header line
+        char header[128];
+        size_t length = 0;
+        long taxa = 0, columns = 0;
+        while (p + length < end && p[length] != '\n' && length < sizeof(header) - 1)
+        {
+            header[length] = p[length];
+            length++;
+        }
+        header[length] = '\0';
+        if (sscanf(header, "%ld %ld", &taxa, &columns) != 2 || taxa <= 0 || columns <= 0)
+        {
+            AlignmentError(path, "neither FASTA nor a PHYLIP \"taxa columns\" header", -1);
+            CloseAlignment(alignment);
+            return NULL;
+        }
+        alignment->sequenceCount = (int)taxa;
+        alignment->columnCount = columns;
+    }
+
+    if (alignment->sequenceCount < 2 || alignment->columnCount <= 0)
+    {
+        AlignmentError(path, "need at least two non-empty sequences", -1);
+        CloseAlignment(alignment);
+        return NULL;
+    }
+    if (characters == 61 && alignment->columnCount % 3 != 0)
+    {
+        AlignmentError(path, "codon alignment length is not a multiple of 3", -1);
+        CloseAlignment(alignment);
+        return NULL;
+    }
+    alignment->siteCount = (characters == 61) ? alignment->columnCount / 3 : alignment->columnCount;
+    return alignment;
+}
+
+// Load
+// *********************************************************************
+bool LoadTipPartials(const Alignment* alignment, const Tree* tree, fpoint* tipPartials)
+{
+    const int characters = alignment->characters;
+    const int width = (characters == 61) ? 3 : 1;
+    const char* p = alignment->data;
+    const char* end = p + alignment->size;
+    int tipCount = tree ? tree->tipCount : alignment->sequenceCount;
+    TipName* names = NULL;
+    bool ok = true;
+
+    if (tipCount != alignment->sequenceCount)
+    {
+        printf("Error in alignment %s: %d sequences for %d tips\n", alignment->path,
+               alignment->sequenceCount, tipCount);
+        return false;
+    }
+    if (tree)
+    {
+        int tip;
+        names = (TipName*)malloc(sizeof(TipName) * tipCount);
+        for (tip = 0; tip < tipCount; tip++)
+        {
+            if (!tree->names[tip])
+            {
+                printf("Error in alignment %s: tree tip %d has no name\n", alignment->path, tip + 1);
+                free(names);
+                return false;
+            }
+            names[tip].name = tree->names[tip];
+            names[tip].tip = tip;
+        }
+        qsort(names, tipCount, sizeof(TipName), CompareTipNames);
+    }
+    char* filled = (char*)calloc(tipCount, 1);
+
+    // skip the PHYLIP header line
+    if (!alignment->fasta)
+    {
+        p = (const char*)memchr(p, '\n', end - p);
+        p = p ? p + 1 : end;
+    }
+
+    long sequence;
+    for (sequence = 0; ok && sequence < alignment->sequenceCount; sequence++)
+    {
+        // name: the rest of a FASTA header line, or the first PHYLIP token
+        while (p < end && IsSpace(*p)) p++;
+        if (alignment->fasta)
+        {
+            if (p == end || *p != '>')
+            {
+                AlignmentError(alignment->path, "expected '>'", sequence);
+                ok = false;
+                break;
+            }
+            p++;
+        }
+        const char* name = p;
+        if (alignment->fasta)
+            while (p < end && *p != '\n' && *p != '\r') p++;
+        else
+            while (p < end && !IsSpace(*p)) p++;
+        size_t nameLength = p - name;
+        while (nameLength > 0 && IsSpace(name[nameLength - 1])) nameLength--;
+
+        int tip = names ? FindTip(names, tipCount, name, nameLength) : (int)sequence;
+        if (tip < 0 || filled[tip])
+        {
+            printf("Error in alignment %s, sequence %ld: %.*s %s\n", alignment->path, sequence + 1,
+                   (int)nameLength, name, tip < 0 ? "is not a tip of the tree" : "appears twice");
+            ok = false;
+            break;
+        }
+        filled[tip] = 1;
+
+        // residues straight into the tip's rows; codons are gathered across
+        // line breaks three characters at a time
+        fpoint* row = tipPartials + (long)tip * alignment->siteCount * characters;
+        char codon[3];
+        int pending = 0;
+        long column = 0;
+        while (p < end && column < alignment->columnCount)
+        {
+            char c = *p;
+            if (alignment->fasta && c == '>') break;
+            p++;
+            if (IsSpace(c)) continue;
+            codon[pending++] = c;
+            column++;
+            if (pending < width) continue;
+            pending = 0;
+            if (TranslateSite(codon, characters, row) == 0)
+            {
+                printf("Error in alignment %s, sequence %ld: '%.*s' at site %ld is %s\n", alignment->path,
+                       sequence + 1, width, codon, column / width,
+                       (width == 3) ? "a stop codon or not a nucleotide triple" : "not in the alphabet");
+                ok = false;
+                break;
+            }
+            row += characters;
+        }
+        if (ok && column != alignment->columnCount)
+        {
+            printf("Error in alignment %s, sequence %ld: %ld columns, expected %ld\n", alignment->path,
+                   sequence + 1, column, alignment->columnCount);
+            ok = false;
+        }
+        // a FASTA record must end here
+        if (ok && alignment->fasta)
+        {
+            while (p < end && IsSpace(*p)) p++;
+            if (p < end && *p != '>')
+            {
+                printf("Error in alignment %s, sequence %ld: more than %ld columns\n", alignment->path,
+                       sequence + 1, alignment->columnCount);
+                ok = false;
+            }
+        }
+    }
+
+    free(names);
+    free(filled);
+    return ok;
+}
+
+void CloseAlignment(Alignment* alignment)
+{
+    if (!alignment) return;
+    munmap((void*)alignment->data, alignment->size);
+    free(alignment);
+}
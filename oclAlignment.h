@@ -0,0 +1,56 @@
+// *********************************************************************
+// oclAlignment: FASTA / PHYLIP alignment loader
+//
+// The file is memory-mapped and parsed in place: residues are translated
+// straight into tip partial rows (1 for every state compatible with the
+// observed character, 0 otherwise) in the packed [tip][site][character]
+// host layout, with no intermediate sequence strings.  The device layouts
+// (oclLayout.h) are not written here: their site stride is the pattern
+// count, only known once site pattern compression (oclPatterns.h) has
+// read these rows, and the layout itself is picked after that.  The tips
+// reach the device layout in one pass, by StoreDevicePartials or inside
+// EngineSetTips.  The state count
+// picks the alphabet: 4 nucleotides, 20 amino acids or 61 sense codons of
+// the universal code (three columns per site).  IUPAC ambiguity codes,
+// gaps and unknowns expand to every compatible state.
+//
+// FASTA is recognised by a leading '>'; anything else is read as
+// sequential (relaxed) PHYLIP: "taxa columns" then one name and sequence
+// per taxon, the sequence possibly spread over several lines.
+// *********************************************************************
+
+#ifndef OCLALIGNMENT_H
+#define OCLALIGNMENT_H
+
+#include <stddef.h>
+
+#include "oclFirstLoop.h"
+
+struct Alignment
+{
+    int         sequenceCount;
+    long        columnCount;        // residues per sequence
+    long        siteCount;          // columns, or codons for 61 states
+    int         characters;
+
+    const char* path;
+    const char* data;               // the mapped file
+    size_t      size;
+    bool        fasta;
+};
+
+// Map the file and size it (sequence count, column count) without
+// translating anything.  Returns NULL after printing the reason on a
+// missing file, unsupported state count or malformed header.
+Alignment* OpenAlignment(const char* path, int characters);
+
+// One pass over the mapped file writing every sequence into its tip row of
+// tipPartials (tipCount * siteCount * characters values, host layout, every
+// column).  With a tree the
+// sequences are matched to tips by name; with NULL they fill tips 0, 1, ...
+// in file order.  Returns false after printing the first problem found.
+bool LoadTipPartials(const Alignment* alignment, const Tree* tree, fpoint* tipPartials);
+
+void CloseAlignment(Alignment* alignment);
+
+#endif
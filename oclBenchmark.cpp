@@ -0,0 +1,122 @@
+// *********************************************************************
+// oclBenchmark: high-resolution timing and benchmark records
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "oclBenchmark.h"
+
+long long TimerNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int CompareSamples(const void* a, const void* b)
+{
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+void SummarizeTimings(long long* samples, int count, TimingStats* stats)
+{
+    stats->count = count;
+    stats->min = stats->max = 0;
+    stats->median = stats->mean = stats->stddev = 0.;
+    if (count <= 0) return;
+
+    qsort(samples, count, sizeof(long long), CompareSamples);
+    stats->min = samples[0];
+    stats->max = samples[count-1];
+    stats->median = (count % 2) ? (double)samples[count/2] : 0.5 * ((double)samples[count/2-1] + samples[count/2]);
+    double sum = 0.;
+    int i;
+    for (i = 0; i < count; i++) sum += samples[i];
+    stats->mean = sum / count;
+    double squares = 0.;
+    for (i = 0; i < count; i++) squares += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+    stats->stddev = (count > 1) ? sqrt(squares / (count - 1)) : 0.;
+}
+
+void NodeWork(const Tree* tree, int node, long patterns, int characters, int categories, size_t valueBytes,
+              double* flops, double* bytes)
+{
+    double rowFpoints = (double)patterns * characters;
+    int child;
+    for (child = tree->childStart[node]; child < tree->childStart[node+1]; child++)
+    {
+        int childRows = (tree->children[child] < tree->tipCount) ? 1 : categories;
+        *flops += categories * (2. * rowFpoints * characters + rowFpoints);
+        *bytes += valueBytes * (childRows * rowFpoints + (double)categories * characters * characters) +
+                  sizeof(int) * (double)patterns;
+    }
+    *bytes += valueBytes * categories * rowFpoints + sizeof(int) * (double)patterns;
+}
+
+void PrintBenchmarkResult(const BenchmarkResult* result)
+{
+    const TimingStats* s = &result->stats;
+    double seconds = s->mean * 1e-9;
+    printf("%-20s median %12.3f us  min %12.3f  max %12.3f  sd %10.3f  (%d runs)  %8.3f GFLOP/s  %8.3f GB/s\n",
+           result->backend, s->median * 1e-3, s->min * 1e-3, s->max * 1e-3, s->stddev * 1e-3, s->count,
+           (seconds > 0.) ? result->flops / seconds * 1e-9 : 0., (seconds > 0.) ? result->bytes / seconds * 1e-9 : 0.);
+}
+
+// JSON string with quotes, backslashes and control characters escaped
+static void WriteJsonString(FILE* f, const char* text)
+{
+    fputc('"', f);
+    for (; text && *text; text++)
+    {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+bool AppendBenchmarkJson(const char* path, const BenchmarkConfig* config, const BenchmarkResult* results, int count)
+{
+    FILE* f = fopen(path, "a");
+    if (!f)
+    {
+        printf("Error opening benchmark file %s\n", path);
+        return false;
+    }
+    fprintf(f, "{\"config\": {\"sites\": %ld, \"patterns\": %ld, \"characters\": %d, \"nodes\": %d, \"tips\": %d, "
+               "\"levels\": %d, \"sites_per_group\": %d, \"work_group_size\": %d, \"unroll\": %d, \"categories\": %d, "
+               "\"fpoint_bytes\": %d, \"host_isa\": ",
+            config->sites, config->patterns, config->characters, config->nodes, config->tips, config->levels,
+            config->sitesPerGroup, config->workGroupSize, config->unroll, config->categories, (int)sizeof(fpoint));
+    WriteJsonString(f, config->hostIsa);
+    fprintf(f, ", \"host_threads\": %d, \"device\": ", config->hostThreads);
+    WriteJsonString(f, config->device);
+    fprintf(f, ", \"precision\": ");
+    WriteJsonString(f, config->precision);
+    fprintf(f, ", \"layout\": ");
+    WriteJsonString(f, config->layout);
+    fprintf(f, ", \"warmup\": %d, \"repeat\": %d}, \"results\": [", config->warmup, config->repeat);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        const TimingStats* s = &results[i].stats;
+        double seconds = s->mean * 1e-9;
+        fprintf(f, "%s{\"backend\": ", i ? ", " : "");
+        WriteJsonString(f, results[i].backend);
+        fprintf(f, ", \"runs\": %d, \"ns\": {\"min\": %lld, \"median\": %.1f, \"mean\": %.1f, \"max\": %lld, "
+                   "\"stddev\": %.1f}, \"flops\": %.0f, \"bytes\": %.0f, \"gflops\": %.6f, \"bytes_per_second\": %.6e}",
+                s->count, s->min, s->median, s->mean, s->max, s->stddev, results[i].flops, results[i].bytes,
+                (seconds > 0.) ? results[i].flops / seconds * 1e-9 : 0.,
+                (seconds > 0.) ? results[i].bytes / seconds : 0.);
+    }
+    fprintf(f, "]}\n");
+    bool written = !ferror(f);
+    if (fclose(f) != 0) written = false;
+    if (!written) printf("Error writing benchmark file %s\n", path);
+    return written;
+}
@@ -0,0 +1,71 @@
+// *********************************************************************
+// oclBenchmark: high-resolution timing and benchmark records
+//
+// Samples are monotonic nanoseconds.  Each backend's samples are reduced
+// to min / median / mean / standard deviation and turned into GFLOP/s and
+// effective bytes/s with the work model of the pruning step below.  A run
+// appends one JSON object per line to the --json file, so a parameter
+// sweep leaves a JSON Lines log that can be compared across releases.
+// *********************************************************************
+
+#ifndef OCLBENCHMARK_H
+#define OCLBENCHMARK_H
+
+#include "oclFirstLoop.h"
+
+// Nanoseconds on a monotonic clock (CLOCK_MONOTONIC)
+long long TimerNanoseconds();
+
+struct TimingStats
+{
+    int         count;
+    long long   min, max;           // nanoseconds
+    double      median, mean, stddev;
+};
+
+// Sorts samples in place
+void SummarizeTimings(long long* samples, int count, TimingStats* stats);
+
+// Work of pruning one internal node over `patterns` sites and K rate
+// categories: per child and category a (patterns x C).(C x C) product
+// (2 C^2 flops per site) and one product into the parent (C per site).
+// Bytes count what has to cross the memory bus at least once: each
+// child's partials (one row per site for a tip, K for an internal node),
+// scalings and K models read, the node's K rows and scalings written,
+// partials and models valueBytes per value.  Both are added to *flops,
+// *bytes.
+void NodeWork(const Tree* tree, int node, long patterns, int characters, int categories, size_t valueBytes,
+              double* flops, double* bytes);
+
+struct BenchmarkResult
+{
+    const char* backend;
+    TimingStats stats;
+    double      flops, bytes;       // work of one sample (the mean when it varies)
+};
+
+// The problem and machine a set of results belongs to
+struct BenchmarkConfig
+{
+    long        sites, patterns;
+    int         characters, nodes, tips, levels;
+    int         sitesPerGroup;
+    int         workGroupSize, unroll;  // the rest of the device launch shape
+    int         categories;         // rate categories
+    const char* hostIsa;
+    int         hostThreads;
+    const char* device;
+    const char* precision;          // of the device kernel
+    const char* layout;             // of the device partials
+    int         warmup, repeat;
+};
+
+// One line: backend, median and spread in microseconds, GFLOP/s, GB/s
+void PrintBenchmarkResult(const BenchmarkResult* result);
+
+// Append {"config": {...}, "results": [...]} as a single line to path.
+// Rates are computed from the mean time.  Returns false if the file
+// cannot be written.
+bool AppendBenchmarkJson(const char* path, const BenchmarkConfig* config, const BenchmarkResult* results, int count);
+
+#endif
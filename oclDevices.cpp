@@ -0,0 +1,107 @@
+// *********************************************************************
+// oclDevices: platform and device selection, site partitioning
+// *********************************************************************
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oclDevices.h"
+
+#define MAX_PLATFORMS   8
+
+cl_device_type ParseDeviceType(const char* name)
+{
+    if (strcmp(name, "gpu") == 0) return CL_DEVICE_TYPE_GPU;
+    if (strcmp(name, "cpu") == 0) return CL_DEVICE_TYPE_CPU;
+    if (strcmp(name, "accelerator") == 0) return CL_DEVICE_TYPE_ACCELERATOR;
+    if (strcmp(name, "all") == 0) return CL_DEVICE_TYPE_ALL;
+    return 0;
+}
+
+const char* DeviceTypeName(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU) return "gpu";
+    if (type & CL_DEVICE_TYPE_CPU) return "cpu";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) return "accelerator";
+    return "other";
+}
+
+static int Platforms(cl_platform_id* platforms)
+{
+    cl_uint count = 0;
+    if (clGetPlatformIDs(MAX_PLATFORMS, platforms, &count) != CL_SUCCESS) return 0;
+    return (count > MAX_PLATFORMS) ? MAX_PLATFORMS : (int)count;
+}
+
+int FindDevices(int platformIndex, cl_device_type type, cl_device_id* devices, int maxDevices)
+{
+    cl_platform_id platforms[MAX_PLATFORMS];
+    int platformCount = Platforms(platforms);
+    int found = 0, p;
+    for (p = 0; p < platformCount && found < maxDevices; p++)
+    {
+        if (platformIndex >= 0 && p != platformIndex) continue;
+        cl_uint count = 0;
+        // CL_DEVICE_NOT_FOUND just means none of this type here
+        if (clGetDeviceIDs(platforms[p], type, maxDevices - found, devices + found, &count) != CL_SUCCESS) continue;
+        found += ((int)count > maxDevices - found) ? maxDevices - found : (int)count;
+    }
+    return found;
+}
+
+int SelectDevices(int platformIndex, cl_device_type* type, cl_device_id* devices, int maxDevices)
+{
+    if (*type) return FindDevices(platformIndex, *type, devices, maxDevices);
+    *type = CL_DEVICE_TYPE_GPU;
+    int found = FindDevices(platformIndex, *type, devices, maxDevices);
+    if (found) return found;
+    *type = CL_DEVICE_TYPE_ALL;
+    return FindDevices(platformIndex, *type, devices, maxDevices);
+}
+
+void ListDevices(int platformIndex, cl_device_type type)
+{
+    cl_platform_id platforms[MAX_PLATFORMS];
+    int platformCount = Platforms(platforms);
+    int number = 0, p, d;
+    for (p = 0; p < platformCount; p++)
+    {
+        char name[256] = {0};
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+        printf("Platform %d: %s\n", p, name);
+
+        cl_device_id devices[MAX_DEVICES];
+        cl_uint count = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, MAX_DEVICES, devices, &count) != CL_SUCCESS) count = 0;
+        if (count > MAX_DEVICES) count = MAX_DEVICES;
+        for (d = 0; d < (int)count; d++)
+        {
+            cl_device_type deviceType = 0;
+            clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, NULL);
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+            bool match = (platformIndex < 0 || p == platformIndex) && (deviceType & type);
+            if (match) printf("  --device=%-3d %-12s %s\n", number++, DeviceTypeName(deviceType), name);
+            else printf("               %-12s %s\n", DeviceTypeName(deviceType), name);
+        }
+    }
+    if (platformCount == 0) printf("No OpenCL platforms\n");
+}
+
+void PartitionSites(const double* throughput, int count, int sites, int quantum, int* shareSites)
+{
+    double total = 0.;
+    int fastest = 0, i;
+    for (i = 0; i < count; i++)
+    {
+        if (throughput[i] > 0.) total += throughput[i];
+        if (throughput[i] > throughput[fastest]) fastest = i;
+    }
+    int assigned = 0;
+    for (i = 0; i < count; i++)
+    {
+        double share = (total > 0. && throughput[i] > 0.) ? sites * throughput[i] / total : 0.;
+        shareSites[i] = (int)(share / quantum) * quantum;
+        assigned += shareSites[i];
+    }
+    shareSites[fastest] += sites - assigned;
+}
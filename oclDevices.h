@@ -0,0 +1,44 @@
+// *********************************************************************
+// oclDevices: platform and device selection, site partitioning
+//
+// Devices are found by type on one platform (--platform=N) or on every
+// platform in turn, and numbered in that order; --device=N picks one of
+// them and --list-devices prints them all.  Without --device-type the
+// driver takes a GPU when there is one and any other device otherwise, so
+// GPU-less nodes fall back to CPU OpenCL runtimes.
+//
+// --all-devices splits the sites across every matching device instead:
+// each device gets a contiguous slice in proportion to the throughput it
+// measured on an even split, rounded to whole work groups.
+// *********************************************************************
+
+#ifndef OCLDEVICES_H
+#define OCLDEVICES_H
+
+#include "oclFirstLoop.h"
+
+#define MAX_DEVICES     16      // devices one run can split the sites across
+
+// "gpu", "cpu", "accelerator" or "all"; 0 if unknown
+cl_device_type ParseDeviceType(const char* name);
+const char* DeviceTypeName(cl_device_type type);
+
+// Up to maxDevices devices of the given type on platform platformIndex, or
+// on every platform in order when platformIndex < 0.  Returns how many
+// were found (0 when none, or when there is no such platform).
+int FindDevices(int platformIndex, cl_device_type type, cl_device_id* devices, int maxDevices);
+
+// FindDevices for *type, or when *type is 0 for GPUs if there are any and
+// every device otherwise; *type is set to the type searched last
+int SelectDevices(int platformIndex, cl_device_type* type, cl_device_id* devices, int maxDevices);
+
+// Every platform and device with its type; the ones FindDevices would
+// return for platformIndex and type are marked with their --device number
+void ListDevices(int platformIndex, cl_device_type type);
+
+// Split sites into count contiguous shares in proportion to throughput
+// (any positive unit), each a multiple of quantum but for the remainder,
+// which goes to the fastest device.  Devices with no throughput get none.
+void PartitionSites(const double* throughput, int count, int sites, int quantum, int* shareSites);
+
+#endif
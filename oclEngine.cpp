@@ -0,0 +1,556 @@
+// *********************************************************************
+// oclEngine: the device pruning engine as a library
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "oclEngine.h"
+#include "oclKernel.h"
+#include "oclMemory.h"
+#include "oclDevices.h"
+#include "oclProgramCache.h"
+
+const char engineDefaultCache[] = "default";
+
+struct Engine
+{
+    const Tree*         tree;
+    int                 sites, characters, categories;
+    size_t              storageBytes, accumBytes;
+    cl_double           uflowThresh[1];     // as an accum
+    KernelConfig        config;
+
+    cl_device_id        device;
+    cl_context          context;
+    cl_command_queue    queue;
+    cl_program          program;
+    CacheStatus         cacheLoaded, cacheStored;   // how the program came from (or went into) the cache
+    cl_kernel           kernel;
+    cl_kernel           rootLikelihood, sumGroups;
+    size_t              reduceLocalSize, reduceGroups;
+    EngineEventHook     eventHook;
+    void*               eventUser;
+    BufferPool*         pool;               // every buffer below
+    cl_mem              partials, models, scalings, childStart, children, dirtyNodes;
+    cl_mem              weights, siteLogL, sums;    // of the log-likelihood reduction
+
+    void*               staging;            // values in the storage type on their way to or from the device
+    fpoint*             root;               // the last evaluation's root partials, once read
+    int*                rootScalings;
+    double*             uploadedWeights;    // the reduction's weights as last uploaded
+    double*             newWeights;         // and as asked for by the current call
+    void*               weightValues;       // the same as accums
+    bool                weightsSet;
+    void*               siteValues;         // per-site log-likelihoods as accums
+    bool*               dirty;              // stale internal nodes, scheduled by the next evaluation
+    int*                dirtyStart;
+    int*                dirtySchedule;
+    bool*               modelSet;
+    int                 modelsMissing;      // nodes whose model was never set
+    bool                tipsSet;
+    bool                evaluated;
+    bool                rootRead;           // root and rootScalings hold the last evaluation
+    cl_int              lastError;
+};
+
+// Fail with status, keeping the OpenCL error behind it
+static EngineStatus Fail(Engine* engine, EngineStatus status, cl_int err)
+{
+    engine->lastError = err;
+    return status;
+}
+
+// The event slot of the next command, from the hook when there is one
+static cl_event* Event(Engine* engine, EngineCommand command, const char* label, size_t bytes, const int* nodes,
+                       int nodeCount)
+{
+    return engine->eventHook ? engine->eventHook(engine->eventUser, command, label, bytes, nodes, nodeCount) : NULL;
+}
+
+// host into buffer at offset, finished with host on return: a blocking
+// write, or mapped and copied when zero-copy
+static cl_int Upload(Engine* engine, cl_mem buffer, size_t offset, size_t bytes, const void* host, const char* label)
+{
+    cl_event* event = Event(engine, ENGINE_COMMAND_WRITE, label, bytes, NULL, 0);
+    if (BufferPoolZeroCopy(engine->pool))
+        return UploadBuffer(engine->pool, engine->queue, buffer, offset, bytes, host, event);
+    return clEnqueueWriteBuffer(engine->queue, buffer, CL_TRUE, offset, bytes, host, 0, NULL, event);
+}
+
+// buffer at offset into host, blocking either way
+static cl_int Download(Engine* engine, cl_mem buffer, size_t offset, size_t bytes, void* host, const char* label)
+{
+    return DownloadBuffer(engine->pool, engine->queue, buffer, offset, bytes, host,
+                          Event(engine, ENGINE_COMMAND_READ, label, bytes, NULL, 0));
+}
+
+static EngineStatus AllocationStatus(cl_int err)
+{
+    return (err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES || err == CL_OUT_OF_HOST_MEMORY ||
+            err == CL_INVALID_BUFFER_SIZE) ? ENGINE_ERROR_OUT_OF_MEMORY : ENGINE_ERROR_OPENCL;
+}
+
+// Whether partials go through staging: another precision or layout on
+// the device
+static bool Converts(const Engine* engine)
+{
+    return engine->storageBytes != sizeof(fpoint) || engine->config.layout.kind != LAYOUT_PACKED;
+}
+
+// Values of the reduction's weights: categories, characters, sites
+static long WeightCount(const Engine* engine)
+{
+    return (long)engine->categories + engine->characters + engine->sites;
+}
+
+// Every internal node stale, as after new tips or a failed evaluation
+static void MarkAllDirty(Engine* engine)
+{
+    int node;
+    for (node = engine->tree->tipCount; node < engine->tree->nodeCount; node++) engine->dirty[node] = true;
+}
+
+void EngineDefaultOptions(EngineOptions* options)
+{
+    options->platformIndex = -1;
+    options->deviceType = 0;
+    options->deviceIndex = 0;
+    options->precision = FPOINT_IS_DOUBLE ? PRECISION_DOUBLE : PRECISION_SINGLE;
+    options->sitesPerGroup = 8;
+    options->localWorkSize = 0;
+    options->unroll = DEFAULT_UNROLL;
+    options->layout = LAYOUT_PADDED;
+    options->programCache = ENGINE_DEFAULT_CACHE;
+    options->zeroCopy = -1;
+    options->eventHook = NULL;
+    options->eventUser = NULL;
+}
+
+// Everything but the host structures of EngineCreate
+static EngineStatus CreateDeviceObjects(Engine* engine, const EngineOptions* options)
+{
+    const Tree* tree = engine->tree;
+    cl_int err;
+    cl_device_type type = options->deviceType;
+    cl_device_id devices[MAX_DEVICES];
+    int deviceCount = SelectDevices(options->platformIndex, &type, devices, MAX_DEVICES);
+    if (options->deviceIndex < 0 || options->deviceIndex >= deviceCount) return ENGINE_ERROR_NO_DEVICE;
+    engine->device = devices[options->deviceIndex];
+
+    PartialsLayout layout;
+    MakeLayout(&layout, options->layout, engine->characters, engine->storageBytes, DeviceLineBytes(engine->device));
+    KernelTuning tuning = { options->localWorkSize, options->sitesPerGroup, options->unroll };
+    err = ConfigureKernel(engine->device, &tuning, engine->characters, engine->categories, options->precision, &layout,
+                          &engine->config);
+    if (err == CL_INVALID_WORK_GROUP_SIZE || err == CL_OUT_OF_RESOURCES)
+        return Fail(engine, ENGINE_ERROR_DEVICE_LIMITS, err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+
+    // every site resident, in single allocations
+    long partialsSize = LayoutSize(&layout, tree, engine->sites, engine->categories);
+    long modelsSize = (long)tree->nodeCount * engine->categories * engine->characters * engine->characters;
+    cl_ulong maxAllocBytes = 0;
+    err = clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAllocBytes, NULL);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    if ((double)partialsSize * engine->storageBytes > maxAllocBytes ||
+        (double)modelsSize * engine->storageBytes > maxAllocBytes)
+        return Fail(engine, ENGINE_ERROR_OUT_OF_MEMORY, CL_INVALID_BUFFER_SIZE);
+
+    // staging holds the largest of the tips and the root in the device
+    // layout and every model; zeroed so padding goes up as zeros
+    long tipValues = LayoutNodeOffset(&layout, tree, tree->tipCount, engine->sites, engine->categories);
+    long rootValues = partialsSize - LayoutNodeOffset(&layout, tree, tree->root, engine->sites, engine->categories);
+    long stagingValues = (tipValues > modelsSize) ? tipValues : modelsSize;
+    if (rootValues > stagingValues) stagingValues = rootValues;
+    engine->staging = calloc(stagingValues, engine->storageBytes);
+    if (!engine->staging) return Fail(engine, ENGINE_ERROR_OUT_OF_MEMORY, CL_OUT_OF_HOST_MEMORY);
+
+    engine->context = clCreateContext(0, 1, &engine->device, NULL, NULL, &err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    engine->eventHook = options->eventHook;
+    engine->eventUser = options->eventUser;
+    engine->queue = clCreateCommandQueue(engine->context, engine->device,
+                                         engine->eventHook ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+
+    char defaultCache[PROGRAM_CACHE_PATH_LENGTH];
+    const char* cacheDirectory = options->programCache;
+    if (cacheDirectory == ENGINE_DEFAULT_CACHE)
+        cacheDirectory = DefaultProgramCacheDirectory(defaultCache, sizeof(defaultCache)) ? defaultCache : NULL;
+    engine->program = BuildKernelProgram(engine->context, engine->device, &engine->config, cacheDirectory,
+                                         &engine->cacheLoaded, &engine->cacheStored, NULL, &err);
+    if (!engine->program) return Fail(engine, (err == CL_BUILD_PROGRAM_FAILURE) ? ENGINE_ERROR_BUILD
+                                                                                : ENGINE_ERROR_OPENCL, err);
+    engine->kernel = clCreateKernel(engine->program, "FirstLoop", &err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    engine->rootLikelihood = clCreateKernel(engine->program, "RootLikelihood", &err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    engine->sumGroups = clCreateKernel(engine->program, "SumGroups", &err);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    ConfigureReduction(engine->device, engine->sites, &engine->reduceLocalSize, &engine->reduceGroups);
+
+    // everything resident, zero-copy buffers allocated host side
+    cl_bool hostUnified = CL_FALSE;
+    if (options->zeroCopy < 0)
+        clGetDeviceInfo(engine->device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &hostUnified, NULL);
+    engine->pool = CreateBufferPool(engine->context, (options->zeroCopy < 0) ? hostUnified == CL_TRUE
+                                                                              : options->zeroCopy == 1);
+    if (!engine->pool) return Fail(engine, ENGINE_ERROR_OUT_OF_MEMORY, CL_OUT_OF_HOST_MEMORY);
+    cl_int err2;
+    engine->partials = PoolAcquire(engine->pool, CL_MEM_READ_WRITE, engine->storageBytes * partialsSize, NULL, &err);
+    engine->scalings = PoolAcquire(engine->pool, CL_MEM_READ_WRITE, sizeof(cl_int) * tree->nodeCount * engine->sites,
+                                   NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->models = PoolAcquire(engine->pool, CL_MEM_READ_ONLY, engine->storageBytes * modelsSize, NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->childStart = PoolAcquire(engine->pool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount + 1), NULL,
+                                     &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->children = PoolAcquire(engine->pool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount - 1), NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->dirtyNodes = PoolAcquire(engine->pool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount - tree->tipCount),
+                                     NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->weights = PoolAcquire(engine->pool, CL_MEM_READ_ONLY, engine->accumBytes * WeightCount(engine), NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->siteLogL = PoolAcquire(engine->pool, CL_MEM_WRITE_ONLY, engine->accumBytes * engine->sites, NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    engine->sums = PoolAcquire(engine->pool, CL_MEM_READ_WRITE, engine->accumBytes * engine->reduceGroups, NULL, &err2);
+    err = (err != CL_SUCCESS) ? err : err2;
+    if (err != CL_SUCCESS) return Fail(engine, AllocationStatus(err), err);
+
+    // the tree, and zero rescue exponents for the tips (internal nodes are
+    // written by the traversal)
+    int* zeros = (int*)calloc((size_t)tree->nodeCount * engine->sites, sizeof(int));
+    if (!zeros) return Fail(engine, ENGINE_ERROR_OUT_OF_MEMORY, CL_OUT_OF_HOST_MEMORY);
+    err = Upload(engine, engine->childStart, 0, sizeof(cl_int) * (tree->nodeCount + 1), tree->childStart,
+                 "tree schedule");
+    err |= Upload(engine, engine->children, 0, sizeof(cl_int) * (tree->nodeCount - 1), tree->children, "tree schedule");
+    err |= Upload(engine, engine->scalings, 0, sizeof(cl_int) * tree->nodeCount * engine->sites, zeros, "scalings");
+    free(zeros);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+
+    // every argument but the level offset, which each launch sets
+    int levelOffset = 0;
+    err = clSetKernelArg(engine->kernel, 0, sizeof(cl_mem), (void*)&engine->partials);
+    err |= clSetKernelArg(engine->kernel, 1, sizeof(cl_mem), (void*)&engine->models);
+    err |= clSetKernelArg(engine->kernel, 2, sizeof(cl_mem), (void*)&engine->scalings);
+    err |= clSetKernelArg(engine->kernel, 3, sizeof(cl_mem), (void*)&engine->childStart);
+    err |= clSetKernelArg(engine->kernel, 4, sizeof(cl_mem), (void*)&engine->children);
+    err |= clSetKernelArg(engine->kernel, 5, sizeof(cl_mem), (void*)&engine->dirtyNodes);
+    err |= clSetKernelArg(engine->kernel, 6, engine->config.modelTileSize * engine->storageBytes, NULL);
+    err |= clSetKernelArg(engine->kernel, 7, engine->config.siteTileSize * engine->accumBytes, NULL);
+    err |= clSetKernelArg(engine->kernel, 8, sizeof(cl_int), (void*)&levelOffset);
+    err |= clSetKernelArg(engine->kernel, 9, sizeof(cl_int), (void*)&engine->sites);
+    err |= clSetKernelArg(engine->kernel, 10, sizeof(cl_int), (void*)&engine->characters);
+    err |= clSetKernelArg(engine->kernel, 11, engine->accumBytes, (void*)engine->uflowThresh);
+    err |= clSetKernelArg(engine->kernel, 12, sizeof(cl_int), (void*)&tree->tipCount);
+
+    // and of the reduction, all but writeSites
+    err |= clSetKernelArg(engine->rootLikelihood, 0, sizeof(cl_mem), (void*)&engine->partials);
+    err |= clSetKernelArg(engine->rootLikelihood, 1, sizeof(cl_mem), (void*)&engine->scalings);
+    err |= clSetKernelArg(engine->rootLikelihood, 2, sizeof(cl_mem), (void*)&engine->weights);
+    err |= clSetKernelArg(engine->rootLikelihood, 3, sizeof(cl_mem), (void*)&engine->siteLogL);
+    err |= clSetKernelArg(engine->rootLikelihood, 4, sizeof(cl_mem), (void*)&engine->sums);
+    err |= clSetKernelArg(engine->rootLikelihood, 5, engine->reduceLocalSize * engine->accumBytes, NULL);
+    err |= clSetKernelArg(engine->rootLikelihood, 6, sizeof(cl_int), (void*)&tree->root);
+    err |= clSetKernelArg(engine->rootLikelihood, 7, sizeof(cl_int), (void*)&engine->sites);
+    err |= clSetKernelArg(engine->rootLikelihood, 8, sizeof(cl_int), (void*)&engine->characters);
+    err |= clSetKernelArg(engine->rootLikelihood, 9, sizeof(cl_int), (void*)&tree->tipCount);
+    int groups = (int)engine->reduceGroups;
+    err |= clSetKernelArg(engine->sumGroups, 0, sizeof(cl_mem), (void*)&engine->sums);
+    err |= clSetKernelArg(engine->sumGroups, 1, engine->reduceLocalSize * engine->accumBytes, NULL);
+    err |= clSetKernelArg(engine->sumGroups, 2, sizeof(cl_int), (void*)&groups);
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineCreate(const EngineOptions* options, const Tree* tree, int sites, int characters, int categories,
+                          Engine** engine, cl_int* error)
+{
+    if (error) *error = CL_SUCCESS;
+    if (!engine) return ENGINE_ERROR_ARGUMENT;
+    *engine = NULL;
+    if (!options || !tree || tree->nodeCount < 2 || sites <= 0 || characters <= 0 || categories < 1 ||
+        options->sitesPerGroup <= 0 || options->unroll <= 0 || options->precision < PRECISION_DOUBLE || options->precision > PRECISION_MIXED ||
+        options->layout < LAYOUT_PACKED || options->layout > LAYOUT_STATE_MAJOR)
+        return ENGINE_ERROR_ARGUMENT;
+
+    Engine* created = (Engine*)calloc(1, sizeof(Engine));
+    if (!created)
+    {
+        if (error) *error = CL_OUT_OF_HOST_MEMORY;
+        return ENGINE_ERROR_OUT_OF_MEMORY;
+    }
+    created->tree = tree;
+    created->sites = sites;
+    created->characters = characters;
+    created->categories = categories;
+    created->storageBytes = PrecisionStorageBytes(options->precision);
+    created->accumBytes = PrecisionAccumBytes(options->precision);
+    fpoint thresh = (created->storageBytes < sizeof(cl_double)) ? (fpoint)SINGLE_UFLOW_THRESH
+                                                                : (fpoint)DOUBLE_UFLOW_THRESH;
+    StoreDeviceValues(created->uflowThresh, &thresh, 1, created->accumBytes);
+
+    created->root = (fpoint*)malloc(sizeof(fpoint) * sites * categories * characters);
+    created->rootScalings = (int*)malloc(sizeof(int) * sites);
+    created->uploadedWeights = (double*)malloc(sizeof(double) * ((long)categories + characters + sites));
+    created->newWeights = (double*)malloc(sizeof(double) * ((long)categories + characters + sites));
+    created->weightValues = malloc(sizeof(cl_double) * ((long)categories + characters + sites));
+    created->siteValues = malloc(sizeof(cl_double) * sites);
+    created->dirty = (bool*)calloc(tree->nodeCount, sizeof(bool));
+    created->dirtyStart = (int*)malloc(sizeof(int) * (tree->levelCount + 1));
+    created->dirtySchedule = (int*)malloc(sizeof(int) * (tree->nodeCount - tree->tipCount));
+    created->modelSet = (bool*)calloc(tree->nodeCount, sizeof(bool));
+    created->modelsMissing = tree->nodeCount - 1;   // the root has no branch above it
+    EngineStatus status = ENGINE_ERROR_OUT_OF_MEMORY;
+    if (created->root && created->rootScalings && created->uploadedWeights && created->newWeights &&
+        created->weightValues && created->siteValues && created->dirty && created->dirtyStart &&
+        created->dirtySchedule && created->modelSet)
+        status = CreateDeviceObjects(created, options);
+    if (status != ENGINE_SUCCESS)
+    {
+        if (error) *error = (status == ENGINE_ERROR_OUT_OF_MEMORY && created->lastError == CL_SUCCESS)
+                            ? CL_OUT_OF_HOST_MEMORY : created->lastError;
+        EngineFree(created);
+        return status;
+    }
+    *engine = created;
+    return ENGINE_SUCCESS;
+}
+
+void EngineFree(Engine* engine)
+{
+    if (!engine) return;
+    if (engine->kernel) clReleaseKernel(engine->kernel);
+    if (engine->rootLikelihood) clReleaseKernel(engine->rootLikelihood);
+    if (engine->sumGroups) clReleaseKernel(engine->sumGroups);
+    if (engine->program) clReleaseProgram(engine->program);
+    if (engine->queue) clReleaseCommandQueue(engine->queue);
+    FreeBufferPool(engine->pool);
+    if (engine->context) clReleaseContext(engine->context);
+    free(engine->staging);
+    free(engine->root);
+    free(engine->rootScalings);
+    free(engine->uploadedWeights);
+    free(engine->newWeights);
+    free(engine->weightValues);
+    free(engine->siteValues);
+    free(engine->dirty);
+    free(engine->dirtyStart);
+    free(engine->dirtySchedule);
+    free(engine->modelSet);
+    free(engine);
+}
+
+EngineStatus EngineSetTips(Engine* engine, const fpoint* tips)
+{
+    if (!engine || !tips) return ENGINE_ERROR_ARGUMENT;
+    const Tree* tree = engine->tree;
+    const PartialsLayout* layout = &engine->config.layout;
+    long count = LayoutNodeOffset(layout, tree, tree->tipCount, engine->sites, engine->categories);
+    const void* values = tips;
+    if (Converts(engine))
+    {
+        StoreDevicePartials(engine->staging, tips, tree, 0, tree->tipCount, engine->sites, engine->categories, layout,
+                            engine->storageBytes);
+        values = engine->staging;
+    }
+    cl_int err = Upload(engine, engine->partials, 0, engine->storageBytes * count, values, "tip partials");
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+    engine->tipsSet = true;
+    MarkAllDirty(engine);
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineSetModels(Engine* engine, const int* nodes, int count, const fpoint* models)
+{
+    if (!engine || !models || count < 0 || count > engine->tree->nodeCount) return ENGINE_ERROR_ARGUMENT;
+    const Tree* tree = engine->tree;
+    long modelSize = (long)engine->categories * engine->characters * engine->characters;
+    int i;
+    for (i = 0; nodes && i < count; i++)
+        if (nodes[i] < 0 || nodes[i] >= tree->nodeCount) return ENGINE_ERROR_ARGUMENT;
+
+    const void* values = models;
+    if (engine->storageBytes != sizeof(fpoint))
+    {
+        StoreDeviceValues(engine->staging, models, count * modelSize, engine->storageBytes);
+        values = engine->staging;
+    }
+    size_t modelBytes = engine->storageBytes * modelSize;
+    cl_int err = CL_SUCCESS;
+    if (!nodes) err = Upload(engine, engine->models, 0, modelBytes * count, values, "models");
+    for (i = 0; nodes && i < count && err == CL_SUCCESS; i++)
+        err = Upload(engine, engine->models, modelBytes * nodes[i], modelBytes, (const char*)values + modelBytes * i,
+                     "branch model");
+    if (err != CL_SUCCESS) return Fail(engine, ENGINE_ERROR_OPENCL, err);
+
+    for (i = 0; i < count; i++)
+    {
+        int node = nodes ? nodes[i] : i;
+        if (!engine->modelSet[node] && node != tree->root) engine->modelsMissing--;
+        engine->modelSet[node] = true;
+        MarkPathDirty(tree, node, engine->dirty);
+    }
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineInvalidate(Engine* engine)
+{
+    if (!engine) return ENGINE_ERROR_ARGUMENT;
+    MarkAllDirty(engine);
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineEvaluate(Engine* engine)
+{
+    if (!engine) return ENGINE_ERROR_ARGUMENT;
+    if (!engine->tipsSet || engine->modelsMissing > 0) return ENGINE_ERROR_NOT_READY;
+    const Tree* tree = engine->tree;
+
+    // one launch per level of the stale nodes, as in the driver's
+    // incremental evaluations; new tips make that every internal node
+    int scheduled = DirtyLevelSchedule(tree, engine->dirty, engine->dirtyStart, engine->dirtySchedule);
+    cl_int err = CL_SUCCESS;
+    if (scheduled)
+        err = Upload(engine, engine->dirtyNodes, 0, sizeof(cl_int) * scheduled, engine->dirtySchedule, "dirty schedule");
+    size_t globalWorkSize[2], localWorkSize[2] = { engine->config.localWorkSize, 1 };
+    int siteGroups = (engine->sites + engine->config.sitesPerGroup - 1) / engine->config.sitesPerGroup;
+    globalWorkSize[0] = siteGroups * localWorkSize[0];
+    char levelLabel[32];
+    int level;
+    for (level = 0; level < tree->levelCount && err == CL_SUCCESS; level++)
+    {
+        int levelOffset = engine->dirtyStart[level];
+        globalWorkSize[1] = engine->dirtyStart[level+1] - levelOffset;
+        if (globalWorkSize[1] == 0) continue;
+        err = clSetKernelArg(engine->kernel, 8, sizeof(cl_int), (void*)&levelOffset);
+        snprintf(levelLabel, sizeof(levelLabel), "level %d", level + 1);
+        if (err == CL_SUCCESS)
+            err = clEnqueueNDRangeKernel(engine->queue, engine->kernel, 2, NULL, globalWorkSize, localWorkSize, 0, NULL,
+                                         Event(engine, ENGINE_COMMAND_KERNEL, levelLabel, 0,
+                                               engine->dirtySchedule + levelOffset, (int)globalWorkSize[1]));
+    }
+
+    // everything done (the root stays on the device until asked for)
+    if (err == CL_SUCCESS) err = clFinish(engine->queue);
+    if (err != CL_SUCCESS)
+    {
+        // nothing on the device can be trusted to be current any more
+        MarkAllDirty(engine);
+        engine->evaluated = false;
+        return Fail(engine, AllocationStatus(err), err);
+    }
+    engine->evaluated = true;
+    engine->rootRead = false;
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineRootPartials(Engine* engine, fpoint* partials, int* scalings)
+{
+    if (!engine) return ENGINE_ERROR_ARGUMENT;
+    if (!engine->evaluated) return ENGINE_ERROR_NOT_READY;
+    const Tree* tree = engine->tree;
+    if (!engine->rootRead)
+    {
+        // blocking reads of the root, converted from the device layout
+        const PartialsLayout* layout = &engine->config.layout;
+        long rootOffset = LayoutNodeOffset(layout, tree, tree->root, engine->sites, engine->categories);
+        long rootValues = LayoutSize(layout, tree, engine->sites, engine->categories) - rootOffset;
+        void* rootStorage = Converts(engine) ? engine->staging : (void*)engine->root;
+        cl_int err = Download(engine, engine->partials, engine->storageBytes * rootOffset,
+                              engine->storageBytes * rootValues, rootStorage, "root partials");
+        if (err == CL_SUCCESS)
+            err = Download(engine, engine->scalings, sizeof(cl_int) * tree->root * engine->sites,
+                           sizeof(cl_int) * engine->sites, engine->rootScalings, "root scalings");
+        if (err != CL_SUCCESS) return Fail(engine, AllocationStatus(err), err);
+        LoadDevicePartials(engine->root, rootStorage, tree, tree->root, tree->nodeCount, engine->sites,
+                           engine->categories, layout, engine->storageBytes);
+        engine->rootRead = true;
+    }
+    if (partials) memcpy(partials, engine->root, sizeof(fpoint) * engine->sites * engine->categories * engine->characters);
+    if (scalings) memcpy(scalings, engine->rootScalings, sizeof(int) * engine->sites);
+    return ENGINE_SUCCESS;
+}
+
+EngineStatus EngineLogLikelihood(Engine* engine, const double* categoryWeights, const double* frequencies,
+                                 const double* siteWeights, double* logLikelihood, double* siteLogL)
+{
+    if (!engine || !logLikelihood) return ENGINE_ERROR_ARGUMENT;
+    if (!engine->evaluated) return ENGINE_ERROR_NOT_READY;
+    int characters = engine->characters, categories = engine->categories;
+
+    // the weights, uploaded only when they differ from the last ones
+    long count = WeightCount(engine);
+    double* weights = engine->newWeights;
+    long i;
+    for (i = 0; i < categories; i++) weights[i] = categoryWeights ? categoryWeights[i] : 1. / categories;
+    for (i = 0; i < characters; i++) weights[categories + i] = frequencies ? frequencies[i] : 1. / characters;
+    for (i = 0; i < engine->sites; i++) weights[categories + characters + i] = siteWeights ? siteWeights[i] : 1.;
+    cl_int err = CL_SUCCESS;
+    if (!engine->weightsSet || memcmp(weights, engine->uploadedWeights, sizeof(double) * count) != 0)
+    {
+        StoreDeviceDoubles(engine->weightValues, weights, count, engine->accumBytes);
+        err = Upload(engine, engine->weights, 0, engine->accumBytes * count, engine->weightValues,
+                     "likelihood weights");
+        memcpy(engine->uploadedWeights, weights, sizeof(double) * count);
+        engine->weightsSet = (err == CL_SUCCESS);
+    }
+
+    // one value per group, then their sum; only it (and the per-site
+    // values when asked for) comes back
+    int writeSites = siteLogL ? 1 : 0;
+    size_t localSize = engine->reduceLocalSize, globalSize = engine->reduceGroups * localSize;
+    if (err == CL_SUCCESS) err = clSetKernelArg(engine->rootLikelihood, 10, sizeof(cl_int), (void*)&writeSites);
+    if (err == CL_SUCCESS)
+        err = clEnqueueNDRangeKernel(engine->queue, engine->rootLikelihood, 1, NULL, &globalSize, &localSize, 0, NULL,
+                                     Event(engine, ENGINE_COMMAND_KERNEL, "root likelihood", 0, NULL, 0));
+    if (err == CL_SUCCESS)
+        err = clEnqueueNDRangeKernel(engine->queue, engine->sumGroups, 1, NULL, &localSize, &localSize, 0, NULL,
+                                     Event(engine, ENGINE_COMMAND_KERNEL, "likelihood sum", 0, NULL, 0));
+    cl_double total[1];
+    if (err == CL_SUCCESS) err = Download(engine, engine->sums, 0, engine->accumBytes, total, "log likelihood");
+    if (err == CL_SUCCESS && siteLogL)
+        err = Download(engine, engine->siteLogL, 0, engine->accumBytes * engine->sites, engine->siteValues,
+                       "site log likelihoods");
+    if (err != CL_SUCCESS) return Fail(engine, AllocationStatus(err), err);
+    LoadDeviceDoubles(logLikelihood, total, 1, engine->accumBytes);
+    if (siteLogL) LoadDeviceDoubles(siteLogL, engine->siteValues, engine->sites, engine->accumBytes);
+    return ENGINE_SUCCESS;
+}
+
+cl_device_id EngineDevice(const Engine* engine)
+{
+    return engine ? engine->device : NULL;
+}
+
+void EngineProgramCache(const Engine* engine, CacheStatus* loaded, CacheStatus* stored)
+{
+    if (loaded) *loaded = engine ? engine->cacheLoaded : CACHE_OFF;
+    if (stored) *stored = engine ? engine->cacheStored : CACHE_OFF;
+}
+
+cl_int EngineLastError(const Engine* engine)
+{
+    return engine ? engine->lastError : CL_INVALID_VALUE;
+}
+
+const char* EngineStatusString(EngineStatus status)
+{
+    switch (status)
+    {
+        case ENGINE_SUCCESS:                return "success";
+        case ENGINE_ERROR_ARGUMENT:         return "invalid argument";
+        case ENGINE_ERROR_NO_DEVICE:        return "no matching OpenCL device";
+        case ENGINE_ERROR_DEVICE_LIMITS:    return "work group or local memory beyond the device's limits";
+        case ENGINE_ERROR_OUT_OF_MEMORY:    return "out of host or device memory";
+        case ENGINE_ERROR_BUILD:            return "kernel build failed";
+        case ENGINE_ERROR_OPENCL:           return "OpenCL error";
+        case ENGINE_ERROR_NOT_READY:        return "tips or branch models not set, or not evaluated yet";
+    }
+    return "unknown status";
+}
@@ -0,0 +1,153 @@
+// *********************************************************************
+// oclEngine: the device pruning engine as a library
+//
+// An Engine owns everything repeated likelihood evaluations of one tree
+// need on one device: context, queue, program, kernel, and resident
+// buffers for the tips, branch models, partials and scalings.  Creating
+// it pays for device setup and the program build (a program cache load
+// when possible) once; after that each evaluation only uploads what
+// changed, re-prunes the stale paths to the root and reduces the root to
+// its log-likelihood on the device:
+//
+//   EngineCreate(&options, tree, sites, characters, categories, &engine, NULL);
+//   EngineSetTips(engine, tips);
+//   EngineSetModels(engine, NULL, tree->nodeCount, models);
+//   for (...)
+//   {
+//       EngineSetModels(engine, &branch, 1, branchModels);
+//       EngineEvaluate(engine);
+//       EngineLogLikelihood(engine, rateWeights, NULL, patternWeights, &logL, NULL);
+//   }
+//   EngineFree(engine);
+//
+// Layouts are the driver's (oclFirstLoop.h): tips [tip][site][character],
+// models [node][category][parent][child], root partials
+// [site][category][character] with one binary rescue exponent per site.
+//
+// No engine call prints or exits.  Every one returns ENGINE_SUCCESS or a
+// negative EngineStatus, and EngineLastError keeps the OpenCL error code
+// behind the last failure of an engine; what the program cache did, which
+// never fails a create, is left to EngineProgramCache.  Engines share no state, so
+// several can run at once on different threads, on one device or many;
+// a single engine must not be used by two threads at a time.
+// *********************************************************************
+
+#ifndef OCLENGINE_H
+#define OCLENGINE_H
+
+#include "oclFirstLoop.h"
+#include "oclPrecision.h"
+#include "oclLayout.h"
+#include "oclProgramCache.h"
+
+enum EngineStatus
+{
+    ENGINE_SUCCESS              =  0,
+    ENGINE_ERROR_ARGUMENT       = -1,   // invalid dimensions, node or NULL pointer
+    ENGINE_ERROR_NO_DEVICE      = -2,   // no device matches the options
+    ENGINE_ERROR_DEVICE_LIMITS  = -3,   // the work group or its local memory does not fit the device
+    ENGINE_ERROR_OUT_OF_MEMORY  = -4,   // host or device allocation failed
+    ENGINE_ERROR_BUILD          = -5,   // the kernel did not build
+    ENGINE_ERROR_OPENCL         = -6,   // any other OpenCL call failed
+    ENGINE_ERROR_NOT_READY      = -7    // evaluated before tips and every model were set
+};
+
+// What an enqueued command does, for EngineOptions.eventHook
+enum EngineCommand
+{
+    ENGINE_COMMAND_WRITE = 0,
+    ENGINE_COMMAND_KERNEL,
+    ENGINE_COMMAND_READ
+};
+
+// Called before each command an engine enqueues with its name (the buffer,
+// or the launch and its level), the bytes it moves and the tree nodes a
+// traversal launch computes; the event slot returned (NULL for none)
+// receives the command's event, as from ProfileEvent (oclProfile.h).
+// EngineEvaluate, EngineRootPartials and EngineLogLikelihood return with
+// every command enqueued so far complete.
+typedef cl_event* (*EngineEventHook)(void* user, EngineCommand command, const char* label, size_t bytes,
+                                     const int* nodes, int nodeCount);
+
+struct EngineOptions
+{
+    int             platformIndex;  // -1: every platform in turn
+    cl_device_type  deviceType;     // 0: a GPU if there is one, any device otherwise
+    int             deviceIndex;    // among the devices found
+    DevicePrecision precision;
+    int             sitesPerGroup;
+    size_t          localWorkSize;  // work items per group, 0 for the narrowest (see KernelTuning)
+    int             unroll;
+    LayoutKind      layout;         // partials on the device; the calls below always take the host's
+    const char*     programCache;   // directory of built program binaries, NULL to always build,
+                                    // ENGINE_DEFAULT_CACHE for the user's (DefaultProgramCacheDirectory)
+    int             zeroCopy;       // mapped transfers (oclMemory.h): 1, 0, -1 when the device shares host memory
+    EngineEventHook eventHook;      // NULL, or every command's event with timestamps on
+    void*           eventUser;      // the hook's first argument
+};
+
+// The programCache that stands for the user's cache directory, resolved
+// by each EngineCreate on its own; compared by address, not contents
+extern const char engineDefaultCache[];
+#define ENGINE_DEFAULT_CACHE    engineDefaultCache
+
+struct Engine;
+
+// Device 0 of the default type, fpoint precision, 8 sites per group in the
+// narrowest work groups with the default unroll, the padded layout, the
+// default program cache, zero-copy when the device shares host memory and
+// no event hook
+void EngineDefaultOptions(EngineOptions* options);
+
+// An engine for sites x characters over tree with categories rate
+// categories per node.  tree is used, not copied: it must outlive the
+// engine and keep its topology (branch lengths are not read).  There is
+// no engine to ask EngineLastError after a failed create, so the OpenCL
+// error behind it goes to *error instead (CL_SUCCESS for a bad argument
+// or no device; error may be NULL).
+EngineStatus EngineCreate(const EngineOptions* options, const Tree* tree, int sites, int characters, int categories,
+                          Engine** engine, cl_int* error);
+void EngineFree(Engine* engine);
+
+// Tip partials for every tip; every internal node becomes stale
+EngineStatus EngineSetTips(Engine* engine, const fpoint* tips);
+
+// count nodes' branch models, categories x characters x characters values
+// each, in the order of nodes (NULL: nodes 0 .. count-1); the paths from
+// them to the root become stale
+EngineStatus EngineSetModels(Engine* engine, const int* nodes, int count, const fpoint* models);
+
+// Every internal node stale, so the next evaluation re-prunes the whole
+// tree (as after new tips, without uploading them)
+EngineStatus EngineInvalidate(Engine* engine);
+
+// Re-prune the stale nodes; the root stays on the device
+EngineStatus EngineEvaluate(Engine* engine);
+
+// The root of the last evaluation, read back on the first call after it;
+// either may be NULL
+EngineStatus EngineRootPartials(Engine* engine, fpoint* partials, int* scalings);
+
+// Sum over sites of siteWeights[site] * log(sum_k categoryWeights[k]
+// sum_c frequencies[c] root[site][k][c]), rescue undone, after the last
+// evaluation.  NULL weights count each site once and the categories
+// equally, NULL frequencies are uniform; per-site values go to siteLogL
+// when it is not NULL.  It is reduced on the device: only the total
+// (and the per-site values when asked for) comes back, and the weights
+// only go up when they change.
+EngineStatus EngineLogLikelihood(Engine* engine, const double* categoryWeights, const double* frequencies,
+                                 const double* siteWeights, double* logLikelihood, double* siteLogL);
+
+// The device the engine runs on, and the OpenCL error behind its last
+// ENGINE_ERROR_* (CL_SUCCESS when there is none)
+cl_device_id EngineDevice(const Engine* engine);
+cl_int EngineLastError(const Engine* engine);
+
+// Whether the engine's program was loaded from the cache (*loaded
+// CACHE_SUCCESS) and, when it was built from source instead, whether its
+// binary was stored; either may be NULL
+void EngineProgramCache(const Engine* engine, CacheStatus* loaded, CacheStatus* stored);
+
+const char* EngineStatusString(EngineStatus status);
+
+#endif
@@ -4,6 +4,86 @@
 // Runs computations with OpenCL on the GPU device and then checks results 
 // against basic host CPU/C++ computation.
 // 
+// The computation is Felsenstein pruning over a rooted tree: a Newick file
+// given with --tree=<file> (or a balanced default tree), traversed level by
+// level on the device and in post-order on the host.  The host engine
+// runs on --threads=N workers (all cores by default).
+//
+// Problem size is set at runtime with --sites=N, --characters=N and
+// --nodes=N (default tree only).  4, 20 and 61 states (nucleotides, amino
+// acids, codons) build specialized kernels on both the device and the host.
+// Each device work group sweeps --sites-per-group=N sites (default 8)
+// through a branch model held in local memory.
+// Identical alignment columns are pruned once and weighted in the
+// log-likelihood (--no-patterns turns that off).
+//
+// Tips come from --alignment=<FASTA or PHYLIP file> (matched to the tips of
+// --tree by name, or to a balanced tree in file order); without one they
+// are dummy values.  Branch models are P(t) from a substitution model
+// (--kappa, --omega) at each branch length, one per rate category of a
+// discrete gamma (--categories=K, default 1, shape --alpha).  Every node
+// carries all categories; one launch per level computes them together and
+// they are mixed at the root.
+//
+// After the full traversal, --updates=N single-branch evaluations (default
+// one per branch, 0 for none) re-prune only the stale path to the root,
+// with every other partial left resident on the device.
+//
+// Each backend (device, host reference, host engine, incremental device
+// evaluations) is timed in nanoseconds over --repeat=N runs after
+// --warmup=N untimed ones and reported with GFLOP/s and bytes/s;
+// --json=<file> appends the results as one JSON line.  "make benchmark"
+// sweeps sites, characters and nodes this way.
+//
+// --profile times every transfer and launch with OpenCL events and prints
+// totals per operation, buffer, level and node; --profile=<file> also
+// writes a Chrome trace of them.
+//
+// --chunk-sites=N streams the sites through the device N at a time with
+// uploads, kernels and downloads of consecutive chunks overlapping on
+// three queues; it is switched on by itself when the alignment does not
+// fit in device memory.
+//
+// On devices that share host memory the buffers wrap the (page-aligned)
+// host arrays and transfers become map/unmap; --zero-copy=on|off
+// overrides the choice.
+//
+// The device is a GPU when there is one and any OpenCL device otherwise;
+// --platform=N, --device-type=gpu|cpu|accelerator|all and --device=N pick
+// another (--list-devices shows them).  --all-devices splits the sites
+// across every matching device in proportion to their measured speed.
+//
+// Built program binaries are cached per device, driver, build options and
+// source in --kernel-cache=<dir> (default ~/.cache/oclFirstLoop, "off" to
+// always build from source), so later runs skip the compiler.
+//
+// --precision=double|single|mixed builds the device kernel in double,
+// float, or float storage with double arithmetic (see oclPrecision.h);
+// the device is checked against the host with ULP and relative-error
+// tolerances (--tolerance-ulp=N, --tolerance-relative=X override them).
+//
+// Device partials are --layout=packed (the host's), padded (site rows
+// padded to cache lines) or state (state-major, sites innermost; only
+// with every site resident on one device); see oclLayout.h.  By default
+// a short engine benchmark of each on the device picks the fastest.
+//
+// With every site resident on one device the run goes through a library
+// engine (oclEngine.h), which reduces the root to its log-likelihood
+// there, and each evaluation brings back one value
+// (--site-likelihoods: also the per-site values); streamed and split runs
+// bring the root rows back and sum them on the host.
+//
+// The launch shape, the work group size (--work-group-size=N, a power of
+// two of at least the characters), --sites-per-group and the unroll factor
+// of the specialized kernels (--unroll=N), comes from the device's tuning
+// profile unless given, along with the layout when that is left to the
+// driver.  --tune benchmarks candidates of each on the device for this
+// state count and stores the fastest in the profile, next to the cached
+// binaries (see oclTuning.h); --tune=off ignores the profile.
+//
+// The device engine is also a library (liboclFirstLoop.a, see
+// oclEngine.h); --engine-instances=N runs N engines of it concurrently,
+// one per thread, and checks each against the host like the driver.
 //
 // *********************************************************************
 
@@ -13,59 +93,162 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
+#include <pthread.h>
 
-//struct timespec begin;
-//struct timespec end;
-
-#if defined(__APPLE__)
-#include <OpenCL/OpenCL.h>
-typedef float fpoint;
-typedef cl_float clfp;
-#define FLOATPREC "typedef float fpoint; \n"
-#else
-#include <oclUtils.h>
-typedef double fpoint;
-typedef cl_double clfp;
-#define FLOATPREC "typedef double fpoint; \n"
-#endif
-
-// Constants
-//**********************************************************************
-#define SITES           1000    //originally 1000
-#define CHARACTERS      61      //originally 61 (codons)
-#define NODES           150        //originally 100
+#include "oclFirstLoop.h"
+#include "hostThreads.h"
+#include "oclPatterns.h"
+#include "oclAlignment.h"
+#include "oclModel.h"
+#include "oclBenchmark.h"
+#include "oclProfile.h"
+#include "oclMemory.h"
+#include "oclDevices.h"
+#include "oclProgramCache.h"
+#include "oclPrecision.h"
+#include "oclKernel.h"
+#include "oclEngine.h"
+#include "oclLayout.h"
+#include "oclTuning.h"
 
+// Problem dimensions
+//**********************************************************************
+int siteCount       = DEFAULT_SITES;
+int characterCount  = DEFAULT_CHARACTERS;
+int patternCount;                       // distinct columns actually pruned
+bool compressPatterns = true;           // --no-patterns prunes every column
+int nodeCount       = DEFAULT_NODES;    // branches in the default tree
+int sitesPerGroup   = 8;                // sites sharing one staged model on the device
+size_t workGroupSize = 0;               // work items per group, 0 = the characters rounded up to a power of two
+int unrollFactor    = DEFAULT_UNROLL;   // of the inner loop of the specialized kernels
+bool launchShapeSet = false;            // any of the three given: the tuning profile is not consulted
+int tuneMode        = 0;                // 1 = --tune benchmarks and stores, -1 = --tune=off ignores the profile
+int charTile        = 0;                // child characters of the model staged per pass
+int chunkSites      = 0;                // sites per streamed chunk, 0 = whole alignment resident
+int updateCount     = -1;               // single-branch evaluations after the full one (-1 = every branch once)
+int categoryCount   = 1;                // rate categories carried by every internal node
 
 // Scaling elements
 //**********************************************************************
-fpoint uflowThresh     = 0.00000000000000000000000000000000000000000000000000000001;
-fpoint scalar          = 100.0;
-void* scalings;
-cl_mem cmScalings;
-
-// Name of the file with the source code for the computation kernel
-// *********************************************************************
-//const char* cSourceFile = "oclFirstLoop.cl";
+fpoint uflowThresh     = DOUBLE_UFLOW_THRESH;
+void* scalings;                 // one binary rescue exponent per node and site
 
 // Host buffers for demo
 // *********************************************************************
 void* Golden;                   // Host buffer for host golden processing cross check
-void    *node_cache, *parent_cache, *model;
+void* GoldenScalings;           // Host rescue exponents for the golden run
+void    *partials, *models;     // one partial buffer and one branch model per node
+void    *devicePartials, *deviceModels; // both in the device's storage type (partials / models when that is fpoint)
+Tree* tree;                     // tree driving the pruning traversal
+Alignment* alignment;           // mapped alignment supplying the tips, if any
+SubstitutionModel* substitutionModel;   // decomposed rate matrix
+MatrixCache* matrixCache;       // branch transition matrices by (length, rate category)
+double kappa = DEFAULT_KAPPA;   // --kappa
+double omega = DEFAULT_OMEGA;   // --omega
+double alpha = DEFAULT_ALPHA;   // --alpha: gamma shape of the rate categories
+SitePatterns* sitePatterns;     // column -> pattern map and pattern weights
+HostThreadPool* hostPool;       // workers for the host engine
+
+// Benchmarking
+//**********************************************************************
+int benchWarmup     = 0;                // --warmup: untimed runs per backend
+int benchRepeat     = 1;                // --repeat: timed runs per backend
+const char* benchJson = NULL;           // --json: file the results are appended to
+long long* benchSamples;                // one sample per timed run or incremental evaluation
+BenchmarkResult benchResults[4];        // device, host reference, host engine, device incremental
+int benchResultCount;
+bool profileDevice = false;             // --profile: event timings for every command
+const char* profileTrace = NULL;        // --profile=<file>: also write a Chrome trace
+DeviceProfiler* profiler;               // NULL unless profiling
 
 // OpenCL Vars
 cl_context cxGPUContext;        // OpenCL context
 cl_command_queue cqCommandQueue;// OpenCL command que
-cl_platform_id cpPlatform;      // OpenCL platform
 cl_device_id cdDevice;          // OpenCL device
 cl_program cpProgram;           // OpenCL program
 cl_kernel ckKernel;             // OpenCL kernel
-cl_mem cmNode_cache;            // OpenCL device source for node_cache
-cl_mem cmParent_cache;          // OpenCL device source for parent_cache
-cl_mem cmModel;                 // OpenCL device source for model
-size_t szGlobalWorkSize;        // 1D var for Total # of work items
-size_t szLocalWorkSize;         // 1D var for # of work items in the work group 
-size_t localMemorySize;         // size of local memory buffer for kernel scratch
+cl_mem cmModels;                // OpenCL device source for models
+cl_mem cmChildStart;            // OpenCL device copy of tree->childStart
+cl_mem cmChildren;              // OpenCL device copy of tree->children
+cl_mem cmLevelNodes;            // OpenCL device copy of tree->levelNodes
+BufferPool* bufferPool;         // every device buffer, zero-copy on shared-memory devices
+int zeroCopyMode = -1;          // --zero-copy=on|off, -1 = when the device shares host memory
+int platformIndex = -1;         // --platform: every platform in turn by default
+cl_device_type deviceType = 0;  // --device-type: a GPU if there is one, anything otherwise
+int deviceIndex = 0;            // --device: among the devices found
+bool splitDevices = false;      // --all-devices: split the sites across every device found
+const char* programCache = NULL;// --kernel-cache: directory of built program binaries, NULL = off
+DevicePrecision devicePrecision = FPOINT_IS_DOUBLE ? PRECISION_DOUBLE : PRECISION_SINGLE;   // --precision
+size_t storageBytes;            // one device partial or model value
+size_t accumBytes;              // one device product or sum
+cl_double deviceUflowThresh[1]; // the rescue threshold as an accum (float storage rescues earlier)
+double ulpTolerance = -1.;      // --tolerance-ulp, -1 = the precision's default
+double relativeTolerance = -1.; // --tolerance-relative, -1 = the precision's default
+int engineInstances = 0;        // --engine-instances: library engines run on threads of their own
+int layoutMode = -1;            // --layout: a LayoutKind, -1 = the fastest in a benchmark
+PartialsLayout deviceLayout;    // of devicePartials and every device partials buffer
+bool siteLikelihoods = false;   // --site-likelihoods: every reduction also reads back the per-site values
+Engine* deviceEngine;           // resident runs: pruning and the log-likelihood reduction
+double* patternWeights;         // sitePatterns->weights as the engine takes them
+cl_command_queue cqUpload;      // streaming: chunk tip uploads
+cl_command_queue cqDownload;    // streaming: chunk root downloads
+
+// One chunk in flight when streaming: every node's partials and scalings
+// for chunkSites sites, and the event of its last download, which the
+// next upload into the slot waits for
+struct StreamSlot
+{
+    cl_mem      partials;
+    cl_mem      scalings;
+    cl_event    downloaded;
+    int         zeroedSites;    // chunk width the tip scalings were last zeroed for
+};
+StreamSlot streamSlots[STREAM_SLOTS];
+
+// One device's slice of the sites when they are split across devices.
+// Share 0 runs on cdDevice and borrows its context, queue, kernel, pool
+// and tree buffers; the others own theirs.  partials and scalings hold
+// every node for the share's sites, which is also the kernel's site
+// stride.
+struct DeviceShare
+{
+    cl_device_id        device;
+    cl_context          context;
+    cl_command_queue    queue;
+    cl_program          program;
+    cl_kernel           kernel;
+    BufferPool*         pool;
+    cl_mem              models, childStart, children, levelNodes;
+    cl_mem              partials, scalings;
+    int                 firstSite, sites;
+    int                 allocatedSites;     // width of partials / scalings
+    double              throughput;         // sites per second, measured alone
+    char                name[256];
+};
+DeviceShare deviceShares[MAX_DEVICES];
+
+// One library engine run by RunEngineCheck on a thread of its own: it is
+// set up once, then evaluated benchRepeat times, each after re-setting one
+// branch model
+struct EngineCheck
+{
+    EngineOptions   options;
+    const double*   patternWeights;
+    EngineStatus    status;
+    cl_int          clError;
+    double          setupSeconds, evaluationSeconds;    // the latter per evaluation
+    double          logLikelihood;
+    fpoint*         rootPartials;
+    int*            rootScalings;
+};
+int shareCount;                 // 0 unless splitting
+size_t szGlobalWorkSize[2];     // 2D var for Total # of work items (sites x nodes in a level)
+size_t szLocalWorkSize[2];      // 2D var for # of work items in the work group
+size_t modelTileSize;           // storage values of local memory for the staged model tile
+size_t siteTileSize;            // accum values of local memory for the staged child rows
 size_t szParmDataBytes;         // Byte size of context information
 size_t szKernelLength;          // Byte size of kernel code
 cl_int ciErr1, ciErr2;          // Error code var
@@ -73,9 +256,32 @@ char* cPathAndName = NULL;      // var for full paths to data, src, etc.
 
 // Forward Declarations
 // *********************************************************************
-void FirstLoopHost(const fpoint* node_cache, const fpoint* model, fpoint* parent_cache);
 void Cleanup (int iExitCode);
-unsigned int roundUpToNextPowerOfTwo(unsigned int x);
+double RootLogLikelihood(const fpoint* rootPartials, const int* rootScalings, double* siteLogL);
+int DeviceCharTile(cl_device_id device);
+cl_program BuildProgram(cl_context context, cl_device_id device, int deviceCharTile);
+void EnqueueLevels(cl_command_queue queue, cl_kernel kernel, cl_mem levelNodes, const int* levelStart, const int* nodes,
+                   const char* label);
+bool DeviceZeroCopy();
+void SetupDriverDevice();
+void CreateDeviceEngine(const EngineOptions* deviceOptions);
+void CheckEngine(EngineStatus status, const char* call);
+void EvaluateRoot();
+double EvaluateLogLikelihood(double* siteLogL);
+bool CheckDeviceRoot(const char* label, const fpoint* rootPartials, const int* rootScalings);
+void StreamTraversal();
+void SetupDeviceShare(DeviceShare* share, cl_device_id device);
+void ResizeDeviceShare(DeviceShare* share, int firstSite, int sites);
+void EnqueueDeviceShare(DeviceShare* share);
+void BalanceDeviceShares();
+void SplitTraversal();
+void RecordBenchmark(const char* backend, int count, double flops, double bytes);
+void* RunEngineCheck(void* check);
+double TimeEngine(const EngineOptions* options, int trials, EngineStatus* status);
+LayoutKind ChooseDeviceLayout(const EngineOptions* options, bool resident);
+KernelTuning TuneKernel(const EngineOptions* options, const KernelTuning* start, double* bestSeconds);
+void LoadDeviceRoot();
+bool CheckDeviceLikelihood(const char* label, double logLikelihood, const double* siteLogL);
 //extern char* load_program_source(const char *filename, const char *argv, size_t *szKernelLength);
 
 // Main function 
@@ -83,83 +289,459 @@ unsigned int roundUpToNextPowerOfTwo(unsigned int x);
 int main(int argc, char **argv)
 {
 	
-    // time stuff:
-    time_t dtimer;
-    time_t htimer;
-	
-    // set and log Global and Local work size dimensions
-    
-    szLocalWorkSize = roundUpToNextPowerOfTwo(CHARACTERS);
-	//  szGlobalWorkSize = NODES * SITES * CHARACTERS;
-    szGlobalWorkSize = roundUpToNextPowerOfTwo(SITES) * roundUpToNextPowerOfTwo(CHARACTERS);
-    localMemorySize = roundUpToNextPowerOfTwo(CHARACTERS);
-    printf("Global Work Size \t\t= %u\nLocal Work Size \t\t= %u\n# of Work Groups \t\t= %u\n\n", 
-           szGlobalWorkSize, szLocalWorkSize, 
-           (szGlobalWorkSize % szLocalWorkSize + szGlobalWorkSize/szLocalWorkSize)); 
-	
-    // Allocate and initialize host arrays 
+    // time stuff (nanoseconds):
+    long long dtimer;
+    long long htimer;
+
+    // Read the tree (--tree=<newick file>), or fall back to a balanced tree
+    // with nodeCount branches (one tip per sequence with an alignment)
     //*************************************************
-    printf( "Allocate and Init Host Mem...\n"); 
-	
-    node_cache      = (void*)malloc (sizeof(clfp)*CHARACTERS*SITES);
-    parent_cache    = (void*)malloc (sizeof(clfp)*CHARACTERS*SITES);
-    scalings        = (void*)malloc (sizeof(int)*CHARACTERS*SITES);
-    model           = (void*)malloc (sizeof(clfp)*CHARACTERS*CHARACTERS);
-    Golden          = (void*)malloc (sizeof(clfp)*CHARACTERS*SITES);
-	
+    const char* treeFile = NULL;
+    const char* alignmentFile = NULL;
+    HostIsa hostIsa = HostDetectIsa();
+    int hostThreads = 0;            // 0 = every online core
+    bool listDevices = false;
+    char defaultCache[PROGRAM_CACHE_PATH_LENGTH];
+    const char* kernelCache = DefaultProgramCacheDirectory(defaultCache, sizeof(defaultCache)) ? defaultCache : NULL;
+    int argIndex;
+    for (argIndex = 1; argIndex < argc; argIndex++)
+    {
+        if (strncmp(argv[argIndex], "--tree=", 7) == 0) treeFile = argv[argIndex] + 7;
+        if (strncmp(argv[argIndex], "--alignment=", 12) == 0) alignmentFile = argv[argIndex] + 12;
+        if (strncmp(argv[argIndex], "--host-isa=", 11) == 0)
+        {
+            int isa = HostParseIsa(argv[argIndex] + 11);
+            if (isa < 0)
+            {
+                printf("Unknown --host-isa %s (generic, avx2 or avx512)\n", argv[argIndex] + 11);
+                Cleanup(EXIT_FAILURE);
+            }
+            hostIsa = (isa > HostDetectIsa()) ? HostDetectIsa() : (HostIsa)isa;
+        }
+        if (strncmp(argv[argIndex], "--threads=", 10) == 0) hostThreads = atoi(argv[argIndex] + 10);
+        if (strncmp(argv[argIndex], "--sites=", 8) == 0) siteCount = atoi(argv[argIndex] + 8);
+        if (strncmp(argv[argIndex], "--characters=", 13) == 0) characterCount = atoi(argv[argIndex] + 13);
+        if (strncmp(argv[argIndex], "--nodes=", 8) == 0) nodeCount = atoi(argv[argIndex] + 8);
+        if (strncmp(argv[argIndex], "--sites-per-group=", 18) == 0)
+        {
+            sitesPerGroup = atoi(argv[argIndex] + 18);
+            launchShapeSet = true;
+        }
+        if (strncmp(argv[argIndex], "--work-group-size=", 18) == 0)
+        {
+            workGroupSize = (size_t)atol(argv[argIndex] + 18);
+            launchShapeSet = true;
+        }
+        if (strncmp(argv[argIndex], "--unroll=", 9) == 0)
+        {
+            unrollFactor = atoi(argv[argIndex] + 9);
+            launchShapeSet = true;
+        }
+        if (strcmp(argv[argIndex], "--tune") == 0) tuneMode = 1;
+        if (strcmp(argv[argIndex], "--tune=off") == 0) tuneMode = -1;
+        if (strcmp(argv[argIndex], "--no-patterns") == 0) compressPatterns = false;
+        if (strncmp(argv[argIndex], "--kappa=", 8) == 0) kappa = atof(argv[argIndex] + 8);
+        if (strncmp(argv[argIndex], "--omega=", 8) == 0) omega = atof(argv[argIndex] + 8);
+        if (strncmp(argv[argIndex], "--categories=", 13) == 0) categoryCount = atoi(argv[argIndex] + 13);
+        if (strncmp(argv[argIndex], "--alpha=", 8) == 0) alpha = atof(argv[argIndex] + 8);
+        if (strcmp(argv[argIndex], "--zero-copy=on") == 0) zeroCopyMode = 1;
+        if (strcmp(argv[argIndex], "--zero-copy=off") == 0) zeroCopyMode = 0;
+        if (strncmp(argv[argIndex], "--platform=", 11) == 0) platformIndex = atoi(argv[argIndex] + 11);
+        if (strncmp(argv[argIndex], "--device-type=", 14) == 0)
+        {
+            deviceType = ParseDeviceType(argv[argIndex] + 14);
+            if (!deviceType)
+            {
+                printf("Unknown --device-type %s (gpu, cpu, accelerator or all)\n", argv[argIndex] + 14);
+                Cleanup(EXIT_FAILURE);
+            }
+        }
+        if (strncmp(argv[argIndex], "--device=", 9) == 0) deviceIndex = atoi(argv[argIndex] + 9);
+        if (strcmp(argv[argIndex], "--all-devices") == 0) splitDevices = true;
+        if (strcmp(argv[argIndex], "--list-devices") == 0) listDevices = true;
+        if (strncmp(argv[argIndex], "--kernel-cache=", 15) == 0)
+        {
+            kernelCache = argv[argIndex] + 15;
+            if (strcmp(kernelCache, "off") == 0) kernelCache = NULL;
+        }
+        if (strncmp(argv[argIndex], "--precision=", 12) == 0)
+        {
+            int precision = ParsePrecision(argv[argIndex] + 12);
+            if (precision < 0)
+            {
+                printf("Unknown --precision %s (double, single or mixed)\n", argv[argIndex] + 12);
+                Cleanup(EXIT_FAILURE);
+            }
+            devicePrecision = (DevicePrecision)precision;
+        }
+        if (strncmp(argv[argIndex], "--tolerance-ulp=", 16) == 0) ulpTolerance = atof(argv[argIndex] + 16);
+        if (strncmp(argv[argIndex], "--tolerance-relative=", 21) == 0) relativeTolerance = atof(argv[argIndex] + 21);
+        if (strncmp(argv[argIndex], "--layout=", 9) == 0)
+        {
+            layoutMode = ParseLayout(argv[argIndex] + 9);
+            if (layoutMode < 0 && strcmp(argv[argIndex] + 9, "auto") != 0)
+            {
+                printf("Unknown --layout %s (packed, padded, state or auto)\n", argv[argIndex] + 9);
+                Cleanup(EXIT_FAILURE);
+            }
+        }
+        if (strcmp(argv[argIndex], "--site-likelihoods") == 0) siteLikelihoods = true;
+        if (strncmp(argv[argIndex], "--engine-instances=", 19) == 0) engineInstances = atoi(argv[argIndex] + 19);
+        if (strncmp(argv[argIndex], "--chunk-sites=", 14) == 0) chunkSites = atoi(argv[argIndex] + 14);
+        if (strncmp(argv[argIndex], "--updates=", 10) == 0) updateCount = atoi(argv[argIndex] + 10);
+        if (strncmp(argv[argIndex], "--warmup=", 9) == 0) benchWarmup = atoi(argv[argIndex] + 9);
+        if (strncmp(argv[argIndex], "--repeat=", 9) == 0) benchRepeat = atoi(argv[argIndex] + 9);
+        if (strncmp(argv[argIndex], "--json=", 7) == 0) benchJson = argv[argIndex] + 7;
+        if (strcmp(argv[argIndex], "--profile") == 0) profileDevice = true;
+        if (strncmp(argv[argIndex], "--profile=", 10) == 0)
+        {
+            profileDevice = true;
+            profileTrace = argv[argIndex] + 10;
+        }
+    }
+    if (siteCount <= 0 || characterCount <= 0 || nodeCount < 2 || sitesPerGroup <= 0 || unrollFactor <= 0)
+    {
+        printf("Invalid dimensions: --sites, --characters, --sites-per-group and --unroll must be positive, --nodes at least 2\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (chunkSites < 0)
+    {
+        printf("Invalid --chunk-sites: must be positive (or 0 to keep every site resident)\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    programCache = kernelCache;
+    storageBytes = PrecisionStorageBytes(devicePrecision);
+    accumBytes = PrecisionAccumBytes(devicePrecision);
+    fpoint thresh = (storageBytes < sizeof(cl_double)) ? (fpoint)SINGLE_UFLOW_THRESH : uflowThresh;
+    StoreDeviceValues(deviceUflowThresh, &thresh, 1, accumBytes);
+    if (ulpTolerance < 0.) ulpTolerance = PrecisionUlpTolerance(devicePrecision);
+    if (relativeTolerance < 0.) relativeTolerance = PrecisionRelativeTolerance(devicePrecision);
+    if (splitDevices && chunkSites)
+    {
+        printf("--chunk-sites streams through one device; it cannot be combined with --all-devices\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (splitDevices && tuneMode > 0)
+    {
+        printf("--tune tunes the launch on one device; it cannot be combined with --all-devices\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (layoutMode == LAYOUT_STATE_MAJOR && (chunkSites || splitDevices))
+    {
+        printf("--layout=state needs every site resident on one device: not with --chunk-sites or --all-devices\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (benchWarmup < 0 || benchRepeat < 1)
+    {
+        printf("Invalid benchmark: --warmup must be at least 0, --repeat at least 1\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (!(kappa > 0.) || !(omega > 0.) || !(alpha > 0.))
+    {
+        printf("Invalid model: --kappa, --omega and --alpha must be positive\n");
+        Cleanup(EXIT_FAILURE);
+    }
+    if (categoryCount < 1 || categoryCount > MAX_RATE_CATEGORIES)
+    {
+        printf("Invalid --categories: 1 to %d rate categories\n", MAX_RATE_CATEGORIES);
+        Cleanup(EXIT_FAILURE);
+    }
+
+    // The device(s): a GPU if there is one and nothing else was asked for;
+    // every device of the type (by default any) when splitting
+    cl_device_type selectedType = (!deviceType && splitDevices) ? CL_DEVICE_TYPE_ALL : deviceType;
+    cl_device_id devices[MAX_DEVICES];
+    int deviceCount = SelectDevices(platformIndex, &selectedType, devices, MAX_DEVICES);
+    if (listDevices)
+    {
+        ListDevices(platformIndex, selectedType);
+        Cleanup(EXIT_SUCCESS);
+    }
+    if (deviceCount == 0 || deviceIndex < 0 || (!splitDevices && deviceIndex >= deviceCount))
+    {
+        printf("No OpenCL device %d of type %s%s (--list-devices shows them)\n", deviceIndex,
+               deviceType ? DeviceTypeName(deviceType) : "any", platformIndex >= 0 ? " on that platform" : "");
+        Cleanup(EXIT_FAILURE);
+    }
+    cdDevice = devices[splitDevices ? 0 : deviceIndex];
+    if (splitDevices) shareCount = deviceCount;
+
+    if (alignmentFile)
+    {
+        alignment = OpenAlignment(alignmentFile, characterCount);
+        if (!alignment) Cleanup(EXIT_FAILURE);
+        siteCount = (int)alignment->siteCount;
+        printf("Alignment: %d sequences, %ld columns\n", alignment->sequenceCount, alignment->columnCount);
+    }
+    printf("Sites: %d, characters: %d (%s host kernels)\n", siteCount, characterCount,
+           KernelSpecialized(characterCount) ? "specialized" : "generic");
+    if (treeFile) tree = ReadNewickFile(treeFile);
+    else tree = BalancedTree(alignment ? alignment->sequenceCount : nodeCount/2 + 1);
+    if (!tree)
+    {
+        printf("Error reading tree, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    printf("Tree: %d tips, %d internal nodes, %d levels\n\n", tree->tipCount,
+           tree->nodeCount - tree->tipCount, tree->levelCount);
+    if (updateCount < 0) updateCount = tree->nodeCount - 1;
+    benchSamples = (long long*)malloc(sizeof(long long) * (benchRepeat > updateCount ? benchRepeat : updateCount));
+
+    // Allocate and initialize host arrays
+    //*************************************************
+    printf( "Allocate and Init Host Mem...\n");
+
+    // initialize the tip vectors for every column, then collapse identical
+    // columns to one pattern each; only the patterns are pruned
     long tempindex = 0;
-    // initialize the vectors
-    for (tempindex = 0; tempindex < (CHARACTERS*SITES); tempindex++)
+    long tipSize = (long)tree->tipCount*characterCount*siteCount;
+    partials        = AlignedAlloc (sizeof(clfp)*tipSize);
+    if (alignment)
+    {
+        htimer = TimerNanoseconds();
+        if (!LoadTipPartials(alignment, treeFile ? tree : NULL, (fpoint*)partials)) Cleanup(EXIT_FAILURE);
+        printf("%f seconds loading the alignment\n", (TimerNanoseconds() - htimer) * 1e-9);
+        CloseAlignment(alignment);
+        alignment = NULL;
+    }
+    else
+    {
+        for (tempindex = 0; tempindex < tipSize; tempindex++)
+        {
+            ((fpoint*)partials)[tempindex] = 1./characterCount; // this is just dummy filler
+        }
+    }
+    sitePatterns = compressPatterns ? CompressSitePatterns((fpoint*)partials, tree->tipCount, siteCount, characterCount)
+                                    : IdentitySitePatterns(siteCount);
+    if (!sitePatterns)
+    {
+        printf("Error compressing site patterns, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    patternCount = (int)sitePatterns->patternCount;
+    printf("Site patterns: %d of %d columns\n", patternCount, siteCount);
+    patternWeights = (double*)malloc(sizeof(double)*patternCount);
+    if (!patternWeights) Cleanup(EXIT_FAILURE);
+    for (tempindex = 0; tempindex < patternCount; tempindex++) patternWeights[tempindex] = sitePatterns->weights[tempindex];
+
+    // internal nodes are filled by the traversal
+    long partialsSize = PartialsSize(tree, patternCount, characterCount, categoryCount);
+    long modelsSize = (long)tree->nodeCount*categoryCount*characterCount*characterCount;
+    // (page-aligned, so zero-copy devices can use these arrays in place)
+    partials        = AlignedRealloc (partials, sizeof(clfp)*tree->tipCount*characterCount*patternCount,
+                                      sizeof(clfp)*partialsSize);
+    scalings        = AlignedAlloc (sizeof(int)*tree->nodeCount*patternCount);
+    models          = AlignedAlloc (sizeof(clfp)*modelsSize);
+    Golden          = AlignedAlloc (sizeof(clfp)*partialsSize);
+    GoldenScalings  = AlignedAlloc (sizeof(int)*tree->nodeCount*patternCount);
+    // the device's copy of the models, converted when its storage type is
+    // not fpoint (whole, since zero-copy buffers wrap it); its partials
+    // follow once the layout is settled
+    deviceModels    = (storageBytes != sizeof(fpoint)) ? AlignedAlloc (storageBytes*modelsSize) : models;
+    if (!partials || !scalings || !models || !Golden || !GoldenScalings || !deviceModels)
+    {
+        printf("Error allocating host memory, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    for (tempindex = (long)tree->tipCount*characterCount*patternCount; tempindex < partialsSize; tempindex++)
+    {
+        ((fpoint*)partials)[tempindex] = 0.;
+    }
+    memcpy(Golden, partials, sizeof(clfp)*partialsSize);
+    for (tempindex = 0; tempindex < (long)tree->nodeCount*patternCount; tempindex++)
     {
-        ((fpoint*)node_cache)[tempindex] = 1./CHARACTERS; // this is just dummy filler
-        ((fpoint*)Golden)[tempindex] = 1.;
-        ((fpoint*)parent_cache)[tempindex] = 1.;
         ((int*)scalings)[tempindex] = 0;
+        ((int*)GoldenScalings)[tempindex] = 0;
     }
-	
-    // initialize the model
-    for (tempindex = 0; tempindex < (CHARACTERS*CHARACTERS); tempindex++)
+
+    // branch models: P(t r_k) for the length of the branch above each node
+    // and the rate of each category, [node][category]
+    substitutionModel = CreateSubstitutionModel(characterCount, kappa, omega);
+    if (!substitutionModel || !SetGammaRates(substitutionModel, categoryCount, alpha)) Cleanup(EXIT_FAILURE);
+    matrixCache = CreateMatrixCache(substitutionModel, 4 * tree->nodeCount * categoryCount);
+    if (categoryCount > 1)
     {
-        ((fpoint*)model)[tempindex] = 1./CHARACTERS; // this is just dummy filler
+        printf("Rate categories (gamma shape %g):", alpha);
+        for (tempindex = 0; tempindex < categoryCount; tempindex++) printf(" %f", substitutionModel->rates[tempindex]);
+        printf("\n");
     }
-	
+    double* branchLengths = (double*)malloc(sizeof(double)*tree->nodeCount*categoryCount);
+    int* branchCategories = (int*)malloc(sizeof(int)*tree->nodeCount*categoryCount);
+    for (tempindex = 0; tempindex < (long)tree->nodeCount*categoryCount; tempindex++)
+    {
+        branchLengths[tempindex] = tree->branchLength[tempindex / categoryCount];
+        branchCategories[tempindex] = (int)(tempindex % categoryCount);
+    }
+    int builtMatrices = BuildTransitionMatrices(matrixCache, tree->nodeCount*categoryCount, branchLengths,
+                                                branchCategories, (fpoint*)models);
+    StoreDeviceValues(deviceModels, (const fpoint*)models, modelsSize, storageBytes);
+    printf("Transition matrices: %d built for %d branches x %d categories\n", builtMatrices, tree->nodeCount,
+           categoryCount);
+    free(branchLengths);
+    free(branchCategories);
+
+    // Partials layout and launch shape on the device: as given, or from
+    // the device's tuning profile for this problem (its fastest layout when
+    // the layout is left to the driver).  Otherwise the layout is the
+    // fastest of each on the device through the engine library
+    // (state-major only when every site stays resident on the one device),
+    // and --tune benchmarks the launch shape too and stores it.  Split runs
+    // keep the default shape: their devices share one sitesPerGroup.
+    EngineOptions trialOptions;
+    EngineDefaultOptions(&trialOptions);
+    trialOptions.platformIndex = platformIndex;
+    trialOptions.deviceType = selectedType;
+    trialOptions.deviceIndex = splitDevices ? 0 : deviceIndex;
+    trialOptions.precision = devicePrecision;
+    trialOptions.sitesPerGroup = sitesPerGroup;
+    trialOptions.localWorkSize = workGroupSize;
+    trialOptions.unroll = unrollFactor;
+    trialOptions.programCache = programCache;
+    KernelTuning tuning;
+    DefaultKernelTuning(&tuning, sitesPerGroup);
+    tuning.localWorkSize = workGroupSize;
+    tuning.unroll = unrollFactor;
+    bool tuned = false;
+    int layoutKind = layoutMode;
+    if (!splitDevices && tuneMode == 0 && !launchShapeSet &&
+        LoadKernelTuning(programCache, cdDevice, characterCount, categoryCount, devicePrecision, &layoutKind, &tuning))
+    {
+        if (layoutKind == LAYOUT_STATE_MAJOR && chunkSites)
+        {
+            DefaultKernelTuning(&tuning, sitesPerGroup);     // tuned for a layout streaming cannot use
+            layoutKind = layoutMode;
+        }
+        else
+        {
+            printf("Kernel tuning loaded from %s: %s layout\n", programCache, LayoutName((LayoutKind)layoutKind));
+            tuned = true;
+        }
+    }
+    size_t lineBytes = DeviceLineBytes(cdDevice);
+    if (layoutKind < 0) layoutKind = ChooseDeviceLayout(&trialOptions, !chunkSites && !splitDevices);
+    MakeLayout(&deviceLayout, (LayoutKind)layoutKind, characterCount, storageBytes, lineBytes);
+    if (!splitDevices && tuneMode > 0)
+    {
+        double tunedSeconds = 0.;
+        trialOptions.layout = deviceLayout.kind;
+        tuning = TuneKernel(&trialOptions, &tuning, &tunedSeconds);
+        tuned = tunedSeconds > 0.;
+        if (tuned && programCache)
+        {
+            if (StoreKernelTuning(programCache, cdDevice, characterCount, categoryCount, devicePrecision,
+                                  deviceLayout.kind, &tuning, tunedSeconds))
+                printf("Kernel tuning stored in %s\n", programCache);
+            else printf("Error writing kernel tuning in %s\n", programCache);
+        }
+    }
+    KernelConfig tunedConfig;
+    if (tuned && ConfigureKernel(cdDevice, &tuning, characterCount, categoryCount, devicePrecision, &deviceLayout,
+                                 &tunedConfig) != CL_SUCCESS)
+    {
+        printf("Tuned launch (%lu work items, %d sites per group) does not fit the device: defaults instead\n",
+               (unsigned long)tuning.localWorkSize, tuning.sitesPerGroup);
+        tuned = false;
+    }
+    if (tuned)
+    {
+        workGroupSize = tuning.localWorkSize;
+        sitesPerGroup = tuning.sitesPerGroup;
+        unrollFactor = tuning.unroll;
+    }
+
+    // set and log Global and Local work size dimensions: one work group per
+    // block of sitesPerGroup patterns and internal node of a level, one work
+    // item per parent character (and more in a tuned wider group)
+
+    int siteGroups = (patternCount + sitesPerGroup - 1) / sitesPerGroup;
+    szLocalWorkSize[0] = workGroupSize ? workGroupSize : roundUpToNextPowerOfTwo(characterCount);
+    szLocalWorkSize[1] = 1;
+    szGlobalWorkSize[0] = siteGroups * szLocalWorkSize[0];
+    printf("Global Work Size \t\t= %lu x (nodes in level)\nLocal Work Size \t\t= %lu\n# of Work Groups \t\t= %d x (nodes in level), %d sites each, unrolled %d\n\n",
+           (unsigned long)szGlobalWorkSize[0], (unsigned long)szLocalWorkSize[0], siteGroups, sitesPerGroup,
+           unrollFactor);
+
     //**************************************************
-    dtimer = time(NULL); 
+    dtimer = TimerNanoseconds();
 	
-    //Get an OpenCL platform
-    ciErr1 = clGetPlatformIDs(1, &cpPlatform, NULL);
-	
-    printf("clGetPlatformID...\n"); 
+    // Local memory: one reduction row per site (which also holds the staged
+    // child rows), then as many model columns as fit, ideally all of them
+    siteTileSize = (size_t)sitesPerGroup * szLocalWorkSize[0];
+    charTile = DeviceCharTile(cdDevice);
+    modelTileSize = (size_t)characterCount * charTile;
+    printf("Model tile: %d of %d child characters, %lu bytes of local memory\n", charTile, characterCount,
+           (unsigned long)(modelTileSize * storageBytes + siteTileSize * accumBytes));
+
+    // Global memory: stream the sites in chunks when asked to, or when the
+    // resident partials would not fit (in one allocation, or in 3/4 of the
+    // device next to the models).  Split across devices, each holds only
+    // its own share.
+    cl_ulong globalMemBytes = 0, maxAllocBytes = 0;
+    ciErr1 = clGetDeviceInfo(cdDevice, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMemBytes, NULL);
+    ciErr1 |= clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAllocBytes, NULL);
     if (ciErr1 != CL_SUCCESS)
     {
-        printf("Error in clGetPlatformID, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        printf("Error in clGetDeviceInfo, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
         Cleanup(EXIT_FAILURE);
     }
-	
-    //Get the devices
-    ciErr1 = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 1, &cdDevice, NULL);
-    printf("clGetDeviceIDs...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    long devicePartialsSize = LayoutSize(&deviceLayout, tree, patternCount, categoryCount);
+    double sitePartialsBytes = (double)PartialsSize(tree, 1, LayoutCharSpan(&deviceLayout), categoryCount) * storageBytes;
+    double siteBytes = sitePartialsBytes + (double)tree->nodeCount * sizeof(cl_int);   // one site, every node
+    double usableBytes = 0.75 * globalMemBytes - (double)modelsSize * storageBytes;
+    if (chunkSites == 0 && !splitDevices && ((double)devicePartialsSize * storageBytes > maxAllocBytes || siteBytes * patternCount > usableBytes))
     {
-        printf("Error in clGetDeviceIDs, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        double fit = usableBytes / (STREAM_SLOTS * siteBytes);
+        double allocFit = (double)maxAllocBytes / sitePartialsBytes;
+        if (allocFit < fit) fit = allocFit;
+        chunkSites = (fit < sitesPerGroup) ? 0 : (int)(fit / sitesPerGroup) * sitesPerGroup;
+        if (chunkSites == 0)
+        {
+            printf("%lu bytes of device memory cannot hold %d sites of %d nodes\n", (unsigned long)globalMemBytes,
+                   sitesPerGroup, tree->nodeCount);
+            Cleanup(EXIT_FAILURE);
+        }
     }
-    
-    size_t maxWorkGroupSize;
-    ciErr1 = clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_WORK_GROUP_SIZE, 
-							 sizeof(size_t), &maxWorkGroupSize, NULL);
-    if (ciErr1 != CL_SUCCESS)
+    if (chunkSites > patternCount) chunkSites = patternCount;
+    bool resident = !chunkSites && !splitDevices;     // every site on one device: the run goes through an engine
+    if (chunkSites)
+        printf("Streaming %d chunks of up to %d sites, %d in flight\n", (patternCount + chunkSites - 1) / chunkSites,
+               chunkSites, STREAM_SLOTS);
+    if (chunkSites && deviceLayout.kind == LAYOUT_STATE_MAJOR)
     {
-        printf("Getting max work group size failed!\n");
+        // chunks are cut from site-major rows
+        printf("Streaming keeps partials site-major: padded layout instead of state-major\n");
+        MakeLayout(&deviceLayout, LAYOUT_PADDED, characterCount, storageBytes, lineBytes);
+        devicePartialsSize = LayoutSize(&deviceLayout, tree, patternCount, categoryCount);
     }
-    printf("Max work group size: %lu\n", (unsigned long)maxWorkGroupSize);
+    if (deviceLayout.kind == LAYOUT_STATE_MAJOR)
+        printf("Partials layout: state, %ld sites per character row (%lu-byte lines)\n",
+               LayoutSiteSpan(&deviceLayout, patternCount), (unsigned long)lineBytes);
+    else
+        printf("Partials layout: %s, %d values per row of %d characters (%lu-byte lines)\n",
+               LayoutName(deviceLayout.kind), LayoutCharSpan(&deviceLayout), characterCount, (unsigned long)lineBytes);
+
+    // the device's copy of the partials for the driver's own launches,
+    // converted when its storage type or layout is not the host's (whole,
+    // since zero-copy buffers wrap it; zeroed, so padding is too); only the
+    // tips are inputs.  The engine converts what it is handed itself.
+    devicePartials = (!resident && (storageBytes != sizeof(fpoint) || deviceLayout.kind != LAYOUT_PACKED))
+                     ? AlignedCalloc (storageBytes*devicePartialsSize) : partials;
+    if (!devicePartials)
+    {
+        printf("Error allocating host memory, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    if (devicePartials != partials)
+        StoreDevicePartials(devicePartials, (const fpoint*)partials, tree, 0, tree->tipCount, patternCount,
+                            categoryCount, &deviceLayout, storageBytes);
     
     cl_uint extcheck;
     ciErr1 = clGetDeviceInfo(cdDevice, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, 
 							 sizeof(cl_uint), &extcheck, NULL);
     if (extcheck ==0 ) 
     {
-        printf("Device does not support double precision.\n");
+        printf("Device does not support double precision%s.\n",
+               accumBytes == sizeof(cl_double) ? " (--precision=single runs in float)" : "");
     }
     
     size_t returned_size = 0;
@@ -171,198 +753,703 @@ int main(int argc, char **argv)
 							  device_name, &returned_size);
     assert(ciErr1 == CL_SUCCESS);
     printf("Connecting to %s %s...\n", vendor_name, device_name);
+    printf("Device precision: %s (%s storage, %s arithmetic)\n", PrecisionName(devicePrecision),
+           PrecisionStorageType(devicePrecision), PrecisionAccumType(devicePrecision));
 	
-    //Create the context
-    cxGPUContext = clCreateContext(0, 1, &cdDevice, NULL, NULL, &ciErr1);
-    printf("clCreateContext...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    // Profiling events for every command, through the engine's hook or
+    // from the driver's own launches
+    if (profileDevice)
     {
-        printf("Error in clCreateContext, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        profiler = CreateDeviceProfiler(tree, profileTrace);
+        if (!profiler) Cleanup(EXIT_FAILURE);
     }
-	
-    // Create a command-queue
-    cqCommandQueue = clCreateCommandQueue(cxGPUContext, cdDevice, 0, &ciErr1);
-    printf("clCreateCommandQueue...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    if (resident) CreateDeviceEngine(&trialOptions);
+    else SetupDriverDevice();
+
+    // Split across devices: share 0 is this device, the others get their
+    // own context, program and copies of the models and tree; then the
+    // sites are divided by measured throughput
+    if (splitDevices)
     {
-        printf("Error in clCreateCommandQueue, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        int shareIndex;
+        deviceShares[0].device = cdDevice;
+        deviceShares[0].context = cxGPUContext;
+        deviceShares[0].queue = cqCommandQueue;
+        deviceShares[0].kernel = ckKernel;
+        deviceShares[0].pool = bufferPool;
+        deviceShares[0].models = cmModels;
+        deviceShares[0].childStart = cmChildStart;
+        deviceShares[0].children = cmChildren;
+        deviceShares[0].levelNodes = cmLevelNodes;
+        snprintf(deviceShares[0].name, sizeof(deviceShares[0].name), "%s", (const char*)device_name);
+        for (shareIndex = 1; shareIndex < shareCount; shareIndex++)
+            SetupDeviceShare(&deviceShares[shareIndex], devices[shareIndex]);
+        BalanceDeviceShares();
+
+        // one name for the benchmark record
+        for (shareIndex = 1; shareIndex < shareCount; shareIndex++)
+        {
+            strncat((char*)device_name, " + ", sizeof(device_name) - strlen((char*)device_name) - 1);
+            strncat((char*)device_name, deviceShares[shareIndex].name, sizeof(device_name) - strlen((char*)device_name) - 1);
+        }
     }
 	
-    // Allocate the OpenCL buffer memory objects for source and result on the device GMEM
-    cmNode_cache = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, 
-								  sizeof(clfp) * CHARACTERS * SITES, NULL, &ciErr1);
-    cmModel = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, 
-							 sizeof(clfp) * CHARACTERS * CHARACTERS, NULL, &ciErr2);
-    ciErr1 |= ciErr2;
-    cmParent_cache = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, 
-									sizeof(clfp) * CHARACTERS * SITES, NULL, &ciErr2);
-    ciErr1 |= ciErr2;
-    cmScalings = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE,
-								sizeof(cl_int) * CHARACTERS * SITES, NULL, &ciErr2);
-    ciErr1 |= ciErr2;
-    printf("clCreateBuffer...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    // Launch kernel
+    
+    // One launch per level: the internal nodes of a level only depend on
+    // lower levels, so they all run in the same wave.  The in-order queue
+    // keeps the levels in sequence.
+    // The engine runs them for resident sites, streaming per chunk and
+    // split devices per share.
+    printf("clEnqueueNDRangeKernel (FirstLoop), %d levels...\n", tree->levelCount); 
+    size_t rootOffset = NodePartialsOffset(tree, tree->root, patternCount, characterCount, categoryCount);
+    if (splitDevices) SplitTraversal();
+    else if (chunkSites) StreamTraversal();
+    else EvaluateRoot();
+    printf("clEnqueueReadBuffer...\n\n"); 
+    //--------------------------------------------------------
+	
+    
+    if (!resident) clFinish(cqCommandQueue);
+    printf("%f seconds on device (setup, upload and first traversal)\n\n", (TimerNanoseconds() - dtimer) * 1e-9);
+    
+    // Work of one full traversal, for the rates of every backend
+    // (the device moves values of its storage type, the host fpoints)
+    double traversalFlops = 0., traversalBytes = 0., deviceFlops = 0., deviceBytes = 0.;
+    for (argIndex = tree->tipCount; argIndex < tree->nodeCount; argIndex++)
     {
-        printf("Error in clCreateBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        NodeWork(tree, argIndex, patternCount, characterCount, categoryCount, sizeof(fpoint), &traversalFlops, &traversalBytes);
+        NodeWork(tree, argIndex, patternCount, characterCount, categoryCount, storageBytes, &deviceFlops, &deviceBytes);
+    }
+    
+    // Timed full traversals: --warmup untimed, then --repeat timed, each
+    // from launch to the log-likelihood (resident: the engine re-prunes
+    // every node and reduces on the device)
+    // or the root rows (streamed or split) back on the host.  Every run
+    // recomputes the same values, so the root read above stays current.
+    int benchRun;
+    for (benchRun = 0; benchRun < benchWarmup + benchRepeat; benchRun++)
+    {
+        dtimer = TimerNanoseconds();
+        if (splitDevices) SplitTraversal();
+        else if (chunkSites) StreamTraversal();
+        else
+        {
+            CheckEngine(EngineInvalidate(deviceEngine), "EngineInvalidate");
+            EvaluateLogLikelihood(NULL);
+        }
+        if (benchRun >= benchWarmup) benchSamples[benchRun - benchWarmup] = TimerNanoseconds() - dtimer;
     }
+    RecordBenchmark("device", benchRepeat, deviceFlops, deviceBytes);
 	
-	// Create the program
+	
+    // Compute and compare results for golden-host and report errors and pass/fail
+    printf("Comparing against Host/C++ computation...\n\n"); 
     
-	// Read the OpenCL kernel in from source file
-
-	const char *program_source = "\n" \
-	"#pragma OPENCL EXTENSION cl_khr_fp64: enable																				\n" \
-	"" FLOATPREC                                                                                                                    \
-	"__kernel void FirstLoop(__global const fpoint* node_cache, __global const fpoint* model, __global fpoint* parent_cache, 	\n" \
-    "    __local fpoint* nodeScratch, __local fpoint * modelScratch, int nodes, int sites, int characters,						\n" \
-    "   __global int* scalings, fpoint uflowthresh, fpoint scalar)																\n" \
-	"{																															\n" \
-	"   int parentCharGlobal = get_global_id(0); // a unique global ID for each parentcharacter									\n" \
-    "   int parentCharLocal = get_local_id(0); // a local ID unique within the site.											\n" \
-	"	if ((parentCharGlobal/characters) >= sites) return;																		\n" \
-	"	if (parentCharLocal >= characters) return;																				\n" \
-	"   nodeScratch[parentCharLocal] = node_cache[parentCharGlobal];															\n" \
-    "   modelScratch[parentCharLocal] = model[parentCharLocal * characters + parentCharLocal];									\n" \
-	"	barrier(CLK_LOCAL_MEM_FENCE);																							\n" \
-	"   fpoint sum = 0.;																										\n" \
-    "   long myChar;																											\n" \
-    "   for (myChar = 0; myChar < characters; myChar++)																			\n" \
-    "   {																														\n" \
-    "       sum += nodeScratch[myChar] * modelScratch[myChar];																	\n" \
-    "   }																														\n" \
-    "   barrier(CLK_LOCAL_MEM_FENCE);																							\n" \
-    "   while (parent_cache[parentCharGlobal] < uflowthresh)																	\n" \
-    "   {																														\n" \
-    "       parent_cache[parentCharGlobal] *= scalar;																			\n" \
-    "    	scalings[parentCharGlobal] += 1;																					\n" \
-    "	}																														\n" \
-	"   parent_cache[parentCharGlobal] *= sum;																					\n" \
-	"}																															\n" \
-	"\n";
-
-      
-//	printf("LoadProgSource (%s)...\n", cSourceFile); 
-//	char *program_source = load_program_source(cSourceFile, argv[0],  &szKernelLength);
-	cpProgram = clCreateProgramWithSource(cxGPUContext, 1, (const char**)&program_source,
-	                                         NULL, &ciErr1);
-	
-    printf("clCreateProgramWithSource...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    for (benchRun = 0; benchRun < benchWarmup + benchRepeat; benchRun++)
     {
-        printf("Error in clCreateProgramWithSource, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        htimer = TimerNanoseconds();
+        FirstLoopHost (tree, (fpoint*)Golden, (const fpoint*)models, (int*)GoldenScalings, patternCount, characterCount,
+                       categoryCount, uflowThresh);
+        if (benchRun >= benchWarmup) benchSamples[benchRun - benchWarmup] = TimerNanoseconds() - htimer;
     }
+    RecordBenchmark("host-reference", benchRepeat, traversalFlops, traversalBytes);
 	
-    ciErr1 = clBuildProgram(cpProgram, 1, &cdDevice, NULL, NULL, NULL);
-    printf("clBuildProgram...\n"); 
+	/*
+	 int goldenLoop = 0;
+	 for (goldenLoop = 0; goldenLoop < patternCount; goldenLoop++)
+	 {
+	 printf("Golden: %e\n", ((fpoint*)Golden)[rootOffset + goldenLoop*characterCount]);
+	 }
+	 */
 	
-    // Shows the log
-    char* build_log;
-    size_t log_size;
-    // First call to know the proper size
-    clGetProgramBuildInfo(cpProgram, cdDevice, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-    build_log = new char[log_size+1];   
-    // Second call to get the log
-    clGetProgramBuildInfo(cpProgram, cdDevice, CL_PROGRAM_BUILD_LOG, log_size, build_log, NULL);
-    build_log[log_size] = '\0';
-    printf(build_log);
-    delete[] build_log;
 	
-    if (ciErr1 != CL_SUCCESS)
+	// Root log-likelihood: each site's rescue exponent undoes 2^scalings
+	//***************************************************************************
+    fpoint* rootPartials = (fpoint*)partials + rootOffset;
+    int* rootScalings = (int*)scalings + tree->root * patternCount;
+    double* deviceSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    bool match = true;
+    if (resident)
     {
-		printf("%i\n", ciErr1); //prints "1"
-		switch(ciErr1)
-		{
-			case   CL_INVALID_PROGRAM: printf("CL_INVALID_PROGRAM\n"); break;
-			case   CL_INVALID_VALUE: printf("CL_INVALID_VALUE\n"); break;
-			case   CL_INVALID_DEVICE: printf("CL_INVALID_DEVICE\n"); break;
-			case   CL_INVALID_BINARY: printf("CL_INVALID_BINARY\n"); break; 
-			case   CL_INVALID_BUILD_OPTIONS: printf("CL_INVALID_BUILD_OPTIONS\n"); break;
-			case   CL_COMPILER_NOT_AVAILABLE: printf("CL_COMPILER_NOT_AVAILABLE\n"); break;
-			case   CL_BUILD_PROGRAM_FAILURE: printf("CL_BUILD_PROGRAM_FAILURE\n"); break;
-			case   CL_INVALID_OPERATION: printf("CL_INVALID_OPERATION\n"); break;
-			case   CL_OUT_OF_HOST_MEMORY: printf("CL_OUT_OF_HOST_MEMORY\n"); break;
-			default: printf("Strange error\n"); //This is printed
-		}
-		printf("Error in clBuildProgram, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-		Cleanup(EXIT_FAILURE);
+        double deviceLogL = EvaluateLogLikelihood(siteLikelihoods ? deviceSiteLogL : NULL);
+        printf("Log likelihood (device, reduced on the device): %f\n", deviceLogL);
+        match = CheckDeviceLikelihood("Device", deviceLogL, siteLikelihoods ? deviceSiteLogL : NULL);
+        printf("%s\n\n", (match) ? "PASSED" : "FAILED");
     }
+    else
+        printf("Log likelihood (device): %f\n\n", RootLogLikelihood(rootPartials, rootScalings, NULL));
 	
-    // Create the kernel
-    ckKernel = clCreateKernel(cpProgram, "FirstLoop", &ciErr1);
-    printf("clCreateKernel (FirstLoop)...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+	
+    // Vectorized host engine, checked against the scalar reference
+	//***************************************************************************
+    int scIndex;
+    fpoint* fastPartials = (fpoint*)AlignedAlloc(sizeof(clfp)*partialsSize);
+    int* fastScalings = (int*)AlignedCalloc(sizeof(int)*tree->nodeCount*patternCount);
+    memcpy(fastPartials, Golden, sizeof(clfp)*tree->tipCount*characterCount*patternCount);
+	
+    hostPool = HostThreadPoolCreate(hostThreads);
+    if (!hostPool)
     {
-        printf("Error in clCreateKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        printf("Error creating the host thread pool, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
         Cleanup(EXIT_FAILURE);
     }
+    for (benchRun = 0; benchRun < benchWarmup + benchRepeat; benchRun++)
+    {
+        htimer = TimerNanoseconds();
+        if (!FirstLoopHostThreaded(hostPool, tree, fastPartials, (const fpoint*)models, fastScalings, patternCount,
+                                   characterCount, categoryCount, uflowThresh, hostIsa))
+        {
+            printf("Error allocating host engine buffers, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+            Cleanup(EXIT_FAILURE);
+        }
+        if (benchRun >= benchWarmup) benchSamples[benchRun - benchWarmup] = TimerNanoseconds() - htimer;
+    }
+    printf("Host engine: %s, %d threads\n", HostIsaName(hostIsa), HostThreadPoolSize(hostPool));
+    RecordBenchmark("host-engine", benchRepeat, traversalFlops, traversalBytes);
 	
+    double* goldenSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    double* fastSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    RootLogLikelihood((fpoint*)Golden + rootOffset, (int*)GoldenScalings + tree->root*patternCount, goldenSiteLogL);
+    RootLogLikelihood(fastPartials + rootOffset, fastScalings + tree->root*patternCount, fastSiteLogL);
+    double maxSiteError = 0.;
+    for (scIndex = 0; scIndex < patternCount; scIndex++)
+    {
+        // relative, but absolute near 0 (fully ambiguous columns have log likelihood 0)
+        double err = fabs(fastSiteLogL[scIndex] - goldenSiteLogL[scIndex]) / fmax(fabs(goldenSiteLogL[scIndex]), 1.);
+        if (!(err <= maxSiteError)) maxSiteError = err;     // also catches NaN
+    }
+    printf("Host engine max relative site log likelihood error: %e\n", maxSiteError);
+    printf("%s\n\n", (maxSiteError < 1e-10) ? "PASSED" : "FAILED");
+    AlignedFree(fastPartials);
+    AlignedFree(fastScalings);
+    free(goldenSiteLogL);
+    free(fastSiteLogL);
 	
-    int tempNodeCount = NODES;
-    int tempSiteCount = SITES;
-    int tempCharCount = CHARACTERS;
 	
-    // Set the Argument values
-    ciErr1 = clSetKernelArg(ckKernel, 0, sizeof(cl_mem), (void*)&cmNode_cache);
-    ciErr1 |= clSetKernelArg(ckKernel, 1, sizeof(cl_mem), (void*)&cmModel);
-    ciErr1 |= clSetKernelArg(ckKernel, 2, sizeof(cl_mem), (void*)&cmParent_cache);
-    ciErr1 |= clSetKernelArg(ckKernel, 3, localMemorySize * sizeof(fpoint), NULL);
-    ciErr1 |= clSetKernelArg(ckKernel, 4, localMemorySize * sizeof(fpoint), NULL);
-    ciErr1 |= clSetKernelArg(ckKernel, 5, sizeof(cl_int), (void*)&tempNodeCount);
-    ciErr1 |= clSetKernelArg(ckKernel, 6, sizeof(cl_int), (void*)&tempSiteCount);
-    ciErr1 |= clSetKernelArg(ckKernel, 7, sizeof(cl_int), (void*)&tempCharCount);
-    ciErr1 |= clSetKernelArg(ckKernel, 8, sizeof(cl_mem), (void*)&cmScalings);
-    ciErr1 |= clSetKernelArg(ckKernel, 9, sizeof(clfp), (void*)&uflowThresh);
-    ciErr1 |= clSetKernelArg(ckKernel, 10, sizeof(clfp), (void*)&scalar);
-    printf("clSetKernelArg 0 - 10...\n\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    int verI;
+    int rootWidth = categoryCount*characterCount;
+    for (verI  = 0; verI < rootWidth*patternCount; verI += patternCount)
     {
-        printf("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        printf("Device: %e, Host: %e, Scalings: %i\n", rootPartials[verI], ((fpoint*)Golden)[rootOffset+verI], rootScalings[verI/rootWidth]); 
     }
+    match = CheckDeviceRoot("Device", rootPartials, rootScalings);
+    printf("%s\n\n", (match) ? "PASSED" : "FAILED");
 	
-    // --------------------------------------------------------
-    // Start Core sequence... copy input data to GPU, compute, copy results back
 	
-    // Asynchronous write of data to GPU device
-    ciErr1 = clEnqueueWriteBuffer(cqCommandQueue, cmNode_cache, CL_FALSE, 0, 
-								  sizeof(clfp) * CHARACTERS * SITES, node_cache, 0, NULL, NULL);
-    ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmModel, CL_FALSE, 0, 
-								   sizeof(clfp) * CHARACTERS * CHARACTERS, model, 0, NULL, NULL);
-    ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmParent_cache, CL_FALSE, 0, 
-								   sizeof(clfp) * CHARACTERS * SITES, parent_cache, 0, NULL, NULL);
-    ciErr1 |= clEnqueueWriteBuffer(cqCommandQueue, cmScalings, CL_FALSE, 0,
-								   sizeof(cl_int) * CHARACTERS * SITES, scalings, 0, NULL, NULL);
-    printf("clEnqueueWriteBuffer (node_cache, parent_cache and model)...\n"); 
-    if (ciErr1 != CL_SUCCESS)
+    // Incremental evaluations, as in a branch-length optimizer: each one
+    // changes a single branch, rebuilds and hands the engine just that
+    // model, and the engine re-prunes only the path from it to the root.
+    // Tips, models and every other partial stay resident on the device
+    // between evaluations.
+	//***************************************************************************
+    if (updateCount > 0 && chunkSites)
+        printf("Incremental evaluations need every site resident on the device; skipped while streaming\n\n");
+    else if (updateCount > 0 && splitDevices)
+        printf("Incremental evaluations run on one device; skipped with the sites split across devices\n\n");
+    else if (updateCount > 0)
     {
-        printf("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
-        Cleanup(EXIT_FAILURE);
+        bool* dirty = (bool*)calloc(tree->nodeCount, sizeof(bool));
+        int* dirtyStart = (int*)malloc(sizeof(int)*(tree->levelCount + 1));
+        int* dirtyNodes = (int*)malloc(sizeof(int)*(tree->nodeCount - tree->tipCount));
+        int rateCategories[MAX_RATE_CATEGORIES];
+        double categoryLengths[MAX_RATE_CATEGORIES];
+        long modelSize = (long)categoryCount*characterCount*characterCount;     // every category of one branch
+        for (tempindex = 0; tempindex < categoryCount; tempindex++) rateCategories[tempindex] = (int)tempindex;
+        long recomputed = 0;
+        int builtUpdates = 0;
+        double logLikelihood = 0., updateFlops = 0., updateBytes = 0.;
+        int update, scheduledIndex;
+        for (update = 0; update < updateCount; update++)
+        {
+            dtimer = TimerNanoseconds();
+            int branch = update % (tree->nodeCount - 1);    // every branch but the root's in turn
+            tree->branchLength[branch] *= 1.1;
+            for (tempindex = 0; tempindex < categoryCount; tempindex++) categoryLengths[tempindex] = tree->branchLength[branch];
+            builtUpdates += BuildTransitionMatrices(matrixCache, categoryCount, categoryLengths, rateCategories,
+                                                    (fpoint*)models + branch*modelSize);
+            CheckEngine(EngineSetModels(deviceEngine, &branch, 1, (const fpoint*)models + branch*modelSize),
+                        "EngineSetModels");
+            logLikelihood = EvaluateLogLikelihood(siteLikelihoods ? deviceSiteLogL : NULL);
+            benchSamples[update] = TimerNanoseconds() - dtimer;
+
+            // the nodes the engine re-pruned, for the work done
+            MarkPathDirty(tree, branch, dirty);
+            int scheduled = DirtyLevelSchedule(tree, dirty, dirtyStart, dirtyNodes);
+            recomputed += scheduled;
+            for (scheduledIndex = 0; scheduledIndex < scheduled; scheduledIndex++)
+                NodeWork(tree, dirtyNodes[scheduledIndex], patternCount, characterCount, categoryCount, storageBytes,
+                         &updateFlops, &updateBytes);
+        }
+        printf("%d incremental evaluations (%d matrices built)\n", updateCount, builtUpdates);
+        RecordBenchmark("device-incremental", updateCount, updateFlops / updateCount, updateBytes / updateCount);
+        printf("Nodes recomputed: %ld of %ld for full traversals\n", recomputed,
+               (long)updateCount * (tree->nodeCount - tree->tipCount));
+        printf("Log likelihood (device, incremental): %f\n", logLikelihood);
+        free(dirty);
+        free(dirtyStart);
+        free(dirtyNodes);
+
+        // the final state must match pruning the whole tree from scratch
+        FirstLoopHost (tree, (fpoint*)Golden, (const fpoint*)models, (int*)GoldenScalings, patternCount, characterCount,
+                       categoryCount, uflowThresh);
+        printf("Log likelihood (host, full): %f\n", RootLogLikelihood((fpoint*)Golden + rootOffset,
+                                                                       (int*)GoldenScalings + tree->root*patternCount, NULL));
+        match = CheckDeviceLikelihood("Device (incremental)", logLikelihood, siteLikelihoods ? deviceSiteLogL : NULL);
+        EvaluateRoot();
+        match = CheckDeviceRoot("Device (incremental)", rootPartials, rootScalings) && match;
+        printf("%s\n\n", (match) ? "PASSED" : "FAILED");
     }
 	
-    // Launch kernel
-    
-    int nodeIndex;
 	
-	//    clock_gettime(CLOCK_REALTIME, &begin);
-    
-    printf("clEnqueueNDRangeKernel (FirstLoop)...\n"); 
-    for (nodeIndex = 0; nodeIndex < NODES; nodeIndex++)
+    // Library engines: each with its own context, program and buffers,
+    // all running at once (spread over the devices with --all-devices);
+    // every one must match the host reference like the driver does
+	//***************************************************************************
+    if (engineInstances > 0)
     {
-		
-        ciErr1 = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel, 1, NULL, 
-										&szGlobalWorkSize, &szLocalWorkSize, 0, NULL, NULL);
-        
-        if (ciErr1 != CL_SUCCESS)
+        EngineCheck* checks = (EngineCheck*)calloc(engineInstances, sizeof(EngineCheck));
+        pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*engineInstances);
+        int instance;
+        for (instance = 0; instance < engineInstances; instance++)
         {
-            printf("%i\n", ciErr1); //prints "1"
-            switch(ciErr1)
+            EngineCheck* check = &checks[instance];
+            EngineDefaultOptions(&check->options);
+            check->options.platformIndex = platformIndex;
+            check->options.deviceType = selectedType;
+            check->options.deviceIndex = splitDevices ? instance % deviceCount : deviceIndex;
+            check->options.precision = devicePrecision;
+            check->options.sitesPerGroup = sitesPerGroup;
+            check->options.localWorkSize = workGroupSize;
+            check->options.unroll = unrollFactor;
+            check->options.programCache = programCache;
+            check->options.layout = deviceLayout.kind;
+            check->patternWeights = patternWeights;
+            if (pthread_create(&threads[instance], NULL, RunEngineCheck, check) != 0)
             {
-                case   CL_INVALID_PROGRAM_EXECUTABLE: printf("CL_INVALID_PROGRAM_EXECUTABLE\n"); break;
-                case   CL_INVALID_COMMAND_QUEUE: printf("CL_INVALID_COMMAND_QUEUE\n"); break;
+                printf("Error starting engine thread %d\n", instance);
+                Cleanup(EXIT_FAILURE);
+            }
+        }
+        char engineLabel[32];
+        for (instance = 0; instance < engineInstances; instance++)
+        {
+            EngineCheck* check = &checks[instance];
+            pthread_join(threads[instance], NULL);
+            if (check->status != ENGINE_SUCCESS)
+            {
+                printf("Engine %d: %s (OpenCL error %d)\nFAILED\n\n", instance, EngineStatusString(check->status),
+                       check->clError);
+            }
+            else
+            {
+                printf("Engine %d: %f seconds setup, %f seconds per evaluation, log likelihood %f\n", instance,
+                       check->setupSeconds, check->evaluationSeconds, check->logLikelihood);
+                sprintf(engineLabel, "Engine %d", instance);
+                match = CheckDeviceRoot(engineLabel, check->rootPartials, check->rootScalings);
+                printf("%s\n\n", (match) ? "PASSED" : "FAILED");
+            }
+            free(check->rootPartials);
+            free(check->rootScalings);
+        }
+        free(checks);
+        free(threads);
+    }
+	
+	
+    if (profiler)
+    {
+        PrintDeviceProfile(profiler);
+        if (profileTrace) printf("Device trace written to %s\n\n", profileTrace);
+    }
+	
+	
+    // Machine-readable record of this configuration
+	//***************************************************************************
+    if (benchJson)
+    {
+        BenchmarkConfig config;
+        config.sites = siteCount;
+        config.patterns = patternCount;
+        config.characters = characterCount;
+        config.nodes = tree->nodeCount;
+        config.tips = tree->tipCount;
+        config.levels = tree->levelCount;
+        config.sitesPerGroup = sitesPerGroup;
+        config.workGroupSize = (int)szLocalWorkSize[0];
+        config.unroll = unrollFactor;
+        config.categories = categoryCount;
+        config.hostIsa = HostIsaName(hostIsa);
+        config.hostThreads = HostThreadPoolSize(hostPool);
+        config.device = (const char*)device_name;
+        config.precision = PrecisionName(devicePrecision);
+        config.layout = LayoutName(deviceLayout.kind);
+        config.warmup = benchWarmup;
+        config.repeat = benchRepeat;
+        if (!AppendBenchmarkJson(benchJson, &config, benchResults, benchResultCount)) Cleanup(EXIT_FAILURE);
+        printf("Benchmark appended to %s\n\n", benchJson);
+    }
+	
+	
+    // Cleanup and leave
+    Cleanup (EXIT_SUCCESS);
+}
+
+// Check that device can run the work groups, then size the model tile:
+// the child characters whose model columns fit in its local memory next
+// to the site tile.  Exits if not even one does.
+// *********************************************************************
+int DeviceCharTile(cl_device_id device)
+{
+    size_t maxWorkGroupSize = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    printf("Max work group size: %lu\n", (unsigned long)maxWorkGroupSize);
+    KernelTuning tuning = { workGroupSize, sitesPerGroup, unrollFactor };
+    KernelConfig config;
+    ciErr1 = ConfigureKernel(device, &tuning, characterCount, categoryCount, devicePrecision, &deviceLayout, &config);
+    if (ciErr1 == CL_INVALID_WORK_GROUP_SIZE)
+    {
+        printf("A work group of %lu for %d characters: it must be a power of two of at least them the device allows\n",
+               (unsigned long)config.localWorkSize, characterCount);
+        Cleanup(EXIT_FAILURE);
+    }
+    if (ciErr1 == CL_OUT_OF_RESOURCES)
+    {
+        cl_ulong localMemBytes = 0;
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemBytes, NULL);
+        printf("%lu bytes of local memory cannot hold %d sites per group of %d characters\n",
+               (unsigned long)localMemBytes, sitesPerGroup, characterCount);
+        Cleanup(EXIT_FAILURE);
+    }
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clGetDeviceInfo, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    return config.charTile;
+}
+
+// Build the kernel for one device with its own CHAR_TILE (see
+// BuildKernelProgram): from the program cache when it holds a binary,
+// from source otherwise.  Prints the build log; exits if the build fails.
+// *********************************************************************
+cl_program BuildProgram(cl_context context, cl_device_id device, int deviceCharTile)
+{
+    KernelConfig config;
+    config.sitesPerGroup = sitesPerGroup;
+    config.unroll = unrollFactor;
+    config.characters = characterCount;
+    config.categories = categoryCount;
+    config.precision = devicePrecision;
+    config.layout = deviceLayout;
+    config.charTile = deviceCharTile;
+
+    long long buildTimer = TimerNanoseconds();
+    CacheStatus loaded, stored;
+    char* build_log;
+    cl_program program = BuildKernelProgram(context, device, &config, programCache, &loaded, &stored, &build_log,
+                                            &ciErr1);
+    if (loaded == CACHE_SUCCESS)
+    {
+        printf("Program binary loaded from %s in %f seconds\n", programCache, (TimerNanoseconds() - buildTimer) * 1e-9);
+        return program;
+    }
+    if (loaded == CACHE_REJECTED) printf("Cached program binary in %s rejected, rebuilding from source\n", programCache);
+    printf("clBuildProgram...\n"); 
+    if (build_log) printf("%s", build_log);
+    free(build_log);
+	
+    if (ciErr1 != CL_SUCCESS)
+    {
+		printf("%i\n", ciErr1); //prints "1"
+		switch(ciErr1)
+		{
+			case   CL_INVALID_PROGRAM: printf("CL_INVALID_PROGRAM\n"); break;
+			case   CL_INVALID_VALUE: printf("CL_INVALID_VALUE\n"); break;
+			case   CL_INVALID_DEVICE: printf("CL_INVALID_DEVICE\n"); break;
+			case   CL_INVALID_BINARY: printf("CL_INVALID_BINARY\n"); break; 
+			case   CL_INVALID_BUILD_OPTIONS: printf("CL_INVALID_BUILD_OPTIONS\n"); break;
+			case   CL_COMPILER_NOT_AVAILABLE: printf("CL_COMPILER_NOT_AVAILABLE\n"); break;
+			case   CL_BUILD_PROGRAM_FAILURE: printf("CL_BUILD_PROGRAM_FAILURE\n"); break;
+			case   CL_INVALID_OPERATION: printf("CL_INVALID_OPERATION\n"); break;
+			case   CL_OUT_OF_HOST_MEMORY: printf("CL_OUT_OF_HOST_MEMORY\n"); break;
+			default: printf("Strange error\n"); //This is printed
+		}
+		printf("Error in clBuildProgram, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+		Cleanup(EXIT_FAILURE);
+    }
+    printf("Program built from source in %f seconds\n", (TimerNanoseconds() - buildTimer) * 1e-9);
+    if (stored != CACHE_SUCCESS && stored != CACHE_OFF)
+        printf("Program binary not cached in %s: %s\n", programCache, CacheStatusString(stored));
+    return program;
+}
+
+// Whether device buffers are zero-copy: as --zero-copy says, or when the
+// device shares host memory
+// *********************************************************************
+bool DeviceZeroCopy()
+{
+    if (zeroCopyMode >= 0) return zeroCopyMode == 1;
+    cl_bool hostUnified = CL_FALSE;
+    clGetDeviceInfo(cdDevice, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &hostUnified, NULL);
+    return hostUnified == CL_TRUE;
+}
+
+// Context, queue, buffers, program and kernel of the driver's own
+// launches, which stream the sites or split them across devices (resident
+// runs go through deviceEngine instead), and the upload of the models and
+// the tree.  Exits on failure.
+// *********************************************************************
+void SetupDriverDevice()
+{
+    //Create the context
+    cxGPUContext = clCreateContext(0, 1, &cdDevice, NULL, NULL, &ciErr1);
+    printf("clCreateContext...\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateContext, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+	
+    // Create a command-queue, with event timestamps when profiling
+    cqCommandQueue = clCreateCommandQueue(cxGPUContext, cdDevice, profiler ? CL_QUEUE_PROFILING_ENABLE : 0, &ciErr1);
+    if (chunkSites)
+    {
+        // streaming moves the transfers to queues of their own
+        cqUpload = clCreateCommandQueue(cxGPUContext, cdDevice, profiler ? CL_QUEUE_PROFILING_ENABLE : 0, &ciErr2);
+        ciErr1 |= ciErr2;
+        cqDownload = clCreateCommandQueue(cxGPUContext, cdDevice, profiler ? CL_QUEUE_PROFILING_ENABLE : 0, &ciErr2);
+        ciErr1 |= ciErr2;
+    }
+    printf("clCreateCommandQueue...\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateCommandQueue, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+	
+    // Allocate the OpenCL buffer memory objects for source and result on the device GMEM:
+    // partials and scalings for one chunk per stream slot (or, split
+    // across devices, for the device's share: see DeviceShare).  Zero-copy
+    // devices wrap the host models instead (streaming keeps its own copies
+    // of each chunk).
+    bool zeroCopy = DeviceZeroCopy();
+    long modelsSize = (long)tree->nodeCount*categoryCount*characterCount*characterCount;
+    bufferPool = CreateBufferPool(cxGPUContext, zeroCopy);
+    printf("Device buffers: %s\n", zeroCopy ? "zero-copy, mapped transfers" : "device memory, copied transfers");
+    int slotIndex;
+    ciErr1 = CL_SUCCESS;
+    if (chunkSites)
+    {
+        for (slotIndex = 0; slotIndex < STREAM_SLOTS; slotIndex++)
+        {
+            streamSlots[slotIndex].partials = PoolAcquire(bufferPool, CL_MEM_READ_WRITE,
+                                                storageBytes * LayoutSize(&deviceLayout, tree, chunkSites, categoryCount),
+                                                NULL, &ciErr2);
+            ciErr1 |= ciErr2;
+            streamSlots[slotIndex].scalings = PoolAcquire(bufferPool, CL_MEM_READ_WRITE,
+                                                sizeof(cl_int) * tree->nodeCount * chunkSites, NULL, &ciErr2);
+            ciErr1 |= ciErr2;
+        }
+    }
+    cmModels = PoolAcquire(bufferPool, CL_MEM_READ_ONLY,
+                           storageBytes * modelsSize, deviceModels, &ciErr2);
+    ciErr1 |= ciErr2;
+    cmChildStart = PoolAcquire(bufferPool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount + 1), NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    cmChildren = PoolAcquire(bufferPool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount - 1), NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    cmLevelNodes = PoolAcquire(bufferPool, CL_MEM_READ_ONLY, sizeof(cl_int) * (tree->nodeCount - tree->tipCount),
+                               NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    printf("clCreateBuffer...\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+	
+	// Create the program
+    cpProgram = BuildProgram(cxGPUContext, cdDevice, charTile);
+	
+    // Create the kernel
+    ckKernel = clCreateKernel(cpProgram, "FirstLoop", &ciErr1);
+    printf("clCreateKernel (FirstLoop)...\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+	
+	
+    int tempLevelOffset = 0;
+    int tempSiteCount = patternCount;
+    int tempCharCount = characterCount;
+	
+    // Set the Argument values (the level offset, arg 8, is reset per launch;
+    // the buffers and site count, 0, 2 and 9, per chunk or device share)
+    ciErr1 = clSetKernelArg(ckKernel, 0, sizeof(cl_mem), (void*)&streamSlots[0].partials);
+    ciErr1 |= clSetKernelArg(ckKernel, 1, sizeof(cl_mem), (void*)&cmModels);
+    ciErr1 |= clSetKernelArg(ckKernel, 2, sizeof(cl_mem), (void*)&streamSlots[0].scalings);
+    ciErr1 |= clSetKernelArg(ckKernel, 3, sizeof(cl_mem), (void*)&cmChildStart);
+    ciErr1 |= clSetKernelArg(ckKernel, 4, sizeof(cl_mem), (void*)&cmChildren);
+    ciErr1 |= clSetKernelArg(ckKernel, 5, sizeof(cl_mem), (void*)&cmLevelNodes);
+    ciErr1 |= clSetKernelArg(ckKernel, 6, modelTileSize * storageBytes, NULL);
+    ciErr1 |= clSetKernelArg(ckKernel, 7, siteTileSize * accumBytes, NULL);
+    ciErr1 |= clSetKernelArg(ckKernel, 8, sizeof(cl_int), (void*)&tempLevelOffset);
+    ciErr1 |= clSetKernelArg(ckKernel, 9, sizeof(cl_int), (void*)&tempSiteCount);
+    ciErr1 |= clSetKernelArg(ckKernel, 10, sizeof(cl_int), (void*)&tempCharCount);
+    ciErr1 |= clSetKernelArg(ckKernel, 11, accumBytes, (void*)deviceUflowThresh);
+    ciErr1 |= clSetKernelArg(ckKernel, 12, sizeof(cl_int), (void*)&tree->tipCount);
+    printf("clSetKernelArg 0 - 12...\n\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    // Asynchronous write of data to GPU device
+    // The tip partials, the only partials that are inputs, go up chunk by
+    // chunk while streaming, and each device's share of them when split.
+    size_t modelBytes = storageBytes * modelsSize;
+    ciErr1 = UploadBuffer(bufferPool, cqCommandQueue, cmModels, 0, modelBytes, deviceModels,
+                          ProfileEvent(profiler, PROFILE_WRITE, "models", modelBytes, NULL, 0));
+    size_t scheduleBytes[3] = { sizeof(cl_int) * (tree->nodeCount + 1), sizeof(cl_int) * (tree->nodeCount - 1),
+                                sizeof(cl_int) * (tree->nodeCount - tree->tipCount) };
+    ciErr1 |= UploadBuffer(bufferPool, cqCommandQueue, cmChildStart, 0, scheduleBytes[0], tree->childStart,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[0], NULL, 0));
+    ciErr1 |= UploadBuffer(bufferPool, cqCommandQueue, cmChildren, 0, scheduleBytes[1], tree->children,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[1], NULL, 0));
+    ciErr1 |= UploadBuffer(bufferPool, cqCommandQueue, cmLevelNodes, 0, scheduleBytes[2], tree->levelNodes,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[2], NULL, 0));
+    printf("clEnqueueWriteBuffer (models and tree schedule)...\n"); 
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+}
+
+// The event slot of one engine command in the profile: the engine's
+// EngineEventHook, with the profiler as user
+// *********************************************************************
+cl_event* ProfileEngineCommand(void* user, EngineCommand command, const char* label, size_t bytes, const int* nodes,
+                               int nodeCount)
+{
+    static const ProfileOperation operations[] = { PROFILE_WRITE, PROFILE_KERNEL, PROFILE_READ };
+    return ProfileEvent((DeviceProfiler*)user, operations[command], label, bytes, nodes, nodeCount);
+}
+
+// The library engine a resident run goes through, on the device of
+// deviceOptions with the launch shape, layout and zero-copy mode settled
+// above, and the tips and every model handed to it.  The engine builds
+// (or loads) its own program and keeps the partials, scalings and the
+// log-likelihood reduction on the device.  Exits on failure.
+// *********************************************************************
+void CreateDeviceEngine(const EngineOptions* deviceOptions)
+{
+    EngineOptions options = *deviceOptions;
+    options.sitesPerGroup = sitesPerGroup;
+    options.localWorkSize = szLocalWorkSize[0];
+    options.unroll = unrollFactor;
+    options.layout = deviceLayout.kind;
+    options.zeroCopy = DeviceZeroCopy() ? 1 : 0;
+    options.eventHook = profiler ? ProfileEngineCommand : NULL;
+    options.eventUser = profiler;
+
+    long long buildTimer = TimerNanoseconds();
+    EngineStatus status = EngineCreate(&options, tree, patternCount, characterCount, categoryCount, &deviceEngine,
+                                       &ciErr1);
+    printf("EngineCreate...\n");
+    if (status != ENGINE_SUCCESS)
+    {
+        printf("Error in EngineCreate: %s (OpenCL error %d), Line %u in file %s !!!\n\n", EngineStatusString(status),
+               ciErr1, __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    printf("Device buffers: %s\n", options.zeroCopy ? "zero-copy, mapped transfers" : "device memory, copied transfers");
+    CacheStatus loaded, stored;
+    EngineProgramCache(deviceEngine, &loaded, &stored);
+    if (loaded == CACHE_REJECTED) printf("Cached program binary in %s rejected, rebuilt from source\n", programCache);
+    if (stored != CACHE_SUCCESS && stored != CACHE_OFF)
+        printf("Program binary not cached in %s: %s\n", programCache, CacheStatusString(stored));
+    printf("Engine created in %f seconds (program %s)\n", (TimerNanoseconds() - buildTimer) * 1e-9,
+           (loaded == CACHE_SUCCESS) ? "binary loaded from the cache" : "built from source");
+    size_t reduceLocalSize, reduceGroups;
+    ConfigureReduction(cdDevice, patternCount, &reduceLocalSize, &reduceGroups);
+    printf("Log likelihood reduction: %lu groups of %lu work items, then one\n\n", (unsigned long)reduceGroups,
+           (unsigned long)reduceLocalSize);
+
+    CheckEngine(EngineSetTips(deviceEngine, (const fpoint*)partials), "EngineSetTips");
+    CheckEngine(EngineSetModels(deviceEngine, NULL, tree->nodeCount, (const fpoint*)models), "EngineSetModels");
+    printf("EngineSetTips, EngineSetModels (tip partials and models)...\n");
+}
+
+// Exit with the engine's error unless status is ENGINE_SUCCESS
+// *********************************************************************
+void CheckEngine(EngineStatus status, const char* call)
+{
+    if (status == ENGINE_SUCCESS) return;
+    printf("Error in %s: %s (OpenCL error %d)\n\n", call, EngineStatusString(status), EngineLastError(deviceEngine));
+    Cleanup(EXIT_FAILURE);
+}
+
+// Re-prune what is stale in the resident engine and read its root into
+// partials and scalings; every command so far has then completed, so
+// their profiling events are collected
+// *********************************************************************
+void EvaluateRoot()
+{
+    CheckEngine(EngineEvaluate(deviceEngine), "EngineEvaluate");
+    CheckEngine(EngineRootPartials(deviceEngine, (fpoint*)partials + NodePartialsOffset(tree, tree->root, patternCount,
+                                                                                       characterCount, categoryCount),
+                                   (int*)scalings + tree->root * patternCount), "EngineRootPartials");
+    ProfileCollect(profiler);
+}
+
+// Re-prune what is stale in the resident engine and reduce its root to
+// the log-likelihood on the device (the per-site values into siteLogL
+// when it is not NULL), under the rate weights, uniform frequencies and
+// the pattern weights; collects the profile like EvaluateRoot
+// *********************************************************************
+double EvaluateLogLikelihood(double* siteLogL)
+{
+    double logLikelihood;
+    CheckEngine(EngineEvaluate(deviceEngine), "EngineEvaluate");
+    CheckEngine(EngineLogLikelihood(deviceEngine, substitutionModel->rateWeights, NULL, patternWeights, &logLikelihood,
+                                    siteLogL), "EngineLogLikelihood");
+    ProfileCollect(profiler);
+    return logLikelihood;
+}
+
+// Enqueue one launch per non-empty level of a schedule laid out like
+// tree->levelStart / levelNodes on queue; levelNodes is the device copy of
+// its nodes, label names the launches in the profile ("<label> <level>")
+// *********************************************************************
+void EnqueueLevels(cl_command_queue queue, cl_kernel kernel, cl_mem levelNodes, const int* levelStart, const int* nodes,
+                   const char* label)
+{
+    char levelLabel[32];
+    ciErr1 = clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*)&levelNodes);
+    int levelIndex;
+    for (levelIndex = 0; levelIndex < tree->levelCount; levelIndex++)
+    {
+        int levelOffset = levelStart[levelIndex];
+        szGlobalWorkSize[1] = levelStart[levelIndex+1] - levelStart[levelIndex];
+        if (szGlobalWorkSize[1] == 0) continue;    // nothing stale at this level
+        ciErr1 |= clSetKernelArg(kernel, 8, sizeof(cl_int), (void*)&levelOffset);
+        sprintf(levelLabel, "%.16s %d", label, levelIndex + 1);
+        ciErr1 |= clEnqueueNDRangeKernel(queue, kernel, 2, NULL, 
+										szGlobalWorkSize, szLocalWorkSize, 0, NULL,
+                                        ProfileEvent(profiler, PROFILE_KERNEL, levelLabel, 0, nodes + levelOffset,
+                                                     (int)szGlobalWorkSize[1]));
+        
+        if (ciErr1 != CL_SUCCESS)
+        {
+            printf("%i\n", ciErr1); //prints "1"
+            switch(ciErr1)
+            {
+                case   CL_INVALID_PROGRAM_EXECUTABLE: printf("CL_INVALID_PROGRAM_EXECUTABLE\n"); break;
+                case   CL_INVALID_COMMAND_QUEUE: printf("CL_INVALID_COMMAND_QUEUE\n"); break;
                 case   CL_INVALID_KERNEL: printf("CL_INVALID_KERNEL\n"); break;
                 case   CL_INVALID_CONTEXT: printf("CL_INVALID_CONTEXT\n"); break;   
                 case   CL_INVALID_KERNEL_ARGS: printf("CL_INVALID_KERNEL_ARGS\n"); break;
@@ -386,97 +1473,593 @@ int main(int argc, char **argv)
 		//      ciErr1 = clEnqueueBarrier(cqCommandQueue);
 		
     }
-    
-	//    clock_gettime(CLOCK_REALTIME, &end);
-	
-    // Synchronous/blocking read of results, and check accumulated errors
-    ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmParent_cache, CL_TRUE, 0, sizeof(clfp) * CHARACTERS * SITES, parent_cache, 0, NULL, NULL);
-    ciErr1 = clEnqueueReadBuffer(cqCommandQueue, cmScalings, CL_TRUE, 0, sizeof(cl_int) * CHARACTERS * SITES, scalings, 0, NULL, NULL);
-    printf("clEnqueueReadBuffer...\n\n"); 
+}
+
+// Stream every site through the device in chunks of chunkSites, one
+// stream slot per chunk in turn.  Tips go up on cqUpload, the levels run
+// on cqCommandQueue and the root rows come back on cqDownload; each chunk
+// only waits on events of its own slot, so chunk k+1 uploads while chunk k
+// computes and chunk k-1 downloads.  Ends with the root partials and
+// scalings of every site in partials and scalings.
+// *********************************************************************
+void StreamTraversal()
+{
+    int chunkCount = (patternCount + chunkSites - 1) / chunkSites;
+    int charSpan = LayoutCharSpan(&deviceLayout);     // site-major: values per site row
+    size_t rootOffset = LayoutNodeOffset(&deviceLayout, tree, tree->root, patternCount, categoryCount);
+    int chunk;
+    for (chunk = 0; chunk < chunkCount; chunk++)
+    {
+        StreamSlot* slot = &streamSlots[chunk % STREAM_SLOTS];
+        int chunkStart = chunk * chunkSites;
+        int sites = (patternCount - chunkStart < chunkSites) ? patternCount - chunkStart : chunkSites;
+        size_t rowBytes = storageBytes * sites * charSpan;
+        cl_event uploaded, computed;
+
+        // The kernel never writes tip scalings, but an earlier chunk of
+        // another width laid internal rows over them: zero them again from
+        // the host tip scalings, which are all 0.  The in-order upload
+        // queue finishes this before the tips below.
+        ciErr1 = CL_SUCCESS;
+        if (slot->zeroedSites != sites)
+        {
+            ciErr1 = clEnqueueWriteBuffer(cqUpload, slot->scalings, CL_FALSE, 0, sizeof(cl_int) * tree->tipCount * sites,
+                                          scalings, slot->downloaded ? 1 : 0, slot->downloaded ? &slot->downloaded : NULL,
+                                          ProfileEvent(profiler, PROFILE_WRITE, "chunk tip scalings",
+                                                       sizeof(cl_int) * tree->tipCount * sites, NULL, 0));
+            slot->zeroedSites = sites;
+        }
+
+        // tip rows of this chunk, packed at its width (the kernel's site stride)
+        size_t bufferOrigin[3] = { 0, 0, 0 };
+        size_t hostOrigin[3] = { storageBytes * chunkStart * charSpan, 0, 0 };
+        size_t region[3] = { rowBytes, (size_t)tree->tipCount, 1 };
+        ciErr1 |= clEnqueueWriteBufferRect(cqUpload, slot->partials, CL_FALSE, bufferOrigin, hostOrigin, region,
+                                           rowBytes, 0, storageBytes * patternCount * charSpan, 0, devicePartials,
+                                           slot->downloaded ? 1 : 0, slot->downloaded ? &slot->downloaded : NULL,
+                                           &uploaded);
+        if (slot->downloaded) clReleaseEvent(slot->downloaded);
+        slot->downloaded = NULL;
+        if (ciErr1 != CL_SUCCESS)
+        {
+            printf("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+            Cleanup(EXIT_FAILURE);
+        }
+        ProfileAttachEvent(profiler, uploaded, PROFILE_WRITE, "chunk tips", rowBytes * tree->tipCount, NULL, 0);
+        clFlush(cqUpload);
+
+        // the levels, once the tips are there; arguments are captured at
+        // enqueue time, so the next chunk can reset them right away
+        int siteGroups = (sites + sitesPerGroup - 1) / sitesPerGroup;
+        szGlobalWorkSize[0] = siteGroups * szLocalWorkSize[0];
+        ciErr1 = clEnqueueWaitForEvents(cqCommandQueue, 1, &uploaded);
+        ciErr1 |= clSetKernelArg(ckKernel, 0, sizeof(cl_mem), (void*)&slot->partials);
+        ciErr1 |= clSetKernelArg(ckKernel, 2, sizeof(cl_mem), (void*)&slot->scalings);
+        ciErr1 |= clSetKernelArg(ckKernel, 9, sizeof(cl_int), (void*)&sites);
+        clReleaseEvent(uploaded);
+        if (ciErr1 != CL_SUCCESS)
+        {
+            printf("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+            Cleanup(EXIT_FAILURE);
+        }
+        EnqueueLevels(cqCommandQueue, ckKernel, cmLevelNodes, tree->levelStart, tree->levelNodes, "level");
+        ciErr1 = clEnqueueMarker(cqCommandQueue, &computed);
+        clFlush(cqCommandQueue);
+
+        // root rows (every category) straight into place; the scalings
+        // read, last on the in-order download queue, frees the slot
+        size_t rootBytes = categoryCount * rowBytes;
+        ciErr1 |= clEnqueueReadBuffer(cqDownload, slot->partials, CL_FALSE,
+                                      storageBytes * LayoutNodeOffset(&deviceLayout, tree, tree->root, sites, categoryCount),
+                                      rootBytes, (char*)devicePartials + storageBytes * (rootOffset +
+                                          (size_t)chunkStart * categoryCount * charSpan), 1, &computed,
+                                      ProfileEvent(profiler, PROFILE_READ, "chunk root partials", rootBytes, NULL, 0));
+        ciErr1 |= clEnqueueReadBuffer(cqDownload, slot->scalings, CL_FALSE, sizeof(cl_int) * tree->root * sites,
+                                      sizeof(cl_int) * sites, (int*)scalings + tree->root * patternCount + chunkStart,
+                                      0, NULL, &slot->downloaded);
+        clReleaseEvent(computed);
+        if (ciErr1 != CL_SUCCESS)
+        {
+            printf("Error in clEnqueueReadBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+            Cleanup(EXIT_FAILURE);
+        }
+        ProfileAttachEvent(profiler, slot->downloaded, PROFILE_READ, "chunk root scalings", sizeof(cl_int) * sites,
+                           NULL, 0);
+        clFlush(cqDownload);
+    }
+
+    clFinish(cqDownload);
+    for (chunk = 0; chunk < STREAM_SLOTS; chunk++)
+    {
+        if (streamSlots[chunk].downloaded) clReleaseEvent(streamSlots[chunk].downloaded);
+        streamSlots[chunk].downloaded = NULL;
+    }
+    LoadDeviceRoot();
+    ProfileCollect(profiler);
+}
+
+// Give one more device its own context, queue and buffer pool, copies of
+// the models and tree schedule, and a kernel built for its local memory;
+// ResizeDeviceShare gives it its sites
+// *********************************************************************
+void SetupDeviceShare(DeviceShare* share, cl_device_id device)
+{
+    share->device = device;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(share->name) - 1, share->name, NULL);
+    printf("Connecting to %s...\n", share->name);
+    int tile = DeviceCharTile(device);
+    share->context = clCreateContext(0, 1, &device, NULL, NULL, &ciErr1);
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateContext, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    share->queue = clCreateCommandQueue(share->context, device, profiler ? CL_QUEUE_PROFILING_ENABLE : 0, &ciErr1);
     if (ciErr1 != CL_SUCCESS)
     {
-        printf("%i\n", ciErr1); //prints "1"
-        switch(ciErr1)
-        {
-            case   CL_INVALID_COMMAND_QUEUE: printf("CL_INVALID_COMMAND_QUEUE\n"); break;
-            case   CL_INVALID_CONTEXT: printf("CL_INVALID_CONTEXT\n"); break;
-            case   CL_INVALID_MEM_OBJECT: printf("CL_INVALID_MEM_OBJECT\n"); break;
-            case   CL_INVALID_VALUE: printf("CL_INVALID_VALUE\n"); break;   
-            case   CL_INVALID_EVENT_WAIT_LIST: printf("CL_INVALID_EVENT_WAIT_LIST\n"); break;
-				//          case   CL_MISALIGNED_SUB_BUFFER_OFFSET: printf("CL_MISALIGNED_SUB_BUFFER_OFFSET\n"); break;
-				//          case   CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST: printf("CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST\n"); break;
-            case   CL_MEM_OBJECT_ALLOCATION_FAILURE: printf("CL_MEM_OBJECT_ALLOCATION_FAILURE\n"); break;
-            case   CL_OUT_OF_RESOURCES: printf("CL_OUT_OF_RESOURCES\n"); break;
-            case   CL_OUT_OF_HOST_MEMORY: printf("CL_OUT_OF_HOST_MEMORY\n"); break;
-            default: printf("Strange error\n"); //This is printed
+        printf("Error in clCreateCommandQueue, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    cl_bool hostUnified = CL_FALSE;
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &hostUnified, NULL);
+    share->pool = CreateBufferPool(share->context, (zeroCopyMode < 0) ? (hostUnified == CL_TRUE) : (zeroCopyMode == 1));
+
+    // the host models are not wrapped: the first device may use them in place
+    size_t modelBytes = storageBytes * tree->nodeCount * categoryCount * characterCount * characterCount;
+    size_t scheduleBytes[3] = { sizeof(cl_int) * (tree->nodeCount + 1), sizeof(cl_int) * (tree->nodeCount - 1),
+                                sizeof(cl_int) * (tree->nodeCount - tree->tipCount) };
+    share->models = PoolAcquire(share->pool, CL_MEM_READ_ONLY, modelBytes, NULL, &ciErr1);
+    share->childStart = PoolAcquire(share->pool, CL_MEM_READ_ONLY, scheduleBytes[0], NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    share->children = PoolAcquire(share->pool, CL_MEM_READ_ONLY, scheduleBytes[1], NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    share->levelNodes = PoolAcquire(share->pool, CL_MEM_READ_ONLY, scheduleBytes[2], NULL, &ciErr2);
+    ciErr1 |= ciErr2;
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    ciErr1 = UploadBuffer(share->pool, share->queue, share->models, 0, modelBytes, deviceModels,
+                          ProfileEvent(profiler, PROFILE_WRITE, "models", modelBytes, NULL, 0));
+    ciErr1 |= UploadBuffer(share->pool, share->queue, share->childStart, 0, scheduleBytes[0], tree->childStart,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[0], NULL, 0));
+    ciErr1 |= UploadBuffer(share->pool, share->queue, share->children, 0, scheduleBytes[1], tree->children,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[1], NULL, 0));
+    ciErr1 |= UploadBuffer(share->pool, share->queue, share->levelNodes, 0, scheduleBytes[2], tree->levelNodes,
+                           ProfileEvent(profiler, PROFILE_WRITE, "tree schedule", scheduleBytes[2], NULL, 0));
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+
+    share->program = BuildProgram(share->context, device, tile);
+    share->kernel = clCreateKernel(share->program, "FirstLoop", &ciErr1);
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clCreateKernel, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+    // 0, 2 and 9 follow the share's sites, 5 and 8 each launch
+    int characters = characterCount;
+    ciErr1 = clSetKernelArg(share->kernel, 1, sizeof(cl_mem), (void*)&share->models);
+    ciErr1 |= clSetKernelArg(share->kernel, 3, sizeof(cl_mem), (void*)&share->childStart);
+    ciErr1 |= clSetKernelArg(share->kernel, 4, sizeof(cl_mem), (void*)&share->children);
+    ciErr1 |= clSetKernelArg(share->kernel, 6, (size_t)characterCount * tile * storageBytes, NULL);
+    ciErr1 |= clSetKernelArg(share->kernel, 7, siteTileSize * accumBytes, NULL);
+    ciErr1 |= clSetKernelArg(share->kernel, 10, sizeof(cl_int), (void*)&characters);
+    ciErr1 |= clSetKernelArg(share->kernel, 11, accumBytes, (void*)deviceUflowThresh);
+    ciErr1 |= clSetKernelArg(share->kernel, 12, sizeof(cl_int), (void*)&tree->tipCount);
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clSetKernelArg, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+}
+
+// Move a share to sites patterns from firstSite: new partials and
+// scalings from its pool when the width changes (tip scalings zeroed, as
+// a recycled buffer holds anything), its tip rows uploaded packed at that
+// width, and its kernel pointed at them
+// *********************************************************************
+void ResizeDeviceShare(DeviceShare* share, int firstSite, int sites)
+{
+    share->firstSite = firstSite;
+    share->sites = sites;
+    if (sites == 0) return;
+    ciErr1 = CL_SUCCESS;
+    if (sites != share->allocatedSites)
+    {
+        PoolRelease(share->pool, share->partials);
+        PoolRelease(share->pool, share->scalings);
+        share->partials = PoolAcquire(share->pool, CL_MEM_READ_WRITE,
+                                      storageBytes * LayoutSize(&deviceLayout, tree, sites, categoryCount), NULL,
+                                      &ciErr1);
+        share->scalings = PoolAcquire(share->pool, CL_MEM_READ_WRITE, sizeof(cl_int) * tree->nodeCount * sites, NULL,
+                                      &ciErr2);
+        ciErr1 |= ciErr2;
+        if (ciErr1 != CL_SUCCESS)
+        {
+            printf("Error in clCreateBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+            Cleanup(EXIT_FAILURE);
         }
+        share->allocatedSites = sites;
+        // the host tip scalings are all 0
+        ciErr1 = clEnqueueWriteBuffer(share->queue, share->scalings, CL_FALSE, 0, sizeof(cl_int) * tree->tipCount * sites,
+                                      scalings, 0, NULL, ProfileEvent(profiler, PROFILE_WRITE, "share tip scalings",
+                                                                      sizeof(cl_int) * tree->tipCount * sites, NULL, 0));
+    }
+
+    int charSpan = LayoutCharSpan(&deviceLayout);     // site-major: values per site row
+    size_t rowBytes = storageBytes * sites * charSpan;
+    size_t bufferOrigin[3] = { 0, 0, 0 };
+    size_t hostOrigin[3] = { storageBytes * firstSite * charSpan, 0, 0 };
+    size_t region[3] = { rowBytes, (size_t)tree->tipCount, 1 };
+    ciErr1 |= clEnqueueWriteBufferRect(share->queue, share->partials, CL_FALSE, bufferOrigin, hostOrigin, region,
+                                       rowBytes, 0, storageBytes * patternCount * charSpan, 0, devicePartials, 0, NULL,
+                                       ProfileEvent(profiler, PROFILE_WRITE, "share tips", rowBytes * tree->tipCount,
+                                                    NULL, 0));
+    ciErr1 |= clSetKernelArg(share->kernel, 0, sizeof(cl_mem), (void*)&share->partials);
+    ciErr1 |= clSetKernelArg(share->kernel, 2, sizeof(cl_mem), (void*)&share->scalings);
+    ciErr1 |= clSetKernelArg(share->kernel, 9, sizeof(cl_int), (void*)&share->sites);
+    if (ciErr1 != CL_SUCCESS)
+    {
+        printf("Error in clEnqueueWriteBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
+        Cleanup(EXIT_FAILURE);
+    }
+}
+
+// Enqueue the levels over a share's sites and non-blocking reads of its
+// root rows straight into place in devicePartials and scalings; the
+// caller waits on the share's queue
+// *********************************************************************
+void EnqueueDeviceShare(DeviceShare* share)
+{
+    if (share->sites == 0) return;
+    int charSpan = LayoutCharSpan(&deviceLayout);
+    size_t rootOffset = LayoutNodeOffset(&deviceLayout, tree, tree->root, patternCount, categoryCount);
+    size_t rootBytes = storageBytes * share->sites * categoryCount * charSpan;
+    szGlobalWorkSize[0] = ((share->sites + sitesPerGroup - 1) / sitesPerGroup) * szLocalWorkSize[0];
+    EnqueueLevels(share->queue, share->kernel, share->levelNodes, tree->levelStart, tree->levelNodes, "level");
+    ciErr1 = clEnqueueReadBuffer(share->queue, share->partials, CL_FALSE,
+                                 storageBytes * LayoutNodeOffset(&deviceLayout, tree, tree->root, share->sites, categoryCount),
+                                 rootBytes, (char*)devicePartials + storageBytes * (rootOffset +
+                                     (size_t)share->firstSite * categoryCount * charSpan), 0, NULL,
+                                 ProfileEvent(profiler, PROFILE_READ, "share root partials", rootBytes, NULL, 0));
+    ciErr1 |= clEnqueueReadBuffer(share->queue, share->scalings, CL_FALSE, sizeof(cl_int) * tree->root * share->sites,
+                                  sizeof(cl_int) * share->sites, (int*)scalings + tree->root * patternCount + share->firstSite,
+                                  0, NULL, ProfileEvent(profiler, PROFILE_READ, "share root scalings",
+                                                        sizeof(cl_int) * share->sites, NULL, 0));
+    if (ciErr1 != CL_SUCCESS)
+    {
         printf("Error in clEnqueueReadBuffer, Line %u in file %s !!!\n\n", __LINE__, __FILE__);
         Cleanup(EXIT_FAILURE);
     }
-    //--------------------------------------------------------
-	
-    
-    clFinish(cqCommandQueue);
-    printf("%f seconds on device\n", difftime(time(NULL), dtimer));
-	//    double timeDifference = ((double)end.tv_sec + ((double)end.tv_nsec/1000.0))-((double)begin.tv_sec + ((double)begin.tv_nsec/1000.0));
-	//    printf("%f seconds on device\n", timeDifference);
-    
-    htimer = time(NULL);
-	
-	
-    // Compute and compare results for golden-host and report errors and pass/fail
-    printf("Comparing against Host/C++ computation...\n\n"); 
-    
-    FirstLoopHost ((const fpoint*)node_cache, (const fpoint*)model, (fpoint*)Golden);
-	
-    printf("%f seconds on host\n", difftime(time(NULL), htimer));
-	
-	/*
-	 int goldenLoop = 0;
-	 for (goldenLoop = 0; goldenLoop < SITES; goldenLoop++)
-	 {
-	 printf("Golden: %e\n", ((fpoint*)Golden)[goldenLoop*CHARACTERS]);
-	 }
-	 */
-	
-	
-	// Unscaling
-	//***************************************************************************
-    int scIndex;
-    for (scIndex = 0; scIndex < CHARACTERS * SITES; scIndex++)
+    clFlush(share->queue);
+}
+
+// Time each device alone on an even split of the sites (after one untimed
+// run for first-launch costs), then divide the sites in proportion to the
+// measured sites per second
+// *********************************************************************
+void BalanceDeviceShares()
+{
+    double throughput[MAX_DEVICES];
+    int shareSites[MAX_DEVICES];
+    int share, run, firstSite;
+    for (share = 0; share < shareCount; share++) throughput[share] = 1.;
+    PartitionSites(throughput, shareCount, patternCount, sitesPerGroup, shareSites);
+    for (share = 0, firstSite = 0; share < shareCount; firstSite += shareSites[share++])
+        ResizeDeviceShare(&deviceShares[share], firstSite, shareSites[share]);
+
+    for (share = 0; share < shareCount; share++)
     {
-        while (((int*)scalings)[scIndex] > 0)
+        DeviceShare* timed = &deviceShares[share];
+        long long elapsed = 0;
+        for (run = 0; run < 2 && timed->sites > 0; run++)
         {
-            ((fpoint*)parent_cache)[scIndex] /= scalar;
-            ((int*)scalings)[scIndex]--;
+            long long start = TimerNanoseconds();
+            EnqueueDeviceShare(timed);
+            clFinish(timed->queue);
+            elapsed = TimerNanoseconds() - start;
         }
+        timed->throughput = (elapsed > 0) ? timed->sites / (elapsed * 1e-9) : 0.;
+        throughput[share] = timed->throughput;
     }
-	
-	
-    bool match = true;
-	//        int unmatching = 0;
-	//        long firstUnmatch = -1;
-	//        long lastUnmatch = -1;
-    int verI;
-    for (verI  = 0; verI < CHARACTERS*SITES; verI++)
+    ProfileCollect(profiler);
+
+    PartitionSites(throughput, shareCount, patternCount, sitesPerGroup, shareSites);
+    printf("Sites split across %d devices:\n", shareCount);
+    for (share = 0, firstSite = 0; share < shareCount; firstSite += shareSites[share++])
+    {
+        ResizeDeviceShare(&deviceShares[share], firstSite, shareSites[share]);
+        printf("  %-40.40s %12.0f sites/s alone  %8d sites\n", deviceShares[share].name, deviceShares[share].throughput,
+               shareSites[share]);
+    }
+    printf("\n");
+}
+
+// Every share at once, one queue per device, then wait for all of them
+// *********************************************************************
+void SplitTraversal()
+{
+    int share;
+    for (share = 0; share < shareCount; share++) EnqueueDeviceShare(&deviceShares[share]);
+    for (share = 0; share < shareCount; share++) clFinish(deviceShares[share].queue);
+    LoadDeviceRoot();
+    ProfileCollect(profiler);
+}
+
+// The root in devicePartials (the device's layout and storage type) into
+// partials
+// *********************************************************************
+void LoadDeviceRoot()
+{
+    LoadDevicePartials((fpoint*)partials + NodePartialsOffset(tree, tree->root, patternCount, characterCount, categoryCount),
+                       (char*)devicePartials + storageBytes * LayoutNodeOffset(&deviceLayout, tree, tree->root, patternCount,
+                                                                               categoryCount),
+                       tree, tree->root, tree->nodeCount, patternCount, categoryCount, &deviceLayout, storageBytes);
+}
+
+// A log-likelihood reduced on the device (and its per-site values, when
+// not NULL) against the host reference in Golden, within the relative
+// tolerance of the device precision
+// *********************************************************************
+bool CheckDeviceLikelihood(const char* label, double logLikelihood, const double* siteLogL)
+{
+    size_t rootOffset = NodePartialsOffset(tree, tree->root, patternCount, characterCount, categoryCount);
+    double* goldenSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    double golden = RootLogLikelihood((const fpoint*)Golden + rootOffset, (const int*)GoldenScalings + tree->root * patternCount,
+                                      goldenSiteLogL);
+    double error = fabs(logLikelihood - golden) / fmax(fabs(golden), 1.);
+    printf("%s log likelihood reduction: %f (host %f), relative error %e", label, logLikelihood, golden, error);
+    bool match = error <= relativeTolerance;
+    if (siteLogL)
     {
-		if (verI%(SITES)==0)
-			printf("Device: %e, Host: %e, Scalings: %i\n", ((fpoint*)parent_cache)[verI], ((fpoint*)Golden)[verI], ((int*)scalings)[verI]); 
-		//                if (((fpoint*)parent_cache)[i] != ((fpoint*)Golden)[i]) match = false;
-        if (((fpoint*)parent_cache)[verI] != ((fpoint*)Golden)[verI])
+        double maxSiteError = 0.;
+        int pattern;
+        for (pattern = 0; pattern < patternCount; pattern++)
         {
-            match = false;
-			//                        unmatching++;
-			//                        if (firstUnmatch == -1) firstUnmatch = i;
-			//                        if (lastUnmatch < i) lastUnmatch = i;
+            double siteError = fabs(siteLogL[pattern] - goldenSiteLogL[pattern]) / fmax(fabs(goldenSiteLogL[pattern]), 1.);
+            if (!(siteError <= maxSiteError)) maxSiteError = siteError;     // also catches NaN
         }
+        printf(", per site max %e", maxSiteError);
+        match = match && maxSiteError <= relativeTolerance;
     }
-	//        printf("Unmatching: %i, First: %d, Last: %d\n", unmatching, firstUnmatch, lastUnmatch);
-    printf("%s\n\n", (match) ? "PASSED" : "FAILED");
-	
-	
-    // Cleanup and leave
-    Cleanup (EXIT_SUCCESS);
+    printf(" (tolerance %e)\n", relativeTolerance);
+    free(goldenSiteLogL);
+    return match;
+}
+
+// The device root against the host reference in Golden: ULPs of the root
+// partials in the storage type and relative error of the site
+// log-likelihoods, both within the tolerances of the device precision
+// *********************************************************************
+bool CheckDeviceRoot(const char* label, const fpoint* rootPartials, const int* rootScalings)
+{
+    size_t rootOffset = NodePartialsOffset(tree, tree->root, patternCount, characterCount, categoryCount);
+    const int* goldenScalings = (const int*)GoldenScalings + tree->root * patternCount;
+    double* deviceSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    double* goldenSiteLogL = (double*)malloc(sizeof(double)*patternCount);
+    AccuracyStats stats;
+    CompareRootPartials(rootPartials, rootScalings, (const fpoint*)Golden + rootOffset, goldenScalings, patternCount,
+                        categoryCount*characterCount, storageBytes, &stats);
+    RootLogLikelihood(rootPartials, rootScalings, deviceSiteLogL);
+    RootLogLikelihood((const fpoint*)Golden + rootOffset, goldenScalings, goldenSiteLogL);
+    CompareSiteLogLikelihoods(deviceSiteLogL, goldenSiteLogL, patternCount, &stats);
+    free(deviceSiteLogL);
+    free(goldenSiteLogL);
+    return ReportAccuracy(label, &stats, ulpTolerance, relativeTolerance);
+}
+
+// Summarize the first count entries of benchSamples as the next result
+// *********************************************************************
+void RecordBenchmark(const char* backend, int count, double flops, double bytes)
+{
+    BenchmarkResult* result = &benchResults[benchResultCount++];
+    result->backend = backend;
+    SummarizeTimings(benchSamples, count, &result->stats);
+    result->flops = flops;
+    result->bytes = bytes;
+    PrintBenchmarkResult(result);
+}
+
+// Thread body of one EngineCheck: the tips and every model go to a new
+// engine, then each evaluation re-sets one branch model (unchanged, so
+// the root stays that of the current models) and re-prunes its path
+// *********************************************************************
+void* RunEngineCheck(void* arg)
+{
+    EngineCheck* check = (EngineCheck*)arg;
+    long modelSize = (long)categoryCount*characterCount*characterCount;
+    Engine* engine = NULL;
+    long long timer = TimerNanoseconds();
+    check->status = EngineCreate(&check->options, tree, patternCount, characterCount, categoryCount, &engine,
+                                 &check->clError);
+    if (check->status == ENGINE_SUCCESS) check->status = EngineSetTips(engine, (const fpoint*)partials);
+    if (check->status == ENGINE_SUCCESS)
+        check->status = EngineSetModels(engine, NULL, tree->nodeCount, (const fpoint*)models);
+    if (check->status == ENGINE_SUCCESS) check->status = EngineEvaluate(engine);
+    check->setupSeconds = (TimerNanoseconds() - timer) * 1e-9;
+
+    int evaluation;
+    timer = TimerNanoseconds();
+    for (evaluation = 0; evaluation < benchRepeat && check->status == ENGINE_SUCCESS; evaluation++)
+    {
+        int branch = evaluation % (tree->nodeCount - 1);
+        check->status = EngineSetModels(engine, &branch, 1, (const fpoint*)models + branch*modelSize);
+        if (check->status == ENGINE_SUCCESS) check->status = EngineEvaluate(engine);
+        if (check->status == ENGINE_SUCCESS)
+            check->status = EngineLogLikelihood(engine, substitutionModel->rateWeights, NULL, check->patternWeights,
+                                                &check->logLikelihood, NULL);
+    }
+    check->evaluationSeconds = (TimerNanoseconds() - timer) * 1e-9 / benchRepeat;
+
+    if (check->status == ENGINE_SUCCESS)
+    {
+        check->rootPartials = (fpoint*)malloc(sizeof(fpoint)*categoryCount*characterCount*patternCount);
+        check->rootScalings = (int*)malloc(sizeof(int)*patternCount);
+        check->status = (check->rootPartials && check->rootScalings)
+                        ? EngineRootPartials(engine, check->rootPartials, check->rootScalings)
+                        : ENGINE_ERROR_OUT_OF_MEMORY;
+    }
+    if (engine) check->clError = EngineLastError(engine);
+    EngineFree(engine);
+    return NULL;
+}
+
+// Seconds per full evaluation of the run's tips and models on the device
+// of options, through a library engine built for them: the mean of trials
+// after one untimed evaluation (which also pays for the build).  *status
+// says whether the engine could run them at all.
+// *********************************************************************
+double TimeEngine(const EngineOptions* options, int trials, EngineStatus* status)
+{
+    Engine* engine = NULL;
+    int trial;
+    *status = EngineCreate(options, tree, patternCount, characterCount, categoryCount, &engine, NULL);
+    if (*status == ENGINE_SUCCESS) *status = EngineSetTips(engine, (const fpoint*)partials);
+    if (*status == ENGINE_SUCCESS) *status = EngineSetModels(engine, NULL, tree->nodeCount, (const fpoint*)models);
+    if (*status == ENGINE_SUCCESS) *status = EngineEvaluate(engine);
+    long long timer = TimerNanoseconds();
+    for (trial = 0; trial < trials && *status == ENGINE_SUCCESS; trial++)
+    {
+        // every model again, so each evaluation is a full traversal
+        *status = EngineSetModels(engine, NULL, tree->nodeCount, (const fpoint*)models);
+        if (*status == ENGINE_SUCCESS) *status = EngineEvaluate(engine);
+    }
+    double seconds = (TimerNanoseconds() - timer) * 1e-9 / trials;
+    EngineFree(engine);
+    return seconds;
+}
+
+// Time LAYOUT_TRIALS full evaluations in each layout on the device of
+// options (TimeEngine); return the fastest.  State-major is left out
+// unless resident.  A layout the device cannot run is skipped; packed
+// when none can.
+// *********************************************************************
+LayoutKind ChooseDeviceLayout(const EngineOptions* options, bool resident)
+{
+    LayoutKind best = LAYOUT_PACKED;
+    double bestSeconds = 0.;
+    int kind;
+    printf("Benchmarking partials layouts (%d evaluations each)...\n", LAYOUT_TRIALS);
+    for (kind = 0; kind < LAYOUT_KINDS; kind++)
+    {
+        if (kind == LAYOUT_STATE_MAJOR && !resident) continue;
+        EngineOptions layoutOptions = *options;
+        layoutOptions.layout = (LayoutKind)kind;
+        EngineStatus status;
+        double seconds = TimeEngine(&layoutOptions, LAYOUT_TRIALS, &status);
+        if (status != ENGINE_SUCCESS)
+        {
+            printf("  %-8s %s\n", LayoutName((LayoutKind)kind), EngineStatusString(status));
+            continue;
+        }
+        printf("  %-8s %12.3f ms per traversal\n", LayoutName((LayoutKind)kind), seconds * 1e3);
+        if (bestSeconds == 0. || seconds < bestSeconds)
+        {
+            best = (LayoutKind)kind;
+            bestSeconds = seconds;
+        }
+    }
+    return best;
+}
+
+// The fastest launch shape on the device of options for the run's
+// problem, by coordinate search from start: every power of two of sites
+// per group up to TUNE_MAX_SITES, then of the work group size from the
+// narrowest up to TUNE_GROUP_WIDENING times it (within the device's
+// limit), then of the unroll factor up to TUNE_MAX_UNROLL when the kernel
+// is specialized, each pass keeping the best of the ones before.  Every
+// candidate is TUNE_TRIALS evaluations (TimeEngine); one the device
+// cannot run is skipped.  *bestSeconds is the winner's time, 0 when none
+// ran (start comes back).
+// *********************************************************************
+KernelTuning TuneKernel(const EngineOptions* options, const KernelTuning* start, double* bestSeconds)
+{
+    KernelTuning best = *start;
+    size_t narrowest = roundUpToNextPowerOfTwo(characterCount);
+    if (best.localWorkSize == 0) best.localWorkSize = narrowest;
+    size_t maxWorkGroupSize = 0;
+    clGetDeviceInfo(cdDevice, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    *bestSeconds = 0.;
+    printf("Tuning the kernel launch for %d characters (%d evaluations each)...\n", characterCount, TUNE_TRIALS);
+    int pass;
+    for (pass = 0; pass < 3; pass++)
+    {
+        size_t first = 1, last = TUNE_MAX_SITES;
+        if (pass == 1)
+        {
+            first = narrowest;
+            last = narrowest * TUNE_GROUP_WIDENING;
+            if (last > maxWorkGroupSize) last = maxWorkGroupSize;
+        }
+        if (pass == 2) last = KernelSpecialized(characterCount) ? TUNE_MAX_UNROLL : 0;
+        KernelTuning base = best;
+        size_t value;
+        for (value = first; value <= last; value *= 2)
+        {
+            // more sites per group than patterns only adds idle work
+            if (pass == 0 && value > 1 && (int)value / 2 >= patternCount) break;
+            KernelTuning tuning = base;
+            if (pass == 0) tuning.sitesPerGroup = (int)value;
+            if (pass == 1) tuning.localWorkSize = value;
+            if (pass == 2) tuning.unroll = (int)value;
+            EngineOptions tuningOptions = *options;
+            tuningOptions.sitesPerGroup = tuning.sitesPerGroup;
+            tuningOptions.localWorkSize = tuning.localWorkSize;
+            tuningOptions.unroll = tuning.unroll;
+            EngineStatus status;
+            double seconds = TimeEngine(&tuningOptions, TUNE_TRIALS, &status);
+            printf("  %4lu work items, %2d sites per group, unroll %d: ", (unsigned long)tuning.localWorkSize,
+                   tuning.sitesPerGroup, tuning.unroll);
+            if (status != ENGINE_SUCCESS)
+            {
+                printf("%s\n", EngineStatusString(status));
+                continue;
+            }
+            printf("%12.3f ms per traversal\n", seconds * 1e3);
+            if (*bestSeconds == 0. || seconds < *bestSeconds)
+            {
+                best = tuning;
+                *bestSeconds = seconds;
+            }
+        }
+    }
+    if (*bestSeconds == 0.) return *start;
+    printf("Fastest: %lu work items, %d sites per group, unroll %d\n", (unsigned long)best.localWorkSize,
+           best.sitesPerGroup, best.unroll);
+    return best;
+}
+
+// Sum over patterns of weight * log(sum_k w_k sum_c pi_c * root[pattern][k][c])
+// with each pattern's rescue exponent undone: the rate categories are
+// mixed here.  Unweighted per-pattern values go to siteLogL when it is not
+// NULL.
+// Equilibrium frequencies are uniform until real models are plugged in.
+// *********************************************************************
+double RootLogLikelihood(const fpoint* rootPartials, const int* rootScalings, double* siteLogL)
+{
+    double logLikelihood = 0.;
+    int pattern, category, parentChar;
+    for (pattern = 0; pattern < patternCount; pattern++)
+    {
+        double siteLikelihood = 0.;
+        for (category = 0; category < categoryCount; category++)
+        {
+            const fpoint* row = rootPartials + ((long)pattern*categoryCount + category)*characterCount;
+            double categoryLikelihood = 0.;
+            for (parentChar = 0; parentChar < characterCount; parentChar++)
+                categoryLikelihood += row[parentChar] / characterCount;
+            siteLikelihood += substitutionModel->rateWeights[category] * categoryLikelihood;
+        }
+        double value = log(siteLikelihood) - rootScalings[pattern] * M_LN2;
+        if (siteLogL) siteLogL[pattern] = value;
+        logLikelihood += sitePatterns->weights[pattern] * value;
+    }
+    return logLikelihood;
 }
 
 void Cleanup (int iExitCode)
@@ -486,71 +2069,40 @@ void Cleanup (int iExitCode)
     if(cPathAndName)free(cPathAndName);
     if(ckKernel)clReleaseKernel(ckKernel);  
     if(cpProgram)clReleaseProgram(cpProgram);
+    FreeDeviceProfiler(profiler);
     if(cqCommandQueue)clReleaseCommandQueue(cqCommandQueue);
+    if(cqUpload)clReleaseCommandQueue(cqUpload);
+    if(cqDownload)clReleaseCommandQueue(cqDownload);
     if(cxGPUContext)clReleaseContext(cxGPUContext);
-    if(cmNode_cache)clReleaseMemObject(cmNode_cache);
-    if(cmModel)clReleaseMemObject(cmModel);
-    if(cmParent_cache)clReleaseMemObject(cmParent_cache);
+    for (int slot = 0; slot < STREAM_SLOTS; slot++)
+        if(streamSlots[slot].downloaded)clReleaseEvent(streamSlots[slot].downloaded);
+    FreeBufferPool(bufferPool);     // every cl_mem above
+    EngineFree(deviceEngine);
+    for (int share = 1; share < shareCount; share++)    // share 0 is the objects above
+    {
+        if(deviceShares[share].kernel)clReleaseKernel(deviceShares[share].kernel);
+        if(deviceShares[share].program)clReleaseProgram(deviceShares[share].program);
+        if(deviceShares[share].queue)clReleaseCommandQueue(deviceShares[share].queue);
+        FreeBufferPool(deviceShares[share].pool);
+        if(deviceShares[share].context)clReleaseContext(deviceShares[share].context);
+    }
 	
     // Free host memory
-    free(node_cache); 
-    free(model);
-    free (parent_cache);
-    free(Golden);
+    if (devicePartials != partials) AlignedFree(devicePartials);
+    if (deviceModels != models) AlignedFree(deviceModels);
+    AlignedFree(partials);
+    AlignedFree(models);
+    AlignedFree(scalings);
+    AlignedFree(Golden);
+    AlignedFree(GoldenScalings);
+    FreeTree(tree);
+    FreeSitePatterns(sitePatterns);
+    CloseAlignment(alignment);
+    FreeMatrixCache(matrixCache);
+    FreeSubstitutionModel(substitutionModel);
+    HostThreadPoolDestroy(hostPool);
+    free(benchSamples);
+    free(patternWeights);
     
     exit (iExitCode);
 }
-
-// "Golden" Host processing vector addition function for comparison purposes
-// *********************************************************************
-void FirstLoopHost(const fpoint* hnode_cache, const fpoint* hmodel, fpoint* hparent_cache)
-{
-    long index, myChar, parentChar, site;
-	
-    fpoint sum;
-	
-	//        long i=0;
-	//        for (i=0;i< CHARACTERS*SITES;i++)
-	//        {
-	//                if (i%10000==0)
-	//                {
-	//                        printf("Node_cache: %e, Parent_cache: %e\n", ((fpoint*)hnode_cache)[i], ((fpoint*)hparent_cache)[i]);
-	//                }
-	//        }
-	
-    for (index = 0; index < NODES; index++) // this is meant to simulate looping over tree nodes
-    {        
-        for (site = 0; site < SITES; site++)
-        {
-            int siteIndex = site*CHARACTERS;
-            for (parentChar = 0; parentChar < CHARACTERS; parentChar++)
-            {
-                sum = 0.;
-                //here
-                for (myChar = 0; myChar < CHARACTERS; myChar++)
-                {
-                    sum += hnode_cache[site*CHARACTERS+myChar] * hmodel[parentChar*CHARACTERS+myChar];
-                }
-                hparent_cache[siteIndex+parentChar] *= sum;
-            }
-        }
-		//                printf("Index: %i, ParentCache: %e\n", index, hparent_cache[0]);
-    }      
-	//        for (index = 0; index < SITES; index++)
-	//        {
-	//                printf("hparent_cache: %e\n", hparent_cache[index*CHARACTERS]);
-	//        }
-}
-
-unsigned int roundUpToNextPowerOfTwo(unsigned int x)
-{
-	x--;
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	x++;
-
-	return x;
-}
@@ -0,0 +1,82 @@
+// *********************************************************************
+// oclFirstLoop shared declarations
+//
+// Precision, problem dimensions and the host-side engine entry points
+// used by both the OpenCL driver and the host reference code.
+// *********************************************************************
+
+#ifndef OCLFIRSTLOOP_H
+#define OCLFIRSTLOOP_H
+
+#if defined(__APPLE__)
+#include <OpenCL/OpenCL.h>
+typedef float fpoint;
+typedef cl_float clfp;
+#define FPOINT_IS_DOUBLE 0
+#else
+#include <oclUtils.h>
+typedef double fpoint;
+typedef cl_double clfp;
+#define FPOINT_IS_DOUBLE 1
+#endif
+
+#include <math.h>
+
+#include "oclTree.h"
+
+// Constants
+//**********************************************************************
+// Defaults for the problem dimensions; --sites, --characters and --nodes
+// override them at runtime.
+#define DEFAULT_SITES       1000    //originally 1000
+#define DEFAULT_CHARACTERS  61      //originally 61 (codons)
+#define DEFAULT_NODES       150     //branches in the default tree (originally 100 loop passes)
+#define STREAM_SLOTS        3       // chunks in flight when streaming: uploading, computing, downloading
+#define LAYOUT_TRIALS       3       // timed evaluations per layout when --layout picks one
+#define TUNE_TRIALS         3       // timed evaluations per candidate launch shape of --tune
+#define TUNE_MAX_SITES      32      // largest sites per group --tune tries
+#define TUNE_GROUP_WIDENING 8       // widest work group --tune tries, in narrowest groups
+#define TUNE_MAX_UNROLL     8       // largest unroll factor --tune tries
+
+// Partials layout
+//**********************************************************************
+// Tips come first with one row of characters per site, shared by every
+// rate category; each internal node then holds categories rows per site,
+// [site][category][character].  Scalings stay one per node and site: a
+// site is rescued across all of its categories at once.  The device may
+// pad or transpose this (oclLayout.h).
+static inline long NodePartialsOffset(const Tree* tree, long node, long sites, int characters, int categories)
+{
+    long rows = (node < tree->tipCount) ? node : tree->tipCount + (node - tree->tipCount)*categories;
+    return rows*sites*characters;
+}
+
+static inline long PartialsSize(const Tree* tree, long sites, int characters, int categories)
+{
+    return NodePartialsOffset(tree, tree->nodeCount, sites, characters, categories);
+}
+
+// Host engine
+//**********************************************************************
+// Felsenstein pruning over the whole tree: for every internal node in
+// post-order and every rate category,
+// partials[node][k] = prod over children of model[child][k] * partials[child][k]
+// (the child's only row when it is a tip).  partials holds PartialsSize
+// values (tips filled in by the caller), models holds categories
+// characters x characters matrices per node (the branch above it) and
+// scalings one binary exponent per node and site: the stored partials are
+// the true ones times 2^scalings (summed down the subtree).
+void FirstLoopHost(const Tree* tree, fpoint* partials, const fpoint* models, int* scalings,
+                   long sites, int characters, int categories, fpoint uflowThresh);
+
+// Underflow rescue for one site: when the largest partial is below
+// uflowThresh, the power of two that brings it back into [0.5, 1), else 0.
+// Applied with ldexp to every character at once, so it is exact.
+static inline int SiteExponentShift(fpoint siteMax, fpoint uflowThresh)
+{
+    int exponent;
+    frexp(siteMax, &exponent);
+    return (siteMax > 0. && siteMax < uflowThresh) ? -exponent : 0;
+}
+
+#endif
@@ -0,0 +1,66 @@
+// *********************************************************************
+// oclFirstLoop host reference
+//
+// Plain scalar Felsenstein pruning used as the "golden" result the
+// OpenCL device computation is checked against.
+// *********************************************************************
+
+#include <math.h>
+
+#include "oclFirstLoop.h"
+
+// "Golden" Host processing of the whole tree for comparison purposes
+// *********************************************************************
+void FirstLoopHost(const Tree* tree, fpoint* hpartials, const fpoint* hmodels, int* hscalings,
+                   long sites, int characters, int categories, fpoint uflowThresh)
+{
+    long node, child, myChar, parentChar, site;
+    int category;
+    const int width = categories*characters;  // one internal site row
+    fpoint sum;
+
+    for (node = tree->tipCount; node < tree->nodeCount; node++) // post-order over internal nodes
+    {
+        fpoint* hparent_cache = hpartials + NodePartialsOffset(tree, node, sites, characters, categories);
+        for (site = 0; site < sites; site++)
+        {
+            fpoint* hparent_row = hparent_cache + site*width;
+            int scaling = 0;
+            for (parentChar = 0; parentChar < width; parentChar++)
+                hparent_row[parentChar] = 1.;
+
+            for (child = tree->childStart[node]; child < tree->childStart[node+1]; child++)
+            {
+                long childNode = tree->children[child];
+                bool tip = childNode < tree->tipCount;
+                const fpoint* hnode_cache = hpartials + NodePartialsOffset(tree, childNode, sites, characters, categories)
+                                          + site*(tip ? characters : width);
+                for (category = 0; category < categories; category++)
+                {
+                    // a tip's one row serves every category
+                    const fpoint* hnode_row = hnode_cache + (tip ? 0 : category*characters);
+                    const fpoint* hmodel = hmodels + (childNode*categories + category)*characters*characters;
+                    for (parentChar = 0; parentChar < characters; parentChar++)
+                    {
+                        sum = 0.;
+                        for (myChar = 0; myChar < characters; myChar++)
+                        {
+                            sum += hnode_row[myChar] * hmodel[parentChar*characters+myChar];
+                        }
+                        hparent_row[category*characters+parentChar] *= sum;
+                    }
+                }
+                scaling += hscalings[childNode*sites+site];
+            }
+
+            // rescue the whole site from underflow, same steps as the kernel
+            fpoint siteMax = 0.;
+            for (parentChar = 0; parentChar < width; parentChar++)
+                if (hparent_row[parentChar] > siteMax) siteMax = hparent_row[parentChar];
+            int shift = SiteExponentShift(siteMax, uflowThresh);
+            for (parentChar = 0; parentChar < width; parentChar++)
+                hparent_row[parentChar] = ldexp(hparent_row[parentChar], shift);
+            hscalings[node*sites+site] = scaling + shift;
+        }
+    }
+}
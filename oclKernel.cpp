@@ -0,0 +1,368 @@
+// *********************************************************************
+// oclKernel: the FirstLoop device kernel, sized and built per device
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oclKernel.h"
+
+// Source code for the computation kernel
+// *********************************************************************
+const char* programSource = "\n" \
+	"#pragma OPENCL EXTENSION cl_khr_fp64: enable                                                                              \n" \
+	"#pragma OPENCL FP_CONTRACT OFF                                                                                            \n" \
+	"// fpoint is the storage type of partials, models and the model tile, accum                                               \n" \
+	"// the type products, sums and the site tile are carried in; the host                                                     \n" \
+	"// supplies both (-D FPOINT=float -D ACCUM=double for mixed precision).                                                   \n" \
+	"typedef FPOINT fpoint;                                                                                                    \n" \
+	"typedef ACCUM accum;                                                                                                      \n" \
+	"// Built with -D FIXED_CHARACTERS=n for the common state counts so the                                                    \n" \
+	"// inner loop has a constant trip count; otherwise it follows the argument.                                               \n" \
+	"// SITES_PER_GROUP, CHAR_TILE, CATEGORY_COUNT and UNROLL are always supplied by                                           \n" \
+	"// the host, and the layout: CHAR_STRIDE, or STATE_MAJOR and SITE_QUANTUM.                                                \n" \
+	"#ifdef FIXED_CHARACTERS                                                                                                   \n" \
+	"#define CHARACTER_COUNT FIXED_CHARACTERS                                                                                  \n" \
+	"#else                                                                                                                     \n" \
+	"#define CHARACTER_COUNT characters                                                                                        \n" \
+	"#endif                                                                                                                    \n" \
+	"// Child characters per model tile (CHAR_TILE is at most CHARACTER_COUNT):                                                \n" \
+	"// a constant when every tile is full, so the unrolled loop over it has a                                                 \n" \
+	"// constant trip count; the runtime width of each tile otherwise.                                                         \n" \
+	"#if defined(FIXED_CHARACTERS) && FIXED_CHARACTERS % CHAR_TILE == 0                                                        \n" \
+	"#define TILE_WIDTH CHAR_TILE                                                                                              \n" \
+	"#else                                                                                                                     \n" \
+	"#define TILE_WIDTH tile                                                                                                   \n" \
+	"#endif                                                                                                                    \n" \
+	"// Tips hold one row of characters per site, shared by every rate category;                                               \n" \
+	"// internal nodes one row per category.  Site-major rows are                                                              \n" \
+	"// [site][category][character] with CHAR_STRIDE values per row; state-major                                               \n" \
+	"// ones [category][character][site] with the sites padded to SITE_QUANTUM.                                                \n" \
+	"#ifdef STATE_MAJOR                                                                                                        \n" \
+	"#define SITE_SPAN ((sites + SITE_QUANTUM - 1) / SITE_QUANTUM * SITE_QUANTUM)                                              \n" \
+	"#define CHAR_SPAN CHARACTER_COUNT                                                                                         \n" \
+	"#else                                                                                                                     \n" \
+	"#define SITE_SPAN sites                                                                                                   \n" \
+	"#define CHAR_SPAN CHAR_STRIDE                                                                                             \n" \
+	"#endif                                                                                                                    \n" \
+	"long NodeOffset(int node, int tipCount, int sites, int characters)                                                        \n" \
+	"{                                                                                                                         \n" \
+	"   long rows = (node < tipCount) ? node : tipCount + (long)(node - tipCount)*CATEGORY_COUNT;                              \n" \
+	"   return rows*SITE_SPAN*CHAR_SPAN;                                                                                       \n" \
+	"}                                                                                                                         \n" \
+	"// (site, category, character) within a node of rows categories                                                           \n" \
+	"long ValueIndex(int site, int cat, int c, int rows, int sites, int characters)                                            \n" \
+	"{                                                                                                                         \n" \
+	"#ifdef STATE_MAJOR                                                                                                        \n" \
+	"   return ((long)cat*CHARACTER_COUNT + c)*SITE_SPAN + site;                                                               \n" \
+	"#else                                                                                                                     \n" \
+	"   return ((long)site*rows + cat)*CHAR_STRIDE + c;                                                                        \n" \
+	"#endif                                                                                                                    \n" \
+	"}                                                                                                                         \n" \
+	"// One work group per block of SITES_PER_GROUP sites of one internal node of                                              \n" \
+	"// the current level, one work item per parent character (items past the                                                  \n" \
+	"// characters, in wider groups, only help stage the tiles).  For every child                                              \n" \
+	"// the branch model is staged in local memory, CHAR_TILE child characters at                                              \n" \
+	"// a time (the whole model when it fits), along with the matching slice of                                                \n" \
+	"// the block's child partials.  Each work item keeps one running sum per site                                             \n" \
+	"// in registers, so every model element read is reused across the block.                                                  \n" \
+	"// Every rate category runs in the same work group, one model after the                                                   \n" \
+	"// other over the same tile; a tip child's staged slice serves them all.                                                  \n" \
+	"__kernel void FirstLoop(__global fpoint* partials, __global const fpoint* models, __global int* scalings,                 \n" \
+	"    __global const int* childStart, __global const int* children, __global const int* levelNodes,                         \n" \
+	"    __local fpoint* modelTile, __local accum* siteTile, int levelOffset, int sites, int characters,                       \n" \
+	"    accum uflowthresh, int tipCount)                                                                                      \n" \
+	"{                                                                                                                         \n" \
+	"   int parentChar = get_local_id(0);                                                                                      \n" \
+	"   int localSize = get_local_size(0);                                                                                     \n" \
+	"   int firstSite = get_group_id(0) * SITES_PER_GROUP;                                                                     \n" \
+	"   int parentNode = levelNodes[levelOffset + get_global_id(1)];                                                           \n" \
+	"   accum product[CATEGORY_COUNT][SITES_PER_GROUP];                                                                        \n" \
+	"   accum sum[CATEGORY_COUNT][SITES_PER_GROUP];                                                                            \n" \
+	"   int scaling[SITES_PER_GROUP];                                                                                          \n" \
+	"   int s, i, k, k0, cat, child;                                                                                           \n" \
+	"   for (s = 0; s < SITES_PER_GROUP; s++)                                                                                  \n" \
+	"   {                                                                                                                      \n" \
+	"       for (cat = 0; cat < CATEGORY_COUNT; cat++) product[cat][s] = 1;                                                    \n" \
+	"       scaling[s] = 0;                                                                                                    \n" \
+	"   }                                                                                                                      \n" \
+	"   for (child = childStart[parentNode]; child < childStart[parentNode+1]; child++)                                        \n" \
+	"   {                                                                                                                      \n" \
+	"       int childNode = children[child];                                                                                   \n" \
+	"       bool tip = childNode < tipCount;                                                                                   \n" \
+	"       int rowCount = tip ? 1 : CATEGORY_COUNT;                                                                           \n" \
+	"       __global const fpoint* categoryModels = models + (long)childNode*CATEGORY_COUNT*CHARACTER_COUNT*CHARACTER_COUNT;   \n" \
+	"       __global const fpoint* rows = partials + NodeOffset(childNode, tipCount, sites, characters);                       \n" \
+	"       for (cat = 0; cat < CATEGORY_COUNT; cat++)                                                                         \n" \
+	"           for (s = 0; s < SITES_PER_GROUP; s++) sum[cat][s] = 0;                                                         \n" \
+	"       for (k0 = 0; k0 < CHARACTER_COUNT; k0 += CHAR_TILE)                                                                \n" \
+	"       {                                                                                                                  \n" \
+	"           int tile = min(CHAR_TILE, CHARACTER_COUNT - k0);                                                               \n" \
+	"           for (cat = 0; cat < CATEGORY_COUNT; cat++)                                                                     \n" \
+	"           {                                                                                                              \n" \
+	"               // modelTile[k][pc] = model[cat][pc][k0 + k]; siteTile[s][k] = child[firstSite + s][cat][k0 + k]           \n" \
+	"               __global const fpoint* model = categoryModels + cat*CHARACTER_COUNT*CHARACTER_COUNT;                       \n" \
+	"               for (i = parentChar; i < CHARACTER_COUNT*tile; i += localSize)                                             \n" \
+	"               {                                                                                                          \n" \
+	"                   int pc = i / tile;                                                                                     \n" \
+	"                   k = i - pc*tile;                                                                                       \n" \
+	"                   modelTile[k*CHARACTER_COUNT + pc] = model[pc*CHARACTER_COUNT + k0 + k];                                \n" \
+	"               }                                                                                                          \n" \
+	"               if (cat == 0 || !tip)                                                                                      \n" \
+	"                   for (i = parentChar; i < SITES_PER_GROUP*tile; i += localSize)                                         \n" \
+	"                   {                                                                                                      \n" \
+	"#ifdef STATE_MAJOR                                                                                                        \n" \
+	"                       s = i % SITES_PER_GROUP;    // neighbouring work items read neighbouring sites                     \n" \
+	"                       k = i / SITES_PER_GROUP;                                                                           \n" \
+	"#else                                                                                                                     \n" \
+	"                       s = i / tile;                                                                                      \n" \
+	"                       k = i - s*tile;                                                                                    \n" \
+	"#endif                                                                                                                    \n" \
+	"                       int site = firstSite + s;                                                                          \n" \
+	"                       siteTile[s*tile + k] = (site < sites)                                                              \n" \
+	"                           ? rows[ValueIndex(site, tip ? 0 : cat, k0 + k, rowCount, sites, characters)] : 0;              \n" \
+	"                   }                                                                                                      \n" \
+	"               barrier(CLK_LOCAL_MEM_FENCE);                                                                              \n" \
+	"               if (parentChar < CHARACTER_COUNT)                                                                          \n" \
+	"               {                                                                                                          \n" \
+	"#ifdef FIXED_CHARACTERS                                                                                                   \n" \
+	"                   #pragma unroll UNROLL                                                                                  \n" \
+	"#endif                                                                                                                    \n" \
+	"                   for (k = 0; k < TILE_WIDTH; k++)                                                                       \n" \
+	"                   {                                                                                                      \n" \
+	"                       accum m = modelTile[k*CHARACTER_COUNT + parentChar];                                               \n" \
+	"                       for (s = 0; s < SITES_PER_GROUP; s++)                                                              \n" \
+	"                           sum[cat][s] += siteTile[s*TILE_WIDTH + k] * m;                                                 \n" \
+	"                   }                                                                                                      \n" \
+	"               }                                                                                                          \n" \
+	"               barrier(CLK_LOCAL_MEM_FENCE);                                                                              \n" \
+	"           }                                                                                                              \n" \
+	"       }                                                                                                                  \n" \
+	"       for (s = 0; s < SITES_PER_GROUP; s++)                                                                              \n" \
+	"       {                                                                                                                  \n" \
+	"           for (cat = 0; cat < CATEGORY_COUNT; cat++) product[cat][s] *= sum[cat][s];                                     \n" \
+	"           if (firstSite + s < sites)                                                                                     \n" \
+	"               scaling[s] += scalings[(long)childNode*sites + firstSite + s];                                             \n" \
+	"       }                                                                                                                  \n" \
+	"   }                                                                                                                      \n" \
+	"   // rescue each site from underflow: max over categories and characters,                                                \n" \
+	"   // then one exact power-of-two shift bringing it to [0.5, 1); siteTile is                                              \n" \
+	"   // reused as one reduction row per site                                                                                \n" \
+	"   for (s = 0; s < SITES_PER_GROUP; s++)                                                                                  \n" \
+	"   {                                                                                                                      \n" \
+	"       accum categoryMax = 0;                                                                                             \n" \
+	"       for (cat = 0; cat < CATEGORY_COUNT; cat++) categoryMax = fmax(categoryMax, product[cat][s]);                       \n" \
+	"       siteTile[s*localSize + parentChar] = (parentChar < CHARACTER_COUNT) ? categoryMax : 0;                             \n" \
+	"   }                                                                                                                      \n" \
+	"   barrier(CLK_LOCAL_MEM_FENCE);                                                                                          \n" \
+	"   int stride;                                                                                                            \n" \
+	"   for (stride = localSize/2; stride > 0; stride >>= 1)                                                                   \n" \
+	"   {                                                                                                                      \n" \
+	"       if (parentChar < stride)                                                                                           \n" \
+	"           for (s = 0; s < SITES_PER_GROUP; s++)                                                                          \n" \
+	"               siteTile[s*localSize + parentChar] = fmax(siteTile[s*localSize + parentChar],                              \n" \
+	"                                                         siteTile[s*localSize + parentChar + stride]);                    \n" \
+	"       barrier(CLK_LOCAL_MEM_FENCE);                                                                                      \n" \
+	"   }                                                                                                                      \n" \
+	"   __global fpoint* parentRows = partials + NodeOffset(parentNode, tipCount, sites, characters);                          \n" \
+	"   for (s = 0; s < SITES_PER_GROUP && firstSite + s < sites; s++)                                                         \n" \
+	"   {                                                                                                                      \n" \
+	"       accum siteMax = siteTile[s*localSize];                                                                             \n" \
+	"       int exponent;                                                                                                      \n" \
+	"       frexp(siteMax, &exponent);                                                                                         \n" \
+	"       int shift = (siteMax > 0 && siteMax < uflowthresh) ? -exponent : 0;                                                \n" \
+	"       if (parentChar < CHARACTER_COUNT)                                                                                  \n" \
+	"           for (cat = 0; cat < CATEGORY_COUNT; cat++)                                                                     \n" \
+	"               parentRows[ValueIndex(firstSite + s, cat, parentChar, CATEGORY_COUNT, sites, characters)] =                \n" \
+	"                   ldexp(product[cat][s], shift);                                                                         \n" \
+	"       if (parentChar == 0)                                                                                               \n" \
+	"           scalings[(long)parentNode*sites + firstSite + s] = scaling[s] + shift;                                         \n" \
+	"   }                                                                                                                      \n" \
+	"}                                                                                                                         \n" \
+	"// The root log-likelihood, reduced on the device so only the total comes                                                 \n" \
+	"// back: each work item sums siteWeight * (log(sum_k categoryWeight_k                                                     \n" \
+	"// sum_c frequency_c root[site][k][c]) - scaling * ln 2) over the sites                                                   \n" \
+	"// strided by the global size, then each group adds up its items in a                                                     \n" \
+	"// tree and leaves one value in groupSums.  weights holds CATEGORY_COUNT                                                  \n" \
+	"// category weights, then the character frequencies, then the site                                                        \n" \
+	"// weights.  With writeSites the unweighted site values go to siteLogL.                                                   \n" \
+	"// The local size is a power of two.                                                                                      \n" \
+	"__kernel void RootLikelihood(__global const fpoint* partials, __global const int* scalings,                               \n" \
+	"                             __global const accum* weights, __global accum* siteLogL, __global accum* groupSums,          \n" \
+	"                             __local accum* localSums, int root, int sites, int characters, int tipCount,                 \n" \
+	"                             int writeSites)                                                                              \n" \
+	"{                                                                                                                         \n" \
+	"   int item = get_local_id(0);                                                                                            \n" \
+	"   int localSize = get_local_size(0);                                                                                     \n" \
+	"   __global const fpoint* rootRows = partials + NodeOffset(root, tipCount, sites, characters);                            \n" \
+	"   __global const accum* frequencies = weights + CATEGORY_COUNT;                                                          \n" \
+	"   __global const accum* siteWeights = frequencies + CHARACTER_COUNT;                                                     \n" \
+	"   accum ln2 = log((accum)2);                                                                                             \n" \
+	"   accum total = 0;                                                                                                       \n" \
+	"   int site, cat, c;                                                                                                      \n" \
+	"   for (site = get_global_id(0); site < sites; site += get_global_size(0))                                                \n" \
+	"   {                                                                                                                      \n" \
+	"       accum siteLikelihood = 0;                                                                                          \n" \
+	"       for (cat = 0; cat < CATEGORY_COUNT; cat++)                                                                         \n" \
+	"       {                                                                                                                  \n" \
+	"           accum categoryLikelihood = 0;                                                                                  \n" \
+	"           for (c = 0; c < CHARACTER_COUNT; c++)                                                                          \n" \
+	"               categoryLikelihood += frequencies[c]                                                                       \n" \
+	"                                     * rootRows[ValueIndex(site, cat, c, CATEGORY_COUNT, sites, characters)];             \n" \
+	"           siteLikelihood += weights[cat] * categoryLikelihood;                                                           \n" \
+	"       }                                                                                                                  \n" \
+	"       accum value = log(siteLikelihood) - scalings[(long)root*sites + site] * ln2;                                       \n" \
+	"       if (writeSites) siteLogL[site] = value;                                                                            \n" \
+	"       total += siteWeights[site] * value;                                                                                \n" \
+	"   }                                                                                                                      \n" \
+	"   localSums[item] = total;                                                                                               \n" \
+	"   barrier(CLK_LOCAL_MEM_FENCE);                                                                                          \n" \
+	"   int stride;                                                                                                            \n" \
+	"   for (stride = localSize/2; stride > 0; stride >>= 1)                                                                   \n" \
+	"   {                                                                                                                      \n" \
+	"       if (item < stride) localSums[item] += localSums[item + stride];                                                    \n" \
+	"       barrier(CLK_LOCAL_MEM_FENCE);                                                                                      \n" \
+	"   }                                                                                                                      \n" \
+	"   if (item == 0) groupSums[get_group_id(0)] = localSums[0];                                                              \n" \
+	"}                                                                                                                         \n" \
+	"// The count group sums of RootLikelihood into sums[0], by one work group                                                 \n" \
+	"// (a power of two); every read is done before the first barrier                                                          \n" \
+	"__kernel void SumGroups(__global accum* sums, __local accum* localSums, int count)                                        \n" \
+	"{                                                                                                                         \n" \
+	"   int item = get_local_id(0);                                                                                            \n" \
+	"   int localSize = get_local_size(0);                                                                                     \n" \
+	"   accum total = 0;                                                                                                       \n" \
+	"   int i;                                                                                                                 \n" \
+	"   for (i = item; i < count; i += localSize) total += sums[i];                                                            \n" \
+	"   localSums[item] = total;                                                                                               \n" \
+	"   barrier(CLK_LOCAL_MEM_FENCE);                                                                                          \n" \
+	"   int stride;                                                                                                            \n" \
+	"   for (stride = localSize/2; stride > 0; stride >>= 1)                                                                   \n" \
+	"   {                                                                                                                      \n" \
+	"       if (item < stride) localSums[item] += localSums[item + stride];                                                    \n" \
+	"       barrier(CLK_LOCAL_MEM_FENCE);                                                                                      \n" \
+	"   }                                                                                                                      \n" \
+	"   if (item == 0) sums[0] = localSums[0];                                                                                 \n" \
+	"}                                                                                                                         \n" \
+	"\n";
+
+void DefaultKernelTuning(KernelTuning* tuning, int sitesPerGroup)
+{
+    tuning->localWorkSize = 0;
+    tuning->sitesPerGroup = sitesPerGroup;
+    tuning->unroll = DEFAULT_UNROLL;
+}
+
+cl_int ConfigureKernel(cl_device_id device, const KernelTuning* tuning, int characters, int categories,
+                       DevicePrecision precision, const PartialsLayout* layout, KernelConfig* config)
+{
+    size_t narrowest = roundUpToNextPowerOfTwo(characters);
+    config->sitesPerGroup = tuning->sitesPerGroup;
+    config->unroll = tuning->unroll;
+    config->characters = characters;
+    config->categories = categories;
+    config->precision = precision;
+    config->layout = *layout;
+    config->localWorkSize = tuning->localWorkSize ? tuning->localWorkSize : narrowest;
+    config->siteTileSize = (size_t)config->sitesPerGroup * config->localWorkSize;
+    config->modelTileSize = 0;
+    config->charTile = 0;
+
+    size_t maxWorkGroupSize = 0;
+    cl_ulong localMemBytes = 0;
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemBytes, NULL);
+    if (err != CL_SUCCESS) return err;
+    if (config->localWorkSize > maxWorkGroupSize || config->localWorkSize < narrowest ||
+        (config->localWorkSize & (config->localWorkSize - 1)) != 0)
+        return CL_INVALID_WORK_GROUP_SIZE;
+
+    // what is left next to the site tile, with headroom for the compiler
+    size_t storageBytes = PrecisionStorageBytes(precision);
+    double siteTileBytes = (double)config->siteTileSize * PrecisionAccumBytes(precision);
+    long localValues = (siteTileBytes < localMemBytes)
+                       ? (long)((localMemBytes - (cl_ulong)siteTileBytes) / storageBytes) - 64 : 0;
+    int tile = (localValues > 0) ? (int)(localValues / characters) : 0;
+    if (tile > characters) tile = characters;
+    if (tile < 1) return CL_OUT_OF_RESOURCES;
+    config->charTile = tile;
+    config->modelTileSize = (size_t)characters * tile;
+    return CL_SUCCESS;
+}
+
+void KernelBuildOptions(const KernelConfig* config, char* options)
+{
+    snprintf(options, KERNEL_OPTIONS_LENGTH,
+             "-D SITES_PER_GROUP=%d -D CHAR_TILE=%d -D CATEGORY_COUNT=%d -D UNROLL=%d -D FPOINT=%s -D ACCUM=%s",
+             config->sitesPerGroup, config->charTile, config->categories, config->unroll,
+             PrecisionStorageType(config->precision), PrecisionAccumType(config->precision));
+    LayoutBuildOptions(&config->layout, options + strlen(options));
+    if (KernelSpecialized(config->characters))
+        snprintf(options + strlen(options), KERNEL_OPTIONS_LENGTH - strlen(options), " -D FIXED_CHARACTERS=%d",
+                 config->characters);
+}
+
+cl_program BuildKernelProgram(cl_context context, cl_device_id device, const KernelConfig* config,
+                              const char* cacheDirectory, CacheStatus* loaded, CacheStatus* stored, char** log,
+                              cl_int* err)
+{
+    char options[KERNEL_OPTIONS_LENGTH];
+    KernelBuildOptions(config, options);
+    if (log) *log = NULL;
+    *stored = CACHE_OFF;
+    *err = CL_SUCCESS;
+    cl_program program = LoadCachedProgram(cacheDirectory, context, device, programSource, options, loaded);
+    if (program) return program;
+
+    program = clCreateProgramWithSource(context, 1, (const char**)&programSource, NULL, err);
+    if (*err != CL_SUCCESS) return NULL;
+    *err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (log)
+    {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        *log = (char*)malloc(logSize + 1);
+        if (*log)
+        {
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, *log, NULL);
+            (*log)[logSize] = '\0';
+        }
+    }
+    if (*err != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    *stored = StoreCachedProgram(cacheDirectory, program, device, programSource, options);
+    return program;
+}
+
+bool KernelSpecialized(int characters)
+{
+    return characters == 4 || characters == 20 || characters == 61;
+}
+
+void ConfigureReduction(cl_device_id device, int sites, size_t* localSize, size_t* groups)
+{
+    size_t maxWorkGroupSize = 1;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    *localSize = 1;
+    while (*localSize * 2 <= maxWorkGroupSize && *localSize * 2 <= REDUCTION_LOCAL_SIZE) *localSize *= 2;
+    *groups = (sites + *localSize - 1) / *localSize;
+    if (*groups > REDUCTION_GROUPS) *groups = REDUCTION_GROUPS;
+    if (*groups < 1) *groups = 1;
+}
+
+unsigned int roundUpToNextPowerOfTwo(unsigned int x)
+{
+	x--;
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	x |= x >> 16;
+	x++;
+
+	return x;
+}
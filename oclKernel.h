@@ -0,0 +1,112 @@
+// *********************************************************************
+// oclKernel: the FirstLoop device kernel, sized and built per device
+//
+// The kernel prunes one level of the tree per launch: one work group per
+// block of sitesPerGroup sites of one internal node, one work item per
+// parent character (the group is a power of two of at least the character
+// count; extra items help stage the tiles).  The launch shape, the group
+// size, sitesPerGroup and the unroll factor of the inner loop, is a
+// KernelTuning: the defaults, or what the tuner found fastest on the
+// device (oclTuning.h).  Its arguments are
+//
+//    0 partials       1 models        2 scalings      3 childStart
+//    4 children       5 levelNodes    6 modelTile     7 siteTile
+//    8 levelOffset    9 sites        10 characters   11 uflowThresh
+//   12 tipCount
+//
+// with the two tiles in local memory (modelTileSize storage values and
+// siteTileSize accum values), uflowThresh an accum, and partials in the
+// layout the program was built for (oclLayout.h).
+//
+// The same program reduces the root to its log-likelihood on the device,
+// so only a scalar (or a per-site vector) comes back: RootLikelihood
+// leaves one sum per work group, SumGroups adds them into the first.
+// Their arguments are
+//
+//   RootLikelihood:  0 partials    1 scalings     2 weights     3 siteLogL
+//                    4 groupSums   5 localSums    6 root        7 sites
+//                    8 characters  9 tipCount    10 writeSites
+//   SumGroups:       0 sums        1 localSums    2 count
+//
+// with weights, siteLogL, the sums and localSums (localSize values) all
+// accums, weights holding the category weights, the character
+// frequencies and the site weights in that order.
+//
+// Nothing here prints or exits: failures come back as OpenCL error codes,
+// and what the program cache did as CacheStatus, for the driver and the
+// engine library to report their own way.
+// *********************************************************************
+
+#ifndef OCLKERNEL_H
+#define OCLKERNEL_H
+
+#include "oclFirstLoop.h"
+#include "oclPrecision.h"
+#include "oclLayout.h"
+#include "oclProgramCache.h"
+
+#define KERNEL_OPTIONS_LENGTH   256
+#define DEFAULT_UNROLL          4       // of the inner loop over child characters
+#define REDUCTION_LOCAL_SIZE    256     // most work items per group of the log-likelihood reduction
+#define REDUCTION_GROUPS        128     // most groups of it, all summed by one more group
+
+extern const char* programSource;
+
+// How the kernel is launched and unrolled
+struct KernelTuning
+{
+    size_t          localWorkSize;  // work items per group; 0: the characters rounded up to a power of two
+    int             sitesPerGroup;
+    int             unroll;         // of the inner loop, in the kernels specialized for a character count
+};
+
+// One device's build of the kernel
+struct KernelConfig
+{
+    int             sitesPerGroup;
+    int             unroll;
+    int             characters;
+    int             categories;
+    DevicePrecision precision;
+    PartialsLayout  layout;
+    size_t          localWorkSize;  // work items per group
+    size_t          siteTileSize;   // accum values: one reduction row per site (also holds the staged child rows)
+    size_t          modelTileSize;  // storage values: charTile columns of one branch model
+    int             charTile;       // child characters staged per pass, all of them when they fit
+};
+
+// tuning's defaults: the narrowest group, sitesPerGroup, DEFAULT_UNROLL
+void DefaultKernelTuning(KernelTuning* tuning, int sitesPerGroup);
+
+// Size the kernel for device with tuning: as many model columns as fit in
+// its local memory next to the site tile.  Returns
+// CL_INVALID_WORK_GROUP_SIZE when the group is not a power of two covering
+// the characters, or larger than the device allows, CL_OUT_OF_RESOURCES
+// when not even one column fits.
+cl_int ConfigureKernel(cl_device_id device, const KernelTuning* tuning, int characters, int categories,
+                       DevicePrecision precision, const PartialsLayout* layout, KernelConfig* config);
+
+// -D options for config: its tiles, types, categories, unroll and layout, and
+// the specialized character count when there is one
+void KernelBuildOptions(const KernelConfig* config, char* options);
+
+// The program for config on device, loaded from the binary cached in
+// cacheDirectory when there is one (*loaded CACHE_SUCCESS), otherwise
+// built from source and its binary cached (how that went in *stored).
+// log, if not NULL, receives the build log of a source build (free it;
+// NULL when loaded).  NULL and *err on failure.
+cl_program BuildKernelProgram(cl_context context, cl_device_id device, const KernelConfig* config,
+                              const char* cacheDirectory, CacheStatus* loaded, CacheStatus* stored, char** log,
+                              cl_int* err);
+
+// True when the state count has its own unrolled kernels: FIXED_CHARACTERS
+// on the device, templates in the host engine (hostEngine.h)
+bool KernelSpecialized(int characters);
+
+// Work items per group (a power of two the device allows) and groups for
+// the log-likelihood reduction of sites sites on device
+void ConfigureReduction(cl_device_id device, int sites, size_t* localSize, size_t* groups);
+
+unsigned int roundUpToNextPowerOfTwo(unsigned int x);
+
+#endif
@@ -0,0 +1,151 @@
+// *********************************************************************
+// oclLayout: device partials layouts
+// *********************************************************************
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oclLayout.h"
+#include "oclPrecision.h"
+
+static const char* layoutNames[LAYOUT_KINDS] = { "packed", "padded", "state" };
+
+int ParseLayout(const char* name)
+{
+    int i;
+    for (i = 0; i < LAYOUT_KINDS; i++)
+        if (strcmp(name, layoutNames[i]) == 0) return i;
+    return -1;
+}
+
+const char* LayoutName(LayoutKind kind)
+{
+    return layoutNames[kind];
+}
+
+size_t DeviceLineBytes(cl_device_id device)
+{
+    cl_uint lineBytes = 0;
+    if (clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, sizeof(cl_uint), &lineBytes, NULL) != CL_SUCCESS ||
+        lineBytes == 0)
+        return DEFAULT_LINE_BYTES;
+    return lineBytes;
+}
+
+void MakeLayout(PartialsLayout* layout, LayoutKind kind, int characters, size_t valueBytes, size_t lineBytes)
+{
+    layout->kind = kind;
+    layout->characters = characters;
+    layout->quantum = (kind != LAYOUT_PACKED && lineBytes >= valueBytes) ? (int)(lineBytes / valueBytes) : 1;
+}
+
+static long RoundUp(long count, long quantum)
+{
+    return (count + quantum - 1) / quantum * quantum;
+}
+
+int LayoutCharSpan(const PartialsLayout* layout)
+{
+    if (layout->kind != LAYOUT_PADDED) return layout->characters;
+    if (layout->characters >= layout->quantum) return (int)RoundUp(layout->characters, layout->quantum);
+    // shorter than a line: the next power of two, so rows never straddle one
+    int span = 1;
+    while (span < layout->characters) span <<= 1;
+    return span;
+}
+
+long LayoutSiteSpan(const PartialsLayout* layout, long sites)
+{
+    return (layout->kind == LAYOUT_STATE_MAJOR) ? RoundUp(sites, layout->quantum) : sites;
+}
+
+long LayoutNodeOffset(const PartialsLayout* layout, const Tree* tree, long node, long sites, int categories)
+{
+    return NodePartialsOffset(tree, node, LayoutSiteSpan(layout, sites), LayoutCharSpan(layout), categories);
+}
+
+long LayoutSize(const PartialsLayout* layout, const Tree* tree, long sites, int categories)
+{
+    return LayoutNodeOffset(layout, tree, tree->nodeCount, sites, categories);
+}
+
+long LayoutIndex(const PartialsLayout* layout, long sites, int rows, long site, int category, int character)
+{
+    if (layout->kind == LAYOUT_STATE_MAJOR)
+        return ((long)category*layout->characters + character)*LayoutSiteSpan(layout, sites) + site;
+    return (site*rows + category)*LayoutCharSpan(layout) + character;
+}
+
+// One host row of count characters to or from the device, which holds
+// them step values apart from index on
+static void CopyRow(void* device, fpoint* host, long index, long step, int count, size_t valueBytes, bool store)
+{
+    int c;
+    if (step == 1)
+    {
+        if (store) StoreDeviceValues((char*)device + valueBytes * index, host, count, valueBytes);
+        else LoadDeviceValues(host, (const char*)device + valueBytes * index, count, valueBytes);
+    }
+    else if (valueBytes == sizeof(cl_float))
+    {
+        cl_float* values = (cl_float*)device + index;
+        for (c = 0; c < count; c++)
+            if (store) values[c*step] = (cl_float)host[c];
+            else host[c] = (fpoint)values[c*step];
+    }
+    else
+    {
+        cl_double* values = (cl_double*)device + index;
+        for (c = 0; c < count; c++)
+            if (store) values[c*step] = (cl_double)host[c];
+            else host[c] = (fpoint)values[c*step];
+    }
+}
+
+static void CopyPartials(void* device, fpoint* host, const Tree* tree, int firstNode, int lastNode, long sites,
+                         int categories, const PartialsLayout* layout, size_t valueBytes, bool store)
+{
+    int characters = layout->characters;
+    long hostStart = NodePartialsOffset(tree, firstNode, sites, characters, categories);
+    if (layout->kind == LAYOUT_PACKED)
+    {
+        long count = NodePartialsOffset(tree, lastNode, sites, characters, categories) - hostStart;
+        if (store) StoreDeviceValues(device, host, count, valueBytes);
+        else LoadDeviceValues(host, device, count, valueBytes);
+        return;
+    }
+    long deviceStart = LayoutNodeOffset(layout, tree, firstNode, sites, categories);
+    long step = (layout->kind == LAYOUT_STATE_MAJOR) ? LayoutSiteSpan(layout, sites) : 1;
+    int node, category;
+    long site;
+    for (node = firstNode; node < lastNode; node++)
+    {
+        int rows = (node < tree->tipCount) ? 1 : categories;
+        fpoint* hostRow = host + NodePartialsOffset(tree, node, sites, characters, categories) - hostStart;
+        long deviceNode = LayoutNodeOffset(layout, tree, node, sites, categories) - deviceStart;
+        for (site = 0; site < sites; site++)
+            for (category = 0; category < rows; category++, hostRow += characters)
+                CopyRow(device, hostRow, deviceNode + LayoutIndex(layout, sites, rows, site, category, 0), step,
+                        characters, valueBytes, store);
+    }
+}
+
+void StoreDevicePartials(void* device, const fpoint* host, const Tree* tree, int firstNode, int lastNode, long sites,
+                         int categories, const PartialsLayout* layout, size_t valueBytes)
+{
+    CopyPartials(device, (fpoint*)host, tree, firstNode, lastNode, sites, categories, layout, valueBytes, true);
+}
+
+void LoadDevicePartials(fpoint* host, const void* device, const Tree* tree, int firstNode, int lastNode, long sites,
+                        int categories, const PartialsLayout* layout, size_t valueBytes)
+{
+    CopyPartials((void*)device, host, tree, firstNode, lastNode, sites, categories, layout, valueBytes, false);
+}
+
+void LayoutBuildOptions(const PartialsLayout* layout, char* options)
+{
+    if (layout->kind == LAYOUT_STATE_MAJOR)
+        snprintf(options, LAYOUT_OPTIONS_LENGTH, " -D STATE_MAJOR -D SITE_QUANTUM=%d", layout->quantum);
+    else
+        snprintf(options, LAYOUT_OPTIONS_LENGTH, " -D CHAR_STRIDE=%d", LayoutCharSpan(layout));
+}
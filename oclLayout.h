@@ -0,0 +1,84 @@
+// *********************************************************************
+// oclLayout: device partials layouts
+//
+// The host keeps partials packed (oclFirstLoop.h).  The device holds
+// them in one of three layouts (--layout):
+//
+//   packed   the host's: site-major, [site][category][character]
+//   padded   site-major with each row of characters padded so that rows
+//            start on cache lines (61 -> 64 codons; rows shorter than a
+//            line are padded to the next power of two: 4 nucleotides stay
+//            4, 20 amino acids become 24 doubles or 32 floats)
+//   state    state-major (SoA), [category][character][site], with each
+//            character's sites padded to whole cache lines, so
+//            neighbouring work items read neighbouring sites
+//
+// Every layout keeps the host's node order and a single category for
+// tips, so a node's values start at NodePartialsOffset with the layout's
+// site and character spans.  Store/LoadDevicePartials convert between
+// the host layout in fpoint and a device layout in its storage type,
+// along with the precision; the kernel is built for one layout
+// (LayoutBuildOptions).
+// *********************************************************************
+
+#ifndef OCLLAYOUT_H
+#define OCLLAYOUT_H
+
+#include <stddef.h>
+
+#include "oclFirstLoop.h"
+
+#define LAYOUT_KINDS            3
+#define LAYOUT_OPTIONS_LENGTH   48
+#define DEFAULT_LINE_BYTES      64      // cache line for devices that report none
+
+enum LayoutKind
+{
+    LAYOUT_PACKED = 0,
+    LAYOUT_PADDED,
+    LAYOUT_STATE_MAJOR
+};
+
+struct PartialsLayout
+{
+    LayoutKind  kind;
+    int         characters;
+    int         quantum;        // values rows are padded to a multiple of (1 = none)
+};
+
+// "packed", "padded" or "state"; -1 if unknown
+int ParseLayout(const char* name);
+const char* LayoutName(LayoutKind kind);
+
+// The global memory cache line of device, in bytes
+size_t DeviceLineBytes(cl_device_id device);
+
+// A layout of kind for characters values of valueBytes, padded to lines of
+// lineBytes
+void MakeLayout(PartialsLayout* layout, LayoutKind kind, int characters, size_t valueBytes, size_t lineBytes);
+
+// Values per site row of one category, and sites per character row:
+// (padded) characters and sites when site-major, characters and padded
+// sites when state-major
+int LayoutCharSpan(const PartialsLayout* layout);
+long LayoutSiteSpan(const PartialsLayout* layout, long sites);
+
+// Where node starts and how many values every node takes, for sites sites
+long LayoutNodeOffset(const PartialsLayout* layout, const Tree* tree, long node, long sites, int categories);
+long LayoutSize(const PartialsLayout* layout, const Tree* tree, long sites, int categories);
+
+// (site, category, character) within one node of rows categories
+long LayoutIndex(const PartialsLayout* layout, long sites, int rows, long site, int category, int character);
+
+// Nodes [firstNode, lastNode) of sites sites between the host layout in
+// fpoint and layout in a type of valueBytes; host and device point at
+// firstNode's values.  Padding is left alone.
+void StoreDevicePartials(void* device, const fpoint* host, const Tree* tree, int firstNode, int lastNode, long sites,
+                         int categories, const PartialsLayout* layout, size_t valueBytes);
+void LoadDevicePartials(fpoint* host, const void* device, const Tree* tree, int firstNode, int lastNode, long sites,
+                        int categories, const PartialsLayout* layout, size_t valueBytes);
+
+// -D options selecting layout in the kernel
+void LayoutBuildOptions(const PartialsLayout* layout, char* options);
+
+#endif
@@ -0,0 +1,179 @@
+// *********************************************************************
+// oclMemory: aligned host memory, device buffer pool and zero-copy
+// transfers
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oclMemory.h"
+
+// Host memory
+// *********************************************************************
+void* AlignedAlloc(size_t bytes)
+{
+    void* memory = NULL;
+    size_t padded = (bytes + HOST_SIZE_QUANTUM - 1) / HOST_SIZE_QUANTUM * HOST_SIZE_QUANTUM;
+    if (posix_memalign(&memory, HOST_ALIGNMENT, padded ? padded : HOST_SIZE_QUANTUM) != 0) return NULL;
+    return memory;
+}
+
+void* AlignedCalloc(size_t bytes)
+{
+    void* memory = AlignedAlloc(bytes);
+    if (memory) memset(memory, 0, bytes);
+    return memory;
+}
+
+void* AlignedRealloc(void* memory, size_t oldBytes, size_t newBytes)
+{
+    void* moved = AlignedAlloc(newBytes);
+    if (!moved) return NULL;
+    if (memory) memcpy(moved, memory, oldBytes < newBytes ? oldBytes : newBytes);
+    AlignedFree(memory);
+    return moved;
+}
+
+void AlignedFree(void* memory)
+{
+    free(memory);
+}
+
+// Buffer pool
+// *********************************************************************
+struct PooledBuffer
+{
+    cl_mem          buffer;
+    cl_mem_flags    flags;          // as requested, before the zero-copy flags
+    size_t          bytes;
+    bool            inUse;
+    bool            wrapsHost;      // CL_MEM_USE_HOST_PTR: never handed out again
+};
+
+struct BufferPool
+{
+    cl_context      context;
+    bool            zeroCopy;
+    PooledBuffer*   buffers;
+    int             count, capacity;
+};
+
+BufferPool* CreateBufferPool(cl_context context, bool zeroCopy)
+{
+    BufferPool* pool = (BufferPool*)calloc(1, sizeof(BufferPool));
+    if (!pool) return NULL;
+    pool->context = context;
+    pool->zeroCopy = zeroCopy;
+    return pool;
+}
+
+void FreeBufferPool(BufferPool* pool)
+{
+    if (!pool) return;
+    int i;
+    for (i = 0; i < pool->count; i++) clReleaseMemObject(pool->buffers[i].buffer);
+    free(pool->buffers);
+    free(pool);
+}
+
+bool BufferPoolZeroCopy(const BufferPool* pool)
+{
+    return pool && pool->zeroCopy;
+}
+
+cl_mem PoolAcquire(BufferPool* pool, cl_mem_flags flags, size_t bytes, void* hostArray, cl_int* err)
+{
+    bool wrapHost = pool->zeroCopy && hostArray;
+    int i, best = -1;
+    if (!wrapHost)
+    {
+        // smallest free buffer with the same flags that is big enough but
+        // not wastefully so
+        for (i = 0; i < pool->count; i++)
+        {
+            PooledBuffer* entry = &pool->buffers[i];
+            if (entry->inUse || entry->wrapsHost || entry->flags != flags) continue;
+            if (entry->bytes < bytes || entry->bytes > 2 * bytes) continue;
+            if (best < 0 || entry->bytes < pool->buffers[best].bytes) best = i;
+        }
+        if (best >= 0)
+        {
+            pool->buffers[best].inUse = true;
+            *err = CL_SUCCESS;
+            return pool->buffers[best].buffer;
+        }
+    }
+
+    cl_mem_flags createFlags = flags;
+    if (wrapHost) createFlags |= CL_MEM_USE_HOST_PTR;
+    else if (pool->zeroCopy) createFlags |= CL_MEM_ALLOC_HOST_PTR;
+    cl_mem buffer = clCreateBuffer(pool->context, createFlags, bytes, wrapHost ? hostArray : NULL, err);
+    if (*err != CL_SUCCESS) return NULL;
+
+    if (pool->count == pool->capacity)
+    {
+        pool->capacity = pool->capacity ? 2 * pool->capacity : 16;
+        pool->buffers = (PooledBuffer*)realloc(pool->buffers, sizeof(PooledBuffer) * pool->capacity);
+    }
+    PooledBuffer* entry = &pool->buffers[pool->count++];
+    entry->buffer = buffer;
+    entry->flags = flags;
+    entry->bytes = bytes;
+    entry->inUse = true;
+    entry->wrapsHost = wrapHost;
+    return buffer;
+}
+
+void PoolRelease(BufferPool* pool, cl_mem buffer)
+{
+    if (!pool || !buffer) return;
+    int i;
+    for (i = 0; i < pool->count; i++)
+    {
+        if (pool->buffers[i].buffer != buffer) continue;
+        if (pool->buffers[i].wrapsHost)
+        {
+            clReleaseMemObject(buffer);
+            pool->buffers[i] = pool->buffers[--pool->count];
+        }
+        else pool->buffers[i].inUse = false;
+        return;
+    }
+}
+
+// Transfers
+// *********************************************************************
+cl_int UploadBuffer(BufferPool* pool, cl_command_queue queue, cl_mem buffer, size_t offset, size_t bytes,
+                    const void* host, cl_event* event)
+{
+    if (!pool->zeroCopy)
+        return clEnqueueWriteBuffer(queue, buffer, CL_FALSE, offset, bytes, host, 0, NULL, event);
+
+    cl_int err;
+    void* mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_WRITE, offset, bytes, 0, NULL, NULL, &err);
+    if (err != CL_SUCCESS) return err;
+    if (mapped != host) memcpy(mapped, host, bytes);
+    return clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL, event);
+}
+
+cl_int DownloadBuffer(BufferPool* pool, cl_command_queue queue, cl_mem buffer, size_t offset, size_t bytes,
+                      void* host, cl_event* event)
+{
+    if (!pool->zeroCopy)
+        return clEnqueueReadBuffer(queue, buffer, CL_TRUE, offset, bytes, host, 0, NULL, event);
+
+    cl_int err;
+    void* mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_READ, offset, bytes, 0, NULL, NULL, &err);
+    if (err != CL_SUCCESS) return err;
+    if (mapped != host) memcpy(host, mapped, bytes);
+
+    // blocking like the read it replaces: wait for the unmap as well
+    cl_event unmapped;
+    err = clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL, &unmapped);
+    if (err != CL_SUCCESS) return err;
+    err = clWaitForEvents(1, &unmapped);
+    if (event) *event = unmapped;
+    else clReleaseEvent(unmapped);
+    return err;
+}
@@ -0,0 +1,64 @@
+// *********************************************************************
+// oclMemory: aligned host memory, device buffer pool and zero-copy
+// transfers
+//
+// Host arrays that back device buffers come from AlignedAlloc: page
+// aligned and padded to whole cache lines, which is what runtimes need to
+// wrap them with CL_MEM_USE_HOST_PTR instead of shadowing them.
+//
+// Device buffers come from a BufferPool.  Released buffers are kept and
+// handed out again for a later request with the same flags and a size
+// within a factor of two, so repeated evaluations do not churn
+// clCreateBuffer / clReleaseMemObject.  Buffers over caller memory
+// (CL_MEM_USE_HOST_PTR) belong to that memory and are never recycled.
+//
+// On devices that share host memory (CPUs, integrated GPUs) the pool runs
+// zero-copy: buffers wrap their host arrays or are allocated host side,
+// and UploadBuffer / DownloadBuffer map and unmap them instead of copying
+// through clEnqueueWrite/ReadBuffer.  When the mapped pointer is the host
+// array itself nothing is copied at all.
+// *********************************************************************
+
+#ifndef OCLMEMORY_H
+#define OCLMEMORY_H
+
+#include <stddef.h>
+
+#include "oclFirstLoop.h"
+
+#define HOST_ALIGNMENT      4096    // page: required for zero-copy USE_HOST_PTR on most runtimes
+#define HOST_SIZE_QUANTUM   64      // cache line: allocation sizes are padded to a multiple
+
+// NULL on failure; free with AlignedFree
+void* AlignedAlloc(size_t bytes);
+void* AlignedCalloc(size_t bytes);
+// Like realloc: keeps min(oldBytes, newBytes) bytes and frees the old block
+void* AlignedRealloc(void* memory, size_t oldBytes, size_t newBytes);
+void AlignedFree(void* memory);
+
+struct BufferPool;
+
+// zeroCopy selects mapped transfers and host-side allocation
+BufferPool* CreateBufferPool(cl_context context, bool zeroCopy);
+void FreeBufferPool(BufferPool* pool);     // releases every buffer, in use or not
+bool BufferPoolZeroCopy(const BufferPool* pool);
+
+// A buffer of at least bytes.  With zero-copy, hostArray (if not NULL, and
+// AlignedAlloc'ed to at least bytes) is wrapped with CL_MEM_USE_HOST_PTR;
+// other buffers get CL_MEM_ALLOC_HOST_PTR.  Without zero-copy hostArray
+// is ignored and the buffer lives on the device.
+cl_mem PoolAcquire(BufferPool* pool, cl_mem_flags flags, size_t bytes, void* hostArray, cl_int* err);
+void PoolRelease(BufferPool* pool, cl_mem buffer);
+
+// Host -> device: clEnqueueWriteBuffer, or map for writing, copy (unless
+// the mapping is host itself) and unmap.  event, if not NULL, receives
+// the write or unmap event.
+cl_int UploadBuffer(BufferPool* pool, cl_command_queue queue, cl_mem buffer, size_t offset, size_t bytes,
+                    const void* host, cl_event* event);
+
+// Device -> host, blocking: clEnqueueReadBuffer, or map for reading, copy
+// (unless the mapping is host itself) and unmap
+cl_int DownloadBuffer(BufferPool* pool, cl_command_queue queue, cl_mem buffer, size_t offset, size_t bytes,
+                      void* host, cl_event* event);
+
+#endif
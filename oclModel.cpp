@@ -0,0 +1,441 @@
+// *********************************************************************
+// oclModel: substitution model and branch transition matrices
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "oclModel.h"
+
+// Rate matrix
+// *********************************************************************
+// Amino acid of each nucleotide triple in A,C,G,T order ('*' = stop); the
+// sense codons, stops skipped, are the 61 states in the same order as the
+// alignment loader uses.
+static const char* geneticCode = "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSS*CWCLFLF";
+
+static bool IsTransition(int a, int b)
+{
+    return (a == 0 && b == 2) || (a == 2 && b == 0) || (a == 1 && b == 3) || (a == 3 && b == 1);
+}
+
+// Symmetric exchangeabilities S (characters x characters)
+static void Exchangeabilities(int characters, double kappa, double omega, double* S)
+{
+    int i, j;
+    for (i = 0; i < characters*characters; i++) S[i] = 1.;
+    if (characters == 4)
+    {
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 4; j++)
+                if (IsTransition(i, j)) S[i*4+j] = kappa;
+    }
+    else if (characters == 61)
+    {
+        int codon[61], n = 0;
+        for (i = 0; i < 64; i++)
+            if (geneticCode[i] != '*') codon[n++] = i;
+        for (i = 0; i < 61; i++)
+            for (j = 0; j < 61; j++)
+            {
+                int a = codon[i], b = codon[j], differences = 0, position;
+                double rate = 1.;
+                for (position = 0; position < 3; position++)
+                {
+                    int na = (a >> (2*(2-position))) & 3, nb = (b >> (2*(2-position))) & 3;
+                    if (na != nb)
+                    {
+                        differences++;
+                        if (IsTransition(na, nb)) rate *= kappa;
+                    }
+                }
+                if (differences != 1) rate = 0.;
+                else if (geneticCode[a] != geneticCode[b]) rate *= omega;
+                S[i*61+j] = rate;
+            }
+    }
+    for (i = 0; i < characters; i++) S[i*characters+i] = 0.;
+}
+
+// Cyclic Jacobi: A (symmetric, destroyed) = V.diag(values).V^T
+static bool JacobiEigen(int n, double* A, double* values, double* V)
+{
+    int i, j, k, sweep;
+    for (i = 0; i < n*n; i++) V[i] = 0.;
+    for (i = 0; i < n; i++) V[i*n+i] = 1.;
+
+    for (sweep = 0; sweep < 100; sweep++)
+    {
+        double off = 0., norm = 0.;
+        for (i = 0; i < n; i++)
+            for (j = 0; j < n; j++)
+            {
+                if (i != j) off += A[i*n+j]*A[i*n+j];
+                norm += A[i*n+j]*A[i*n+j];
+            }
+        if (off <= 1e-30 * norm)
+        {
+            for (i = 0; i < n; i++) values[i] = A[i*n+i];
+            return true;
+        }
+        for (i = 0; i < n - 1; i++)
+            for (j = i + 1; j < n; j++)
+            {
+                if (fabs(A[i*n+j]) < 1e-300) continue;
+                double theta = (A[j*n+j] - A[i*n+i]) / (2.*A[i*n+j]);
+                double t = (theta >= 0. ? 1. : -1.) / (fabs(theta) + sqrt(theta*theta + 1.));
+                double c = 1. / sqrt(t*t + 1.), s = t*c;
+                for (k = 0; k < n; k++)
+                {
+                    double aki = A[k*n+i], akj = A[k*n+j];
+                    A[k*n+i] = c*aki - s*akj;
+                    A[k*n+j] = s*aki + c*akj;
+                }
+                for (k = 0; k < n; k++)
+                {
+                    double aik = A[i*n+k], ajk = A[j*n+k];
+                    A[i*n+k] = c*aik - s*ajk;
+                    A[j*n+k] = s*aik + c*ajk;
+                }
+                for (k = 0; k < n; k++)
+                {
+                    double vki = V[k*n+i], vkj = V[k*n+j];
+                    V[k*n+i] = c*vki - s*vkj;
+                    V[k*n+j] = s*vki + c*vkj;
+                }
+            }
+    }
+    return false;
+}
+
+SubstitutionModel* CreateSubstitutionModel(int characters, double kappa, double omega)
+{
+    const int n = characters;
+    SubstitutionModel* model = (SubstitutionModel*)calloc(1, sizeof(SubstitutionModel));
+    model->characters = n;
+    model->frequencies = (double*)malloc(sizeof(double)*n);
+    model->eigenvalues = (double*)malloc(sizeof(double)*n);
+    model->eigenvectors = (double*)malloc(sizeof(double)*n*n);
+    model->inverseEigenvectors = (double*)malloc(sizeof(double)*n*n);
+    model->rateCount = 1;
+    model->rates = (double*)malloc(sizeof(double));
+    model->rates[0] = 1.;
+    model->rateWeights = (double*)malloc(sizeof(double));
+    model->rateWeights[0] = 1.;
+
+    double* Q = (double*)malloc(sizeof(double)*n*n);
+    double* V = (double*)malloc(sizeof(double)*n*n);
+    int i, j;
+    for (i = 0; i < n; i++) model->frequencies[i] = 1./n;
+
+    // Q[i][j] = S[i][j] pi[j], rows sum to 0, one expected substitution per unit time
+    Exchangeabilities(n, kappa, omega, Q);
+    double meanRate = 0.;
+    for (i = 0; i < n; i++)
+    {
+        double row = 0.;
+        for (j = 0; j < n; j++)
+        {
+            Q[i*n+j] *= model->frequencies[j];
+            row += Q[i*n+j];
+        }
+        Q[i*n+i] = -row;
+        meanRate += model->frequencies[i] * row;
+    }
+    for (i = 0; i < n*n; i++) Q[i] /= meanRate;
+
+    // reversibility makes D^1/2 Q D^-1/2 symmetric (D = diag(pi)); decompose
+    // that and map back: U = D^-1/2 V, U^-1 = V^T D^1/2
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++)
+            Q[i*n+j] *= sqrt(model->frequencies[i] / model->frequencies[j]);
+    for (i = 0; i < n; i++)
+        for (j = 0; j < i; j++)
+            Q[i*n+j] = Q[j*n+i] = 0.5*(Q[i*n+j] + Q[j*n+i]);
+    if (!JacobiEigen(n, Q, model->eigenvalues, V))
+    {
+        printf("Error decomposing the %d-state rate matrix, Line %u in file %s !!!\n\n", n, __LINE__, __FILE__);
+        free(Q);
+        free(V);
+        FreeSubstitutionModel(model);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++)
+        {
+            model->eigenvectors[i*n+j] = V[i*n+j] / sqrt(model->frequencies[i]);
+            model->inverseEigenvectors[i*n+j] = V[j*n+i] * sqrt(model->frequencies[j]);
+        }
+    free(Q);
+    free(V);
+    return model;
+}
+
+void FreeSubstitutionModel(SubstitutionModel* model)
+{
+    if (!model) return;
+    free(model->frequencies);
+    free(model->eigenvalues);
+    free(model->eigenvectors);
+    free(model->inverseEigenvectors);
+    free(model->rates);
+    free(model->rateWeights);
+    free(model);
+}
+
+// Discrete gamma
+// *********************************************************************
+// Regularized lower incomplete gamma P(a, x): the series below a + 1, the
+// continued fraction (modified Lentz) above
+static double IncompleteGamma(double a, double x)
+{
+    if (x <= 0.) return 0.;
+    double logPrefix = a*log(x) - x - lgamma(a);
+    int n;
+    if (x < a + 1.)
+    {
+        double term = 1./a, sum = term;
+        for (n = 1; n < 1000 && fabs(term) > fabs(sum)*1e-16; n++)
+        {
+            term *= x / (a + n);
+            sum += term;
+        }
+        return sum * exp(logPrefix);
+    }
+    double b = x + 1. - a, c = 1e300, d = 1./b, h = d;
+    for (n = 1; n < 1000; n++)
+    {
+        double an = -n * (n - a);
+        b += 2.;
+        d = an*d + b;
+        if (fabs(d) < 1e-300) d = 1e-300;
+        c = b + an/c;
+        if (fabs(c) < 1e-300) c = 1e-300;
+        d = 1./d;
+        double delta = d*c;
+        h *= delta;
+        if (fabs(delta - 1.) < 1e-16) break;
+    }
+    return 1. - exp(logPrefix) * h;
+}
+
+// x with P(alpha, alpha x) = p: the p quantile of a gamma of shape alpha
+// and mean 1, by bisection
+static double GammaQuantile(double alpha, double p)
+{
+    double low = 0., high = 1.;
+    while (IncompleteGamma(alpha, alpha*high) < p) high *= 2.;
+    int i;
+    for (i = 0; i < 200 && high - low > 1e-15*high; i++)
+    {
+        double mid = 0.5*(low + high);
+        if (IncompleteGamma(alpha, alpha*mid) < p) low = mid;
+        else high = mid;
+    }
+    return 0.5*(low + high);
+}
+
+bool SetGammaRates(SubstitutionModel* model, int categories, double alpha)
+{
+    if (categories < 1 || categories > MAX_RATE_CATEGORIES || !(alpha > 0.)) return false;
+    double* rates = (double*)malloc(sizeof(double)*categories);
+    double* weights = (double*)malloc(sizeof(double)*categories);
+    double sum = 0.;
+    int k;
+    for (k = 0; k < categories; k++)
+    {
+        rates[k] = (categories == 1) ? 1. : GammaQuantile(alpha, (2.*k + 1.) / (2.*categories));
+        weights[k] = 1. / categories;
+        sum += rates[k];
+    }
+    for (k = 0; k < categories; k++) rates[k] *= categories / sum;
+    free(model->rates);
+    free(model->rateWeights);
+    model->rates = rates;
+    model->rateWeights = weights;
+    model->rateCount = categories;
+    return true;
+}
+
+// Cache
+// *********************************************************************
+struct MatrixCache
+{
+    const SubstitutionModel* model;
+    int         capacity, count;        // entries in use (<= capacity)
+    int         tableSize;              // open addressing, power of two
+    int*        table;                  // entry index, -1 = empty
+    double*     lengths;                // key of each entry
+    int*        categories;
+    fpoint*     matrices;               // capacity matrices
+    int*        pending;                // scratch: entry of each matrix to build
+};
+
+MatrixCache* CreateMatrixCache(const SubstitutionModel* model, int maxEntries)
+{
+    const int n = model->characters;
+    MatrixCache* cache = (MatrixCache*)calloc(1, sizeof(MatrixCache));
+    cache->model = model;
+    cache->capacity = maxEntries > 0 ? maxEntries : 1;
+    cache->tableSize = 1;
+    while (cache->tableSize < 2*cache->capacity) cache->tableSize <<= 1;
+    cache->table = (int*)malloc(sizeof(int)*cache->tableSize);
+    memset(cache->table, 0xff, sizeof(int)*cache->tableSize);
+    cache->lengths = (double*)malloc(sizeof(double)*cache->capacity);
+    cache->categories = (int*)malloc(sizeof(int)*cache->capacity);
+    cache->matrices = (fpoint*)malloc(sizeof(fpoint)*(long)cache->capacity*n*n);
+    cache->pending = (int*)malloc(sizeof(int)*cache->capacity);
+    return cache;
+}
+
+void FreeMatrixCache(MatrixCache* cache)
+{
+    if (!cache) return;
+    free(cache->table);
+    free(cache->lengths);
+    free(cache->categories);
+    free(cache->matrices);
+    free(cache->pending);
+    free(cache);
+}
+
+void ClearMatrixCache(MatrixCache* cache)
+{
+    cache->count = 0;
+    memset(cache->table, 0xff, sizeof(int)*cache->tableSize);
+}
+
+static int CacheSlot(const MatrixCache* cache, double length, int category)
+{
+    unsigned long long bits;
+    memcpy(&bits, &length, sizeof(bits));
+    bits ^= (unsigned long long)category * 0x9E3779B97F4A7C15ULL;
+    bits *= 0xBF58476D1CE4E5B9ULL;
+    int slot = (int)(bits >> 40) & (cache->tableSize - 1);
+    while (cache->table[slot] >= 0 &&
+           (cache->lengths[cache->table[slot]] != length || cache->categories[cache->table[slot]] != category))
+        slot = (slot + 1) & (cache->tableSize - 1);
+    return slot;
+}
+
+// P[b] = U.diag(exp(L times[b])).U^-1 for count matrices at once, negative
+// round-off clamped to 0: one exponential sweep over every matrix, then
+// the products MATRIX_BLOCK matrices at a time, so each row of U^-1 is
+// loaded once per block rather than once per matrix.  Accumulates in
+// double whatever fpoint is.
+#define MATRIX_BLOCK    16
+
+static void BuildMatrices(const SubstitutionModel* model, int count, const double* times, fpoint* const* P)
+{
+    const int n = model->characters;
+    double* exponentials = (double*)malloc(sizeof(double)*count*n);
+    double* acc = (double*)malloc(sizeof(double)*MATRIX_BLOCK*n);
+    int b, first, i, j, k;
+    for (b = 0; b < count; b++)
+        for (k = 0; k < n; k++) exponentials[b*n+k] = exp(model->eigenvalues[k] * times[b]);
+
+    for (first = 0; first < count; first += MATRIX_BLOCK)
+    {
+        const int block = (count - first < MATRIX_BLOCK) ? count - first : MATRIX_BLOCK;
+        const double* e = exponentials + first*n;
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < block*n; j++) acc[j] = 0.;
+            for (k = 0; k < n; k++)
+            {
+                const double u = model->eigenvectors[i*n+k];
+                const double* inv = model->inverseEigenvectors + k*n;
+                for (b = 0; b < block; b++)
+                {
+                    const double s = u * e[b*n+k];
+                    double* row = acc + b*n;
+                    for (j = 0; j < n; j++) row[j] += s * inv[j];
+                }
+            }
+            for (b = 0; b < block; b++)
+                for (j = 0; j < n; j++)
+                    P[first+b][i*n+j] = (fpoint)(acc[b*n+j] > 0. ? acc[b*n+j] : 0.);
+        }
+    }
+    free(exponentials);
+    free(acc);
+}
+
+// Look every branch up, reserving an entry (built later, from pending)
+// for each distinct new key; entry[i] is -1 for a key that found no room.
+// false when some key did not fit.
+static bool ReserveEntries(MatrixCache* cache, int count, const double* lengths, const int* categories, int* entry,
+                           int* pendingCount)
+{
+    bool fits = true;
+    int i;
+    *pendingCount = 0;
+    for (i = 0; i < count; i++)
+    {
+        double length = lengths[i] > 0. ? lengths[i] : 0.;
+        int slot = CacheSlot(cache, length, categories[i]);
+        if (cache->table[slot] < 0)
+        {
+            if (cache->count == cache->capacity)
+            {
+                entry[i] = -1;
+                fits = false;
+                continue;
+            }
+            int e = cache->count++;
+            cache->table[slot] = e;
+            cache->lengths[e] = length;
+            cache->categories[e] = categories[i];
+            cache->pending[(*pendingCount)++] = e;
+        }
+        entry[i] = cache->table[slot];
+    }
+    return fits;
+}
+
+int BuildTransitionMatrices(MatrixCache* cache, int count, const double* lengths, const int* categories,
+                            fpoint* matrices)
+{
+    const SubstitutionModel* model = cache->model;
+    const long size = (long)model->characters * model->characters;
+    int i;
+
+    // a batch whose distinct new keys cannot fit beside the current entries
+    // starts again from an empty cache; keys that still find no room (more
+    // than the cache holds) are built straight out
+    int pendingCount = 0;
+    int* entry = (int*)malloc(sizeof(int)*count);
+    if (!ReserveEntries(cache, count, lengths, categories, entry, &pendingCount))
+    {
+        ClearMatrixCache(cache);
+        ReserveEntries(cache, count, lengths, categories, entry, &pendingCount);
+    }
+
+    // the new entries and the ones built straight out, in one batch
+    double* times = (double*)malloc(sizeof(double)*count);
+    fpoint** targets = (fpoint**)malloc(sizeof(fpoint*)*count);
+    int built = 0;
+    for (i = 0; i < pendingCount; i++)
+    {
+        int e = cache->pending[i];
+        times[built] = cache->lengths[e] * model->rates[cache->categories[e]];
+        targets[built++] = cache->matrices + e*size;
+    }
+    for (i = 0; i < count; i++)
+        if (entry[i] < 0)
+        {
+            times[built] = (lengths[i] > 0. ? lengths[i] : 0.) * model->rates[categories[i]];
+            targets[built++] = matrices + i*size;
+        }
+    BuildMatrices(model, built, times, targets);
+
+    for (i = 0; i < count; i++)
+        if (entry[i] >= 0)
+            memcpy(matrices + i*size, cache->matrices + entry[i]*size, sizeof(fpoint)*size);
+    free(entry);
+    free(times);
+    free(targets);
+    return built;
+}
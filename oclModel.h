@@ -0,0 +1,69 @@
+// *********************************************************************
+// oclModel: substitution model and branch transition matrices
+//
+// A time-reversible rate matrix Q is eigendecomposed once, Q = U.L.U^-1,
+// and every branch matrix is then P(t) = U.exp(L r t).U^-1 for branch
+// length t and rate multiplier r.  Matrices are built in batches (one
+// exponential sweep over every new matrix, then products blocked across
+// the matrices) and kept in a cache keyed by (branch length, rate
+// category), so only branches whose length changed are ever recomputed.
+//
+// Among-site rate variation is a discrete gamma: rateCount equally likely
+// categories, each the median of its quantile slice of a mean-1 gamma of
+// shape alpha, rescaled so the rates average 1.
+//
+// Exchangeabilities follow the state count: HKY-style transitions/
+// transversions (kappa) for 4 states, Goldman-Yang codons (kappa, omega)
+// for 61, equal rates otherwise.  Equilibrium frequencies are uniform, to
+// match RootLogLikelihood.
+// *********************************************************************
+
+#ifndef OCLMODEL_H
+#define OCLMODEL_H
+
+#include "oclFirstLoop.h"
+
+#define DEFAULT_KAPPA       2.0     // transition / transversion rate ratio
+#define DEFAULT_OMEGA       0.5     // nonsynonymous / synonymous rate ratio
+#define DEFAULT_ALPHA       1.0     // gamma shape of the rate categories
+#define MAX_RATE_CATEGORIES 16
+
+struct SubstitutionModel
+{
+    int         characters;
+    double*     frequencies;        // pi, characters entries
+    double*     eigenvalues;        // L, characters entries (<= 0)
+    double*     eigenvectors;       // U, characters x characters, row-major
+    double*     inverseEigenvectors;// U^-1
+    int         rateCount;          // rate categories
+    double*     rates;              // rate multiplier of each category
+    double*     rateWeights;        // probability of each category
+};
+
+// Build and decompose Q for the given state count; NULL if the
+// decomposition fails to converge.  Starts with a single rate category.
+SubstitutionModel* CreateSubstitutionModel(int characters, double kappa, double omega);
+void FreeSubstitutionModel(SubstitutionModel* model);
+
+// Replace the rate categories with a discrete gamma of categories rates
+// (1 to MAX_RATE_CATEGORIES) of shape alpha; false if either is out of range.
+// Caches of the model still hold matrices for the old rates: clear them
+// with ClearMatrixCache.
+bool SetGammaRates(SubstitutionModel* model, int categories, double alpha);
+
+struct MatrixCache;
+
+// maxEntries matrices are kept; the cache is emptied when it fills up
+MatrixCache* CreateMatrixCache(const SubstitutionModel* model, int maxEntries);
+void FreeMatrixCache(MatrixCache* cache);
+
+// Drop every cached matrix, as after the model's rates change
+void ClearMatrixCache(MatrixCache* cache);
+
+// matrices[i] (characters x characters, row = parent state, column = child
+// state) = P(lengths[i] * rates[categories[i]]).  Cached matrices are copied
+// out; the rest are built in one batched pass.  Returns the number built.
+int BuildTransitionMatrices(MatrixCache* cache, int count, const double* lengths, const int* categories,
+                            fpoint* matrices);
+
+#endif
@@ -0,0 +1,124 @@
+// *********************************************************************
+// oclPatterns: site-pattern compression
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oclPatterns.h"
+
+// FNV-1a over the bytes of one column, tip by tip
+static unsigned long long HashColumn(const fpoint* tipPartials, int tipCount, long sites, int characters, long site)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    int tip;
+    size_t b;
+    for (tip = 0; tip < tipCount; tip++)
+    {
+        const unsigned char* bytes = (const unsigned char*)(tipPartials + ((long)tip*sites + site)*characters);
+        for (b = 0; b < sizeof(fpoint)*characters; b++)
+        {
+            hash ^= bytes[b];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+static bool SameColumn(const fpoint* tipPartials, int tipCount, long sites, int characters, long a, long b)
+{
+    int tip;
+    for (tip = 0; tip < tipCount; tip++)
+    {
+        const fpoint* base = tipPartials + (long)tip*sites*characters;
+        if (memcmp(base + a*characters, base + b*characters, sizeof(fpoint)*characters) != 0) return false;
+    }
+    return true;
+}
+
+static SitePatterns* AllocSitePatterns(long sites)
+{
+    SitePatterns* patterns = (SitePatterns*)calloc(1, sizeof(SitePatterns));
+    if (!patterns) return NULL;
+    patterns->siteCount = sites;
+    patterns->weights = (int*)malloc(sizeof(int)*sites);
+    patterns->sitePattern = (long*)malloc(sizeof(long)*sites);
+    if (!patterns->weights || !patterns->sitePattern)
+    {
+        FreeSitePatterns(patterns);
+        return NULL;
+    }
+    return patterns;
+}
+
+SitePatterns* CompressSitePatterns(fpoint* tipPartials, int tipCount, long sites, int characters)
+{
+    SitePatterns* patterns = AllocSitePatterns(sites);
+    long* firstSite = (long*)malloc(sizeof(long)*sites);   // first column of each pattern
+    long tableSize = 1;
+    while (tableSize < 2*sites) tableSize <<= 1;
+    long* table = (long*)malloc(sizeof(long)*tableSize);    // open addressing, -1 = empty
+    if (!patterns || !firstSite || !table)
+    {
+        FreeSitePatterns(patterns);
+        free(firstSite);
+        free(table);
+        return NULL;
+    }
+    memset(table, 0xff, sizeof(long)*tableSize);
+
+    long site, pattern = 0;
+    for (site = 0; site < sites; site++)
+    {
+        long slot = (long)(HashColumn(tipPartials, tipCount, sites, characters, site) & (tableSize - 1));
+        while (table[slot] >= 0 &&
+               !SameColumn(tipPartials, tipCount, sites, characters, firstSite[table[slot]], site))
+            slot = (slot + 1) & (tableSize - 1);
+        if (table[slot] < 0)
+        {
+            table[slot] = pattern;
+            firstSite[pattern] = site;
+            patterns->weights[pattern] = 0;
+            pattern++;
+        }
+        patterns->weights[table[slot]]++;
+        patterns->sitePattern[site] = table[slot];
+    }
+    patterns->patternCount = pattern;
+
+    // Compact to [tip][pattern][character].  Every destination row is at or
+    // before its source row and after every source already copied, so a
+    // forward sweep never overwrites a column it still needs.
+    int tip;
+    for (tip = 0; tip < tipCount; tip++)
+        for (pattern = 0; pattern < patterns->patternCount; pattern++)
+            memmove(tipPartials + ((long)tip*patterns->patternCount + pattern)*characters,
+                    tipPartials + ((long)tip*sites + firstSite[pattern])*characters, sizeof(fpoint)*characters);
+
+    free(firstSite);
+    free(table);
+    return patterns;
+}
+
+SitePatterns* IdentitySitePatterns(long sites)
+{
+    SitePatterns* patterns = AllocSitePatterns(sites);
+    if (!patterns) return NULL;
+    long site;
+    for (site = 0; site < sites; site++)
+    {
+        patterns->weights[site] = 1;
+        patterns->sitePattern[site] = site;
+    }
+    patterns->patternCount = sites;
+    return patterns;
+}
+
+void FreeSitePatterns(SitePatterns* patterns)
+{
+    if (!patterns) return;
+    free(patterns->weights);
+    free(patterns->sitePattern);
+    free(patterns);
+}
@@ -0,0 +1,34 @@
+// *********************************************************************
+// oclPatterns: site-pattern compression
+//
+// Alignment columns whose tip partials are identical across every tip give
+// identical likelihoods, so only one copy of each distinct column (a
+// pattern) is pruned and its log-likelihood is counted once per column it
+// stands for.
+// *********************************************************************
+
+#ifndef OCLPATTERNS_H
+#define OCLPATTERNS_H
+
+#include "oclFirstLoop.h"
+
+struct SitePatterns
+{
+    long    siteCount;          // alignment columns before compression
+    long    patternCount;       // distinct columns kept
+    int*    weights;            // weights[pattern]: columns it stands for
+    long*   sitePattern;        // sitePattern[site]: pattern holding that column
+};
+
+// Collapse duplicate columns of the tip partials ([tip][site][character],
+// tipCount * sites * characters values) in place: on return the first
+// tipCount * patternCount * characters values hold [tip][pattern][character],
+// patterns in order of first appearance.  Returns NULL on allocation failure.
+SitePatterns* CompressSitePatterns(fpoint* tipPartials, int tipCount, long sites, int characters);
+
+// One pattern per column, weights of 1; the tip partials are left as they are
+SitePatterns* IdentitySitePatterns(long sites);
+
+void FreeSitePatterns(SitePatterns* patterns);
+
+#endif
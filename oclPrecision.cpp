@@ -0,0 +1,177 @@
+// *********************************************************************
+// oclPrecision: device precision modes and tolerance-based verification
+// *********************************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "oclPrecision.h"
+
+static const char* precisionNames[] = { "double", "single", "mixed" };
+
+int ParsePrecision(const char* name)
+{
+    int i;
+    for (i = 0; i < 3; i++)
+        if (strcmp(name, precisionNames[i]) == 0) return i;
+    return -1;
+}
+
+const char* PrecisionName(DevicePrecision precision)
+{
+    return precisionNames[precision];
+}
+
+const char* PrecisionStorageType(DevicePrecision precision)
+{
+    return (precision == PRECISION_DOUBLE) ? "double" : "float";
+}
+
+const char* PrecisionAccumType(DevicePrecision precision)
+{
+    return (precision == PRECISION_SINGLE) ? "float" : "double";
+}
+
+size_t PrecisionStorageBytes(DevicePrecision precision)
+{
+    return (precision == PRECISION_DOUBLE) ? sizeof(cl_double) : sizeof(cl_float);
+}
+
+size_t PrecisionAccumBytes(DevicePrecision precision)
+{
+    return (precision == PRECISION_SINGLE) ? sizeof(cl_float) : sizeof(cl_double);
+}
+
+// Summation order and contraction may differ from the host's, so even
+// double gets a few ULPs; float partials are rounded once per node on the
+// way to the root
+double PrecisionUlpTolerance(DevicePrecision precision)
+{
+    return (precision == PRECISION_DOUBLE) ? 64. : 1024.;
+}
+
+double PrecisionRelativeTolerance(DevicePrecision precision)
+{
+    if (precision == PRECISION_DOUBLE) return 1e-10;
+    return (precision == PRECISION_MIXED) ? 1e-6 : 1e-5;
+}
+
+void StoreDeviceValues(void* device, const fpoint* host, long count, size_t valueBytes)
+{
+    long i;
+    if (valueBytes == sizeof(fpoint))
+    {
+        if (device != host) memcpy(device, host, sizeof(fpoint) * count);
+    }
+    else if (valueBytes == sizeof(cl_float))
+        for (i = 0; i < count; i++) ((cl_float*)device)[i] = (cl_float)host[i];
+    else
+        for (i = 0; i < count; i++) ((cl_double*)device)[i] = (cl_double)host[i];
+}
+
+void LoadDeviceValues(fpoint* host, const void* device, long count, size_t valueBytes)
+{
+    long i;
+    if (valueBytes == sizeof(fpoint))
+    {
+        if (device != host) memcpy(host, device, sizeof(fpoint) * count);
+    }
+    else if (valueBytes == sizeof(cl_float))
+        for (i = 0; i < count; i++) host[i] = (fpoint)((const cl_float*)device)[i];
+    else
+        for (i = 0; i < count; i++) host[i] = (fpoint)((const cl_double*)device)[i];
+}
+
+void StoreDeviceDoubles(void* device, const double* host, long count, size_t valueBytes)
+{
+    long i;
+    if (valueBytes == sizeof(cl_double))
+    {
+        if (device != host) memcpy(device, host, sizeof(cl_double) * count);
+    }
+    else
+        for (i = 0; i < count; i++) ((cl_float*)device)[i] = (cl_float)host[i];
+}
+
+void LoadDeviceDoubles(double* host, const void* device, long count, size_t valueBytes)
+{
+    long i;
+    if (valueBytes == sizeof(cl_double))
+    {
+        if (device != host) memcpy(host, device, sizeof(cl_double) * count);
+    }
+    else
+        for (i = 0; i < count; i++) host[i] = ((const cl_float*)device)[i];
+}
+
+// Representable values between a and b in float or double: their bit
+// patterns mapped to a monotonic integer scale
+static double UlpDistance(double a, double b, size_t valueBytes)
+{
+    if (isnan(a) || isnan(b)) return INFINITY;
+    if (valueBytes == sizeof(cl_float))
+    {
+        float x = (fabs(a) < FLT_MIN) ? 0.f : (float)a, y = (fabs(b) < FLT_MIN) ? 0.f : (float)b;
+        int32_t i, j;
+        memcpy(&i, &x, sizeof(i));
+        memcpy(&j, &y, sizeof(j));
+        if (i < 0) i = INT32_MIN - i;
+        if (j < 0) j = INT32_MIN - j;
+        return fabs((double)i - (double)j);
+    }
+    double x = (fabs(a) < DBL_MIN) ? 0. : a, y = (fabs(b) < DBL_MIN) ? 0. : b;
+    int64_t i, j;
+    memcpy(&i, &x, sizeof(i));
+    memcpy(&j, &y, sizeof(j));
+    if (i < 0) i = INT64_MIN - i;
+    if (j < 0) j = INT64_MIN - j;
+    return fabs((double)i - (double)j);
+}
+
+void CompareRootPartials(const fpoint* device, const int* deviceScalings, const fpoint* reference,
+                         const int* referenceScalings, long patterns, int characters, size_t valueBytes,
+                         AccuracyStats* stats)
+{
+    double sum = 0.;
+    long pattern;
+    int c;
+    stats->maxUlp = 0.;
+    for (pattern = 0; pattern < patterns; pattern++)
+    {
+        // both are value * 2^-scaling: the reference at the device's exponent
+        int shift = deviceScalings[pattern] - referenceScalings[pattern];
+        for (c = 0; c < characters; c++)
+        {
+            double ulps = UlpDistance(device[pattern*characters + c], ldexp(reference[pattern*characters + c], shift),
+                                      valueBytes);
+            if (!(ulps <= stats->maxUlp)) stats->maxUlp = ulps;     // also catches NaN
+            sum += ulps;
+        }
+    }
+    stats->meanUlp = (patterns > 0) ? sum / ((double)patterns * characters) : 0.;
+}
+
+void CompareSiteLogLikelihoods(const double* device, const double* reference, long count, AccuracyStats* stats)
+{
+    double sum = 0.;
+    long i;
+    stats->maxRelative = 0.;
+    for (i = 0; i < count; i++)
+    {
+        double err = fabs(device[i] - reference[i]) / fmax(fabs(reference[i]), 1.);
+        if (!(err <= stats->maxRelative)) stats->maxRelative = err;
+        sum += err;
+    }
+    stats->meanRelative = (count > 0) ? sum / count : 0.;
+}
+
+bool ReportAccuracy(const char* label, const AccuracyStats* stats, double ulpTolerance, double relativeTolerance)
+{
+    printf("%s root partials: max %.0f ULP, mean %.3f ULP (tolerance %.0f); site log likelihood relative error: "
+           "max %e, mean %e (tolerance %e)\n", label, stats->maxUlp, stats->meanUlp, ulpTolerance, stats->maxRelative,
+           stats->meanRelative, relativeTolerance);
+    return stats->maxUlp <= ulpTolerance && stats->maxRelative <= relativeTolerance;
+}
@@ -0,0 +1,91 @@
+// *********************************************************************
+// oclPrecision: device precision modes and tolerance-based verification
+//
+// The host always prunes in fpoint.  The device kernel is built for one
+// of three modes (--precision):
+//
+//   double   partials, models and arithmetic in double
+//   single   all in float: half the memory and bandwidth
+//   mixed    float partials and models, products and sums carried in
+//            double, so only the stored values are rounded to float
+//
+// The host keeps copies of the partials and models in the device's
+// storage type for the transfers; StoreDeviceValues / LoadDeviceValues
+// convert between them and fpoint (a no-op when the types match).  Float
+// storage also needs an earlier rescue threshold than double, so every
+// stored value stays a normal float.
+//
+// A device result is then checked against the host reference with
+// tolerances instead of bit equality: the ULP distance of every root
+// partial, measured in the storage type after bringing the reference to
+// the device's rescue exponent, and the relative error of every site
+// log-likelihood.  Both are reported as max and mean.
+// *********************************************************************
+
+#ifndef OCLPRECISION_H
+#define OCLPRECISION_H
+
+#include <stddef.h>
+
+#include "oclFirstLoop.h"
+
+enum DevicePrecision
+{
+    PRECISION_DOUBLE = 0,
+    PRECISION_SINGLE,
+    PRECISION_MIXED
+};
+
+#define DOUBLE_UFLOW_THRESH     1e-56                   // rescue threshold for double storage
+#define SINGLE_UFLOW_THRESH     9.094947017729282e-13   // 2^-40: rescue threshold for float storage
+
+// -1 if unknown
+int ParsePrecision(const char* name);
+const char* PrecisionName(DevicePrecision precision);
+
+// Kernel types: storage (partials, models, local tiles) and accumulation
+// (products, sums, reductions), as OpenCL C names and as host byte sizes
+const char* PrecisionStorageType(DevicePrecision precision);
+const char* PrecisionAccumType(DevicePrecision precision);
+size_t PrecisionStorageBytes(DevicePrecision precision);
+size_t PrecisionAccumBytes(DevicePrecision precision);
+
+// Default tolerances: root partial ULPs in the storage type, and relative
+// site log-likelihood error
+double PrecisionUlpTolerance(DevicePrecision precision);
+double PrecisionRelativeTolerance(DevicePrecision precision);
+
+// count values between fpoint and a device type of valueBytes (4 or 8).
+// Nothing is done when valueBytes is sizeof(fpoint) and the arrays are
+// the same.
+void StoreDeviceValues(void* device, const fpoint* host, long count, size_t valueBytes);
+void LoadDeviceValues(fpoint* host, const void* device, long count, size_t valueBytes);
+
+// The same for doubles, such as the log-likelihood reduction's weights
+// and results in the accum type
+void StoreDeviceDoubles(void* device, const double* host, long count, size_t valueBytes);
+void LoadDeviceDoubles(double* host, const void* device, long count, size_t valueBytes);
+
+struct AccuracyStats
+{
+    double  maxUlp, meanUlp;                // root partials
+    double  maxRelative, meanRelative;      // site log-likelihoods
+};
+
+// ULP distances of patterns x characters root partials, device against
+// reference, each pattern with its own rescue exponent.  Distances are
+// counted in a type of valueBytes; values below its smallest normal count
+// as 0, since devices may flush them.
+void CompareRootPartials(const fpoint* device, const int* deviceScalings, const fpoint* reference,
+                         const int* referenceScalings, long patterns, int characters, size_t valueBytes,
+                         AccuracyStats* stats);
+
+// Relative errors |device - reference| / max(|reference|, 1) of count
+// site log-likelihoods (absolute near 0, where fully ambiguous columns sit)
+void CompareSiteLogLikelihoods(const double* device, const double* reference, long count, AccuracyStats* stats);
+
+// One line of both; true when the max errors are within the tolerances
+// (NaN never is)
+bool ReportAccuracy(const char* label, const AccuracyStats* stats, double ulpTolerance, double relativeTolerance);
+
+#endif
@@ -0,0 +1,269 @@
+// *********************************************************************
+// oclProfile: OpenCL event profiling
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oclProfile.h"
+
+#define PROFILE_LABEL_LENGTH    32
+#define PROFILE_TOP_NODES       10
+
+static const char* operationNames[PROFILE_OPERATIONS] = { "write", "kernel", "read" };
+
+struct ProfileTotals
+{
+    long        count;
+    double      bytes;
+    cl_ulong    queuedToSubmit, submitToStart, execution;   // nanoseconds
+};
+
+struct ProfileLabel
+{
+    char                name[PROFILE_LABEL_LENGTH];
+    ProfileOperation    operation;
+    ProfileTotals       totals;
+};
+
+struct PendingEvent
+{
+    cl_event            event;
+    ProfileOperation    operation;
+    char                label[PROFILE_LABEL_LENGTH];
+    size_t              bytes;
+    int                 nodeStart, nodeCount;   // into pendingNodes
+};
+
+struct DeviceProfiler
+{
+    const Tree*     tree;
+
+    PendingEvent*   pending;
+    int             pendingCount, pendingCapacity;
+    int*            pendingNodes;
+    int             pendingNodeCount, pendingNodeCapacity;
+
+    ProfileTotals   operations[PROFILE_OPERATIONS];
+    ProfileLabel*   labels;
+    int             labelCount, labelCapacity;
+    double*         nodeTime;           // kernel nanoseconds charged to each node
+    long*           nodeLaunches;
+    long            unreadable;         // events whose stamps could not be read
+
+    FILE*           trace;
+    bool            traceStarted;       // an event has been written (comma before the next)
+    cl_ulong        traceBase;          // QUEUED stamp of the first event
+};
+
+DeviceProfiler* CreateDeviceProfiler(const Tree* tree, const char* tracePath)
+{
+    DeviceProfiler* profiler = (DeviceProfiler*)calloc(1, sizeof(DeviceProfiler));
+    profiler->tree = tree;
+    profiler->nodeTime = (double*)calloc(tree->nodeCount, sizeof(double));
+    profiler->nodeLaunches = (long*)calloc(tree->nodeCount, sizeof(long));
+    if (tracePath)
+    {
+        profiler->trace = fopen(tracePath, "w");
+        if (!profiler->trace)
+        {
+            printf("Error creating trace file %s\n", tracePath);
+            FreeDeviceProfiler(profiler);
+            return NULL;
+        }
+        fprintf(profiler->trace, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    }
+    return profiler;
+}
+
+void FreeDeviceProfiler(DeviceProfiler* profiler)
+{
+    if (!profiler) return;
+    int i;
+    for (i = 0; i < profiler->pendingCount; i++)
+        if (profiler->pending[i].event) clReleaseEvent(profiler->pending[i].event);
+    if (profiler->trace)
+    {
+        fprintf(profiler->trace, "\n]}\n");
+        fclose(profiler->trace);
+    }
+    free(profiler->pending);
+    free(profiler->pendingNodes);
+    free(profiler->labels);
+    free(profiler->nodeTime);
+    free(profiler->nodeLaunches);
+    free(profiler);
+}
+
+cl_event* ProfileEvent(DeviceProfiler* profiler, ProfileOperation operation, const char* label, size_t bytes,
+                       const int* nodes, int nodeCount)
+{
+    if (!profiler) return NULL;
+    if (profiler->pendingCount == profiler->pendingCapacity)
+    {
+        profiler->pendingCapacity = profiler->pendingCapacity ? 2 * profiler->pendingCapacity : 64;
+        profiler->pending = (PendingEvent*)realloc(profiler->pending, sizeof(PendingEvent) * profiler->pendingCapacity);
+    }
+    while (profiler->pendingNodeCount + nodeCount > profiler->pendingNodeCapacity)
+    {
+        profiler->pendingNodeCapacity = profiler->pendingNodeCapacity ? 2 * profiler->pendingNodeCapacity : 256;
+        profiler->pendingNodes = (int*)realloc(profiler->pendingNodes, sizeof(int) * profiler->pendingNodeCapacity);
+    }
+
+    PendingEvent* pending = &profiler->pending[profiler->pendingCount++];
+    pending->event = NULL;          // stays NULL if the enqueue fails
+    pending->operation = operation;
+    strncpy(pending->label, label, PROFILE_LABEL_LENGTH - 1);
+    pending->label[PROFILE_LABEL_LENGTH - 1] = '\0';
+    pending->bytes = bytes;
+    pending->nodeStart = profiler->pendingNodeCount;
+    pending->nodeCount = nodeCount;
+    if (nodeCount > 0) memcpy(profiler->pendingNodes + profiler->pendingNodeCount, nodes, sizeof(int) * nodeCount);
+    profiler->pendingNodeCount += nodeCount;
+    return &pending->event;
+}
+
+void ProfileAttachEvent(DeviceProfiler* profiler, cl_event event, ProfileOperation operation, const char* label,
+                        size_t bytes, const int* nodes, int nodeCount)
+{
+    if (!profiler || !event) return;
+    clRetainEvent(event);
+    *ProfileEvent(profiler, operation, label, bytes, nodes, nodeCount) = event;
+}
+
+static ProfileTotals* LabelTotals(DeviceProfiler* profiler, ProfileOperation operation, const char* name)
+{
+    int i;
+    for (i = 0; i < profiler->labelCount; i++)
+        if (profiler->labels[i].operation == operation && strcmp(profiler->labels[i].name, name) == 0)
+            return &profiler->labels[i].totals;
+    if (profiler->labelCount == profiler->labelCapacity)
+    {
+        profiler->labelCapacity = profiler->labelCapacity ? 2 * profiler->labelCapacity : 16;
+        profiler->labels = (ProfileLabel*)realloc(profiler->labels, sizeof(ProfileLabel) * profiler->labelCapacity);
+    }
+    ProfileLabel* label = &profiler->labels[profiler->labelCount++];
+    memset(label, 0, sizeof(ProfileLabel));
+    strcpy(label->name, name);
+    label->operation = operation;
+    return &label->totals;
+}
+
+static void AddTotals(ProfileTotals* totals, size_t bytes, cl_ulong queuedToSubmit, cl_ulong submitToStart,
+                      cl_ulong execution)
+{
+    totals->count++;
+    totals->bytes += bytes;
+    totals->queuedToSubmit += queuedToSubmit;
+    totals->submitToStart += submitToStart;
+    totals->execution += execution;
+}
+
+static void TraceEvent(DeviceProfiler* profiler, const PendingEvent* pending, cl_ulong queued, cl_ulong submit,
+                       cl_ulong start, cl_ulong end)
+{
+    if (!profiler->traceStarted) profiler->traceBase = queued;
+    cl_ulong base = profiler->traceBase;
+    fprintf(profiler->trace, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                             "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"queued_us\": %.3f, \"submit_us\": %.3f, "
+                             "\"bytes\": %lu, \"nodes\": [",
+            profiler->traceStarted ? ",\n" : "", pending->label, operationNames[pending->operation],
+            (int)pending->operation, (start > base ? start - base : 0) * 1e-3, (end - start) * 1e-3,
+            (queued > base ? queued - base : 0) * 1e-3, (submit > base ? submit - base : 0) * 1e-3,
+            (unsigned long)pending->bytes);
+    int i;
+    for (i = 0; i < pending->nodeCount; i++)
+        fprintf(profiler->trace, "%s%d", i ? ", " : "", profiler->pendingNodes[pending->nodeStart + i]);
+    fprintf(profiler->trace, "]}}");
+    profiler->traceStarted = true;
+}
+
+void ProfileCollect(DeviceProfiler* profiler)
+{
+    if (!profiler) return;
+    const Tree* tree = profiler->tree;
+    int i, n;
+    for (i = 0; i < profiler->pendingCount; i++)
+    {
+        PendingEvent* pending = &profiler->pending[i];
+        if (!pending->event) continue;
+
+        cl_ulong queued, submit, start, end;
+        cl_int err = clGetEventProfilingInfo(pending->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        err |= clGetEventProfilingInfo(pending->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        // some runtimes leave QUEUED / SUBMIT unset; count those stages as 0
+        if (clGetEventProfilingInfo(pending->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL)
+            != CL_SUCCESS || queued > start) queued = start;
+        if (clGetEventProfilingInfo(pending->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL)
+            != CL_SUCCESS || submit > start || submit < queued) submit = queued;
+        clReleaseEvent(pending->event);
+        pending->event = NULL;
+        if (err != CL_SUCCESS || end < start)
+        {
+            profiler->unreadable++;
+            continue;
+        }
+
+        AddTotals(&profiler->operations[pending->operation], pending->bytes, submit - queued, start - submit,
+                  end - start);
+        AddTotals(LabelTotals(profiler, pending->operation, pending->label), pending->bytes, submit - queued,
+                  start - submit, end - start);
+
+        // charge a launch to its nodes by child count
+        const int* nodes = profiler->pendingNodes + pending->nodeStart;
+        long children = 0;
+        for (n = 0; n < pending->nodeCount; n++)
+            children += tree->childStart[nodes[n]+1] - tree->childStart[nodes[n]];
+        for (n = 0; n < pending->nodeCount && children > 0; n++)
+        {
+            profiler->nodeTime[nodes[n]] += (double)(end - start) *
+                                            (tree->childStart[nodes[n]+1] - tree->childStart[nodes[n]]) / children;
+            profiler->nodeLaunches[nodes[n]]++;
+        }
+
+        if (profiler->trace) TraceEvent(profiler, pending, queued, submit, start, end);
+    }
+    profiler->pendingCount = 0;
+    profiler->pendingNodeCount = 0;
+    if (profiler->trace) fflush(profiler->trace);
+}
+
+static void PrintTotals(const char* name, const char* operation, const ProfileTotals* totals)
+{
+    double execution = (double)totals->execution;
+    printf("%-20s %-7s %8ld %14.3f %14.3f %14.3f %10.3f\n", name, operation, totals->count,
+           totals->queuedToSubmit * 1e-6, totals->submitToStart * 1e-6, execution * 1e-6,
+           (totals->bytes > 0. && execution > 0.) ? totals->bytes / execution : 0.);
+}
+
+void PrintDeviceProfile(const DeviceProfiler* profiler)
+{
+    const Tree* tree = profiler->tree;
+    int i, j;
+    printf("Device profile (ms)          count queued->submit  submit->start      execution       GB/s\n");
+    for (i = 0; i < PROFILE_OPERATIONS; i++)
+        if (profiler->operations[i].count) PrintTotals(operationNames[i], "", &profiler->operations[i]);
+    printf("\n");
+    for (i = 0; i < profiler->labelCount; i++)
+        PrintTotals(profiler->labels[i].name, operationNames[profiler->labels[i].operation], &profiler->labels[i].totals);
+    if (profiler->unreadable) printf("%ld events without profiling information\n", profiler->unreadable);
+
+    // busiest internal nodes, by selection over a short list
+    int top[PROFILE_TOP_NODES];
+    int topCount = 0;
+    for (i = tree->tipCount; i < tree->nodeCount; i++)
+    {
+        if (profiler->nodeLaunches[i] == 0) continue;
+        if (topCount < PROFILE_TOP_NODES) topCount++;
+        else if (profiler->nodeTime[i] <= profiler->nodeTime[top[topCount-1]]) continue;
+        for (j = topCount - 1; j > 0 && profiler->nodeTime[top[j-1]] < profiler->nodeTime[i]; j--) top[j] = top[j-1];
+        top[j] = i;
+    }
+    if (topCount) printf("\nNode   level children launches   kernel ms\n");
+    for (i = 0; i < topCount; i++)
+        printf("%-6d %5d %8d %8ld %11.3f\n", top[i], tree->level[top[i]],
+               tree->childStart[top[i]+1] - tree->childStart[top[i]], profiler->nodeLaunches[top[i]],
+               profiler->nodeTime[top[i]] * 1e-6);
+    printf("\n");
+}
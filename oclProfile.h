@@ -0,0 +1,57 @@
+// *********************************************************************
+// oclProfile: OpenCL event profiling
+//
+// With --profile the command queue is created with
+// CL_QUEUE_PROFILING_ENABLE and every write, kernel launch and read hands
+// an event slot from ProfileEvent to its clEnqueue* call.  Once the queue
+// has drained, ProfileCollect reads the QUEUED / SUBMIT / START / END
+// stamps of the pending events and folds them into totals per operation
+// type, per label (buffer or level) and per tree node.  A level launch is
+// charged to its nodes in proportion to their child counts, the amount of
+// work each one does.  Only the standard profiling queries are used, so
+// CPU runtimes such as pocl work as well as GPU drivers.
+//
+// With --profile=<file> every event is also streamed to a Chrome trace
+// (chrome://tracing, Perfetto) with its nodes and transfer size.
+// *********************************************************************
+
+#ifndef OCLPROFILE_H
+#define OCLPROFILE_H
+
+#include "oclFirstLoop.h"
+
+enum ProfileOperation
+{
+    PROFILE_WRITE = 0,
+    PROFILE_KERNEL,
+    PROFILE_READ,
+    PROFILE_OPERATIONS
+};
+
+struct DeviceProfiler;
+
+// tracePath may be NULL for the summary only.  Returns NULL after printing
+// the reason if the trace file cannot be created.
+DeviceProfiler* CreateDeviceProfiler(const Tree* tree, const char* tracePath);
+void FreeDeviceProfiler(DeviceProfiler* profiler);     // finishes the trace file
+
+// The event argument for one clEnqueue* call, or NULL when profiler is NULL
+// (profiling off).  bytes is the transfer size (0 for kernels), nodes the
+// tree nodes a launch computes.
+cl_event* ProfileEvent(DeviceProfiler* profiler, ProfileOperation operation, const char* label, size_t bytes,
+                       const int* nodes, int nodeCount);
+
+// Same for an event the caller created and keeps (pipeline dependencies):
+// the profiler takes its own reference
+void ProfileAttachEvent(DeviceProfiler* profiler, cl_event event, ProfileOperation operation, const char* label,
+                        size_t bytes, const int* nodes, int nodeCount);
+
+// Fold every pending event into the totals and release it; call once the
+// commands have completed (after a blocking read or clFinish)
+void ProfileCollect(DeviceProfiler* profiler);
+
+// Totals per operation type and label, then the nodes with the most
+// device time
+void PrintDeviceProfile(const DeviceProfiler* profiler);
+
+#endif
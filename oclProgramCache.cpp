@@ -0,0 +1,171 @@
+// *********************************************************************
+// oclProgramCache: on-disk cache of built program binaries
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "oclProgramCache.h"
+
+#define CACHE_KEY_LENGTH    2048
+#define CACHE_FORMAT        "oclFirstLoop program binary 1"
+
+unsigned long long HashText(const char* text)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *text; text++)
+    {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void DeviceIdentity(cl_device_id device, char* identity, size_t length)
+{
+    char name[256] = {0}, vendor[256] = {0}, driver[256] = {0}, version[256] = {0};
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VENDOR, sizeof(vendor) - 1, vendor, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version) - 1, version, NULL);
+    snprintf(identity, length, "device: %s\nvendor: %s\ndriver: %s\nversion: %s\n", name, vendor, driver, version);
+}
+
+// Everything the binary depends on, as text
+static void CacheKey(cl_device_id device, const char* source, const char* options, char* key)
+{
+    char identity[DEVICE_IDENTITY_LENGTH];
+    DeviceIdentity(device, identity, sizeof(identity));
+    snprintf(key, CACHE_KEY_LENGTH, "%s\n%soptions: %s\nsource: %016llx\n", CACHE_FORMAT, identity, options,
+             HashText(source));
+}
+
+static void CachePath(const char* directory, const char* key, char* path)
+{
+    snprintf(path, PROGRAM_CACHE_PATH_LENGTH, "%s/%016llx.bin", directory, HashText(key));
+}
+
+bool MakeDirectories(const char* path)
+{
+    char partial[PROGRAM_CACHE_PATH_LENGTH];
+    size_t length = strlen(path), end;
+    if (length == 0 || length >= sizeof(partial)) return false;
+    memcpy(partial, path, length + 1);
+    for (end = 1; end <= length; end++)     // each prefix ending at a '/', then the whole path
+    {
+        if (partial[end] != '/' && partial[end] != '\0') continue;
+        partial[end] = '\0';
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST) return false;
+        partial[end] = path[end];
+    }
+    return true;
+}
+
+bool DefaultProgramCacheDirectory(char* directory, size_t length)
+{
+    const char* base = getenv("XDG_CACHE_HOME");
+    if (base && *base) snprintf(directory, length, "%s/oclFirstLoop", base);
+    else if ((base = getenv("HOME")) && *base) snprintf(directory, length, "%s/.cache/oclFirstLoop", base);
+    else return false;
+    return true;
+}
+
+cl_program LoadCachedProgram(const char* directory, cl_context context, cl_device_id device, const char* source,
+                             const char* options, CacheStatus* status)
+{
+    *status = CACHE_OFF;
+    if (!directory) return NULL;
+    char key[CACHE_KEY_LENGTH], path[PROGRAM_CACHE_PATH_LENGTH];
+    CacheKey(device, source, options, key);
+    CachePath(directory, key, path);
+    *status = CACHE_MISS;
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    // [key length][key][binary length][binary]
+    size_t keyLength = 0, binaryLength = 0;
+    char storedKey[CACHE_KEY_LENGTH];
+    unsigned char* binary = NULL;
+    bool valid = fread(&keyLength, sizeof(size_t), 1, f) == 1 && keyLength == strlen(key) &&
+                 fread(storedKey, 1, keyLength, f) == keyLength && memcmp(storedKey, key, keyLength) == 0 &&
+                 fread(&binaryLength, sizeof(size_t), 1, f) == 1 && binaryLength > 0 &&
+                 (binary = (unsigned char*)malloc(binaryLength)) != NULL &&
+                 fread(binary, 1, binaryLength, f) == binaryLength;
+    fclose(f);
+    if (!valid)
+    {
+        free(binary);
+        return NULL;
+    }
+
+    cl_int binaryStatus = CL_SUCCESS, err;
+    const unsigned char* binaries[1] = { binary };
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binaryLength, binaries, &binaryStatus, &err);
+    free(binary);
+    if (err == CL_SUCCESS && binaryStatus == CL_SUCCESS) err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    else if (err == CL_SUCCESS) err = binaryStatus;
+    if (err != CL_SUCCESS)
+    {
+        *status = CACHE_REJECTED;
+        if (program) clReleaseProgram(program);
+        remove(path);
+        return NULL;
+    }
+    *status = CACHE_SUCCESS;
+    return program;
+}
+
+CacheStatus StoreCachedProgram(const char* directory, cl_program program, cl_device_id device, const char* source,
+                               const char* options)
+{
+    if (!directory) return CACHE_OFF;
+    size_t binaryLength = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binaryLength, NULL) != CL_SUCCESS ||
+        binaryLength == 0)
+        return CACHE_NO_BINARY;
+    unsigned char* binary = (unsigned char*)malloc(binaryLength);
+    unsigned char* binaries[1] = { binary };
+    if (!binary || clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+    {
+        free(binary);
+        return CACHE_NO_BINARY;
+    }
+
+    char key[CACHE_KEY_LENGTH], path[PROGRAM_CACHE_PATH_LENGTH], temporary[PROGRAM_CACHE_PATH_LENGTH + 32];
+    CacheKey(device, source, options, key);
+    CachePath(directory, key, path);
+    static int storeCount = 0;     // distinct temporaries for engines storing at once in one process
+    snprintf(temporary, sizeof(temporary), "%s.%d.%d.tmp", path, (int)getpid(), __sync_fetch_and_add(&storeCount, 1));
+    MakeDirectories(directory);
+    size_t keyLength = strlen(key);
+    FILE* f = fopen(temporary, "wb");
+    bool written = f && fwrite(&keyLength, sizeof(size_t), 1, f) == 1 && fwrite(key, 1, keyLength, f) == keyLength &&
+                   fwrite(&binaryLength, sizeof(size_t), 1, f) == 1 &&
+                   fwrite(binary, 1, binaryLength, f) == binaryLength;
+    if (f && fclose(f) != 0) written = false;
+    free(binary);
+    if (!written || rename(temporary, path) != 0)
+    {
+        remove(temporary);
+        return CACHE_WRITE_FAILED;
+    }
+    return CACHE_SUCCESS;
+}
+
+const char* CacheStatusString(CacheStatus status)
+{
+    switch (status)
+    {
+        case CACHE_SUCCESS:         return "success";
+        case CACHE_OFF:             return "no cache directory";
+        case CACHE_MISS:            return "no cached binary";
+        case CACHE_REJECTED:        return "cached binary rejected by the runtime";
+        case CACHE_NO_BINARY:       return "no program binary to cache";
+        case CACHE_WRITE_FAILED:    return "error writing the program cache";
+        default:                    return "unknown cache status";
+    }
+}
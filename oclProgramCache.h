@@ -0,0 +1,69 @@
+// *********************************************************************
+// oclProgramCache: on-disk cache of built program binaries
+//
+// Building the kernel from source costs hundreds of milliseconds to
+// seconds in every process.  After a source build the device binary
+// (CL_PROGRAM_BINARIES) is stored in the cache directory under a hash of
+// everything it depends on: device name and vendor, driver and device
+// versions, build options and the kernel source.  A later run with the
+// same key loads it with clCreateProgramWithBinary instead; a binary the
+// runtime rejects (new driver, damaged file) is dropped and the program
+// rebuilt from source, which stores a fresh one.
+//
+// The full key is kept in the file and compared on load, so a hash
+// collision costs a rebuild, never a wrong program.  Entries are written
+// under a temporary name and renamed into place, so concurrent jobs (or
+// engines on several threads) never load half a binary.
+// *********************************************************************
+
+#ifndef OCLPROGRAMCACHE_H
+#define OCLPROGRAMCACHE_H
+
+#include "oclFirstLoop.h"
+
+#define DEVICE_IDENTITY_LENGTH      1088    // four fields of up to 255 characters and their names
+#define PROGRAM_CACHE_PATH_LENGTH   1024    // a cache directory, or a file in one
+
+// What a load or store of the cache did; only CACHE_SUCCESS and CACHE_MISS
+// are quiet, the rest are worth a word from the caller (none stop a build)
+enum CacheStatus
+{
+    CACHE_SUCCESS = 0,      // loaded, or stored
+    CACHE_OFF,              // no cache directory
+    CACHE_MISS,             // no binary stored for the program
+    CACHE_REJECTED,         // the runtime rejected the stored binary, which is removed
+    CACHE_NO_BINARY,        // the runtime gave no binary to store
+    CACHE_WRITE_FAILED      // the binary could not be written
+};
+
+// The device's name, vendor, driver and device versions, one "field:
+// value" line each: what cached binaries (and tuning profiles, oclTuning.h)
+// are kept per
+void DeviceIdentity(cl_device_id device, char* identity, size_t length);
+
+// 64-bit FNV-1a of text, naming the files of the cache
+unsigned long long HashText(const char* text);
+
+// mkdir -p: path and every missing directory above it; true when they
+// are all there
+bool MakeDirectories(const char* path);
+
+// $XDG_CACHE_HOME/oclFirstLoop, or ~/.cache/oclFirstLoop, into directory
+// (length bytes); false without either variable.  Nothing is created
+// until something is stored there.
+bool DefaultProgramCacheDirectory(char* directory, size_t length);
+
+// The program for source and options on device, built from the cached
+// binary, or NULL when directory is NULL or holds no binary the device
+// accepts; *status says which
+cl_program LoadCachedProgram(const char* directory, cl_context context, cl_device_id device, const char* source,
+                             const char* options, CacheStatus* status);
+
+// Store the binary of a program just built from source and options for
+// device
+CacheStatus StoreCachedProgram(const char* directory, cl_program program, cl_device_id device, const char* source,
+                               const char* options);
+
+const char* CacheStatusString(CacheStatus status);
+
+#endif
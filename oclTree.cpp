@@ -0,0 +1,365 @@
+// *********************************************************************
+// oclTree: Newick parsing and traversal schedules for the pruning engine
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "oclTree.h"
+
+// Scratch representation used while parsing: nodes in creation order with
+// first-child / next-sibling links.
+// *********************************************************************
+struct NewickScratch
+{
+    int     count, capacity;
+    int     *parent, *firstChild, *lastChild, *nextSibling;
+    double* length;
+    char**  name;
+};
+
+static int NewScratchNode(NewickScratch* s, int parent)
+{
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity ? 2 * s->capacity : 64;
+        s->parent      = (int*)realloc(s->parent,      sizeof(int) * s->capacity);
+        s->firstChild  = (int*)realloc(s->firstChild,  sizeof(int) * s->capacity);
+        s->lastChild   = (int*)realloc(s->lastChild,   sizeof(int) * s->capacity);
+        s->nextSibling = (int*)realloc(s->nextSibling, sizeof(int) * s->capacity);
+        s->length      = (double*)realloc(s->length,   sizeof(double) * s->capacity);
+        s->name        = (char**)realloc(s->name,      sizeof(char*) * s->capacity);
+    }
+    int n = s->count++;
+    s->parent[n] = parent;
+    s->firstChild[n] = s->lastChild[n] = s->nextSibling[n] = -1;
+    s->length[n] = 0.;
+    s->name[n] = NULL;
+    if (parent >= 0)
+    {
+        if (s->lastChild[parent] < 0) s->firstChild[parent] = n;
+        else s->nextSibling[s->lastChild[parent]] = n;
+        s->lastChild[parent] = n;
+    }
+    return n;
+}
+
+static void FreeScratch(NewickScratch* s, bool freeNames)
+{
+    if (freeNames)
+    {
+        for (int n = 0; n < s->count; n++) free(s->name[n]);
+    }
+    free(s->parent); free(s->firstChild); free(s->lastChild);
+    free(s->nextSibling); free(s->length); free(s->name);
+}
+
+static void NewickError(const char* newick, const char* at, const char* what)
+{
+    printf("Error in Newick tree at character %ld: %s\n", (long)(at - newick), what);
+}
+
+// Renumber the scratch nodes (tips first, then internal nodes in post-order)
+// and build the child rows and level schedule.
+// *********************************************************************
+static Tree* BuildTree(NewickScratch* s)
+{
+    int n, k, tips = 0;
+    for (n = 0; n < s->count; n++)
+        if (s->firstChild[n] < 0) tips++;
+
+    int* remap = (int*)malloc(sizeof(int) * s->count);
+    int* stack = (int*)malloc(sizeof(int) * s->count);
+    int* iter  = (int*)malloc(sizeof(int) * s->count);
+    int nextTip = 0, nextInternal = tips, sp = 0;
+
+    // iterative post-order walk from the root (scratch node 0)
+    stack[sp++] = 0;
+    iter[0] = s->firstChild[0];
+    while (sp > 0)
+    {
+        int top = stack[sp - 1];
+        int child = iter[top];
+        if (child >= 0)
+        {
+            iter[top] = s->nextSibling[child];
+            iter[child] = s->firstChild[child];
+            stack[sp++] = child;
+        }
+        else
+        {
+            sp--;
+            remap[top] = (s->firstChild[top] < 0) ? nextTip++ : nextInternal++;
+        }
+    }
+    free(stack);
+    free(iter);
+
+    Tree* tree = (Tree*)calloc(1, sizeof(Tree));
+    tree->nodeCount     = s->count;
+    tree->tipCount      = tips;
+    tree->root          = s->count - 1;
+    tree->parent        = (int*)malloc(sizeof(int) * s->count);
+    tree->branchLength  = (double*)malloc(sizeof(double) * s->count);
+    tree->names         = (char**)malloc(sizeof(char*) * s->count);
+    tree->level         = (int*)malloc(sizeof(int) * s->count);
+    tree->childStart    = (int*)calloc(s->count + 1, sizeof(int));
+    tree->children      = (int*)malloc(sizeof(int) * (s->count > 1 ? s->count - 1 : 1));
+
+    for (n = 0; n < s->count; n++)
+    {
+        int m = remap[n];
+        tree->parent[m]       = (s->parent[n] >= 0) ? remap[s->parent[n]] : -1;
+        tree->branchLength[m] = s->length[n];
+        tree->names[m]        = s->name[n];
+        for (k = s->firstChild[n]; k >= 0; k = s->nextSibling[k])
+            tree->childStart[m + 1]++;
+    }
+    for (n = 0; n < s->count; n++)
+        tree->childStart[n + 1] += tree->childStart[n];
+    for (n = 0; n < s->count; n++)
+    {
+        int slot = tree->childStart[remap[n]];
+        for (k = s->firstChild[n]; k >= 0; k = s->nextSibling[k])
+            tree->children[slot++] = remap[k];
+    }
+    free(remap);
+
+    // children always precede their parent, so one ascending pass sets levels
+    tree->levelCount = 0;
+    for (n = 0; n < tree->nodeCount; n++)
+    {
+        int lvl = 0;
+        for (k = tree->childStart[n]; k < tree->childStart[n + 1]; k++)
+            if (tree->level[tree->children[k]] + 1 > lvl) lvl = tree->level[tree->children[k]] + 1;
+        tree->level[n] = lvl;
+        if (lvl > tree->levelCount) tree->levelCount = lvl;
+    }
+
+    // bucket the internal nodes by level
+    tree->levelStart = (int*)calloc(tree->levelCount + 1, sizeof(int));
+    tree->levelNodes = (int*)malloc(sizeof(int) * (tree->nodeCount - tree->tipCount));
+    for (n = tree->tipCount; n < tree->nodeCount; n++)
+        tree->levelStart[tree->level[n]]++;
+    for (k = 0; k < tree->levelCount; k++)
+        tree->levelStart[k + 1] += tree->levelStart[k];
+    int* fill = (int*)malloc(sizeof(int) * (tree->levelCount + 1));
+    memcpy(fill, tree->levelStart, sizeof(int) * (tree->levelCount + 1));
+    for (n = tree->tipCount; n < tree->nodeCount; n++)
+        tree->levelNodes[fill[tree->level[n] - 1]++] = n;
+    free(fill);
+
+    return tree;
+}
+
+// Newick parser
+// *********************************************************************
+Tree* ParseNewick(const char* newick)
+{
+    NewickScratch s;
+    memset(&s, 0, sizeof(s));
+
+    int cur = NewScratchNode(&s, -1);
+    const char* p = newick;
+    bool done = false;
+
+    while (*p && !done)
+    {
+        if (isspace((unsigned char)*p)) { p++; continue; }
+        switch (*p)
+        {
+            case '(':
+                cur = NewScratchNode(&s, cur);
+                p++;
+                break;
+            case ',':
+                if (s.parent[cur] < 0)
+                {
+                    NewickError(newick, p, "',' outside of a clade");
+                    FreeScratch(&s, true);
+                    return NULL;
+                }
+                cur = NewScratchNode(&s, s.parent[cur]);
+                p++;
+                break;
+            case ')':
+                if (s.parent[cur] < 0)
+                {
+                    NewickError(newick, p, "unbalanced ')'");
+                    FreeScratch(&s, true);
+                    return NULL;
+                }
+                cur = s.parent[cur];
+                p++;
+                break;
+            case ':':
+            {
+                char* end;
+                s.length[cur] = strtod(p + 1, &end);
+                if (end == p + 1)
+                {
+                    NewickError(newick, p, "missing branch length after ':'");
+                    FreeScratch(&s, true);
+                    return NULL;
+                }
+                p = end;
+                break;
+            }
+            case '[':
+                while (*p && *p != ']') p++;
+                if (*p) p++;
+                break;
+            case ';':
+                done = true;
+                break;
+            default:
+            {
+                const char* start = p;
+                size_t len;
+                if (*p == '\'')
+                {
+                    start = ++p;
+                    while (*p && *p != '\'') p++;
+                    len = p - start;
+                    if (*p) p++;
+                }
+                else
+                {
+                    while (*p && !isspace((unsigned char)*p) && !strchr("(),:;[", *p)) p++;
+                    len = p - start;
+                }
+                free(s.name[cur]);
+                s.name[cur] = (char*)malloc(len + 1);
+                memcpy(s.name[cur], start, len);
+                s.name[cur][len] = '\0';
+                break;
+            }
+        }
+    }
+
+    if (s.parent[cur] >= 0)
+    {
+        NewickError(newick, p, "missing ')'");
+        FreeScratch(&s, true);
+        return NULL;
+    }
+    if (s.count < 2)
+    {
+        NewickError(newick, p, "tree has no internal nodes");
+        FreeScratch(&s, true);
+        return NULL;
+    }
+
+    Tree* tree = BuildTree(&s);
+    FreeScratch(&s, false);     // names now belong to the tree
+    return tree;
+}
+
+Tree* ReadNewickFile(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        printf("Error opening tree file %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* text = (char*)malloc(size + 1);
+    size_t got = fread(text, 1, size, f);
+    text[got] = '\0';
+    fclose(f);
+
+    Tree* tree = ParseNewick(text);
+    free(text);
+    return tree;
+}
+
+// Default tree
+// *********************************************************************
+// Length of the newick text of tips first+1 .. first+count: each tip is
+// "t<n>:0.1", each internal node adds "(", "," and "):0.1"
+static size_t BalancedLength(int first, int count)
+{
+    size_t length = 7 * (size_t)(count - 1);
+    int tip;
+    for (tip = first + 1; tip <= first + count; tip++)
+    {
+        length += 5;
+        for (int digits = tip; digits > 0; digits /= 10) length++;
+    }
+    return length;
+}
+
+static void AppendBalanced(char* buf, size_t* len, int first, int count)
+{
+    if (count == 1)
+    {
+        *len += sprintf(buf + *len, "t%d:0.1", first + 1);
+        return;
+    }
+    buf[(*len)++] = '(';
+    AppendBalanced(buf, len, first, count / 2);
+    buf[(*len)++] = ',';
+    AppendBalanced(buf, len, first + count / 2, count - count / 2);
+    *len += sprintf(buf + *len, "):0.1");
+}
+
+Tree* BalancedTree(int tips)
+{
+    if (tips < 2) tips = 2;
+    size_t len = 0;
+    char* newick = (char*)malloc(BalancedLength(0, tips) + 2);     // with the ';' and the terminator
+    if (!newick) return NULL;
+    AppendBalanced(newick, &len, 0, tips);
+    newick[len++] = ';';
+    newick[len] = '\0';
+
+    Tree* tree = ParseNewick(newick);
+    free(newick);
+    return tree;
+}
+
+void FreeTree(Tree* tree)
+{
+    if (!tree) return;
+    for (int n = 0; n < tree->nodeCount; n++) free(tree->names[n]);
+    free(tree->names);
+    free(tree->parent);
+    free(tree->branchLength);
+    free(tree->level);
+    free(tree->childStart);
+    free(tree->children);
+    free(tree->levelStart);
+    free(tree->levelNodes);
+    free(tree);
+}
+
+// Dirty paths
+// *********************************************************************
+void MarkPathDirty(const Tree* tree, int node, bool* dirty)
+{
+    for (node = tree->parent[node]; node >= 0 && !dirty[node]; node = tree->parent[node])
+        dirty[node] = true;
+}
+
+int DirtyLevelSchedule(const Tree* tree, bool* dirty, int* start, int* nodes)
+{
+    int count = 0;
+    for (int l = 0; l < tree->levelCount; l++)
+    {
+        start[l] = count;
+        for (int i = tree->levelStart[l]; i < tree->levelStart[l+1]; i++)
+        {
+            int node = tree->levelNodes[i];
+            if (!dirty[node]) continue;
+            dirty[node] = false;
+            nodes[count++] = node;
+        }
+    }
+    start[tree->levelCount] = count;
+    return count;
+}
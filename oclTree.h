@@ -0,0 +1,61 @@
+// *********************************************************************
+// oclTree: rooted trees for the pruning engine
+//
+// Trees are read from Newick.  Nodes are numbered so that the tips come
+// first (0 .. tipCount-1, left to right) followed by the internal nodes in
+// post-order; every child therefore has a smaller index than its parent and
+// the root is always the last node.  Each node owns one partial-likelihood
+// buffer addressed by its index.
+// *********************************************************************
+
+#ifndef OCLTREE_H
+#define OCLTREE_H
+
+struct Tree
+{
+    int     nodeCount;
+    int     tipCount;
+    int     root;           // == nodeCount - 1
+
+    int*    parent;         // parent[node], -1 for the root
+    double* branchLength;   // length of the branch above node (0 if absent)
+    char**  names;          // tip/node labels, NULL when unlabelled
+    int*    level;          // 0 for tips, 1 + max(child level) otherwise
+
+    // Children in compressed rows: children[childStart[n] .. childStart[n+1])
+    int*    childStart;     // nodeCount + 1 entries
+    int*    children;
+
+    // Internal nodes grouped by level, so every node of a level only depends
+    // on lower levels: levelNodes[levelStart[l] .. levelStart[l+1]) for
+    // l = 0 .. levelCount-1 holds the internal nodes of level l+1.
+    int     levelCount;
+    int*    levelStart;     // levelCount + 1 entries
+    int*    levelNodes;
+};
+
+// Parse a Newick string ("((a:0.1,b:0.2):0.05,c:0.3);").  Returns NULL and
+// prints the offending position if the string is malformed.
+Tree* ParseNewick(const char* newick);
+
+// Read the first tree from a Newick file.
+Tree* ReadNewickFile(const char* path);
+
+// A balanced binary tree with the given number of tips and unit-ish branch
+// lengths; used when no tree is supplied on the command line.
+Tree* BalancedTree(int tips);
+
+void FreeTree(Tree* tree);
+
+// Dirty-path tracking for incremental recomputation.  Changing the branch
+// above node (or the partials of node) makes every ancestor stale; flag
+// them in dirty (nodeCount entries).  Stops early at an ancestor that is
+// already flagged, since the rest of its path is too.
+void MarkPathDirty(const Tree* tree, int node, bool* dirty);
+
+// Schedule the flagged internal nodes like levelStart / levelNodes (start
+// has levelCount + 1 entries, nodes room for every internal node; a level
+// may be empty) and clear the flags.  Returns the number of nodes scheduled.
+int DirtyLevelSchedule(const Tree* tree, bool* dirty, int* start, int* nodes);
+
+#endif
@@ -0,0 +1,128 @@
+// *********************************************************************
+// oclTuning: per-device profiles of the fastest kernel launch shape
+// *********************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oclTuning.h"
+#include "oclProgramCache.h"
+
+#define TUNING_HEADER_LENGTH    2048
+#define TUNING_PATH_LENGTH      PROGRAM_CACHE_PATH_LENGTH
+#define TUNING_LINE_LENGTH      256
+#define TUNING_FORMAT           "oclFirstLoop kernel tuning 1"
+
+// The lines every profile of device starts with
+static void TuningHeader(cl_device_id device, char* header)
+{
+    char identity[DEVICE_IDENTITY_LENGTH];
+    DeviceIdentity(device, identity, sizeof(identity));
+    snprintf(header, TUNING_HEADER_LENGTH, "%s\n%ssource: %016llx\n", TUNING_FORMAT, identity,
+             HashText(programSource));
+}
+
+static void TuningPath(const char* directory, cl_device_id device, char* path)
+{
+    char identity[DEVICE_IDENTITY_LENGTH];
+    DeviceIdentity(device, identity, sizeof(identity));
+    snprintf(path, TUNING_PATH_LENGTH, "%s/%016llx.tuning", directory, HashText(identity));
+}
+
+// The profile at path when it starts with header: its file, positioned
+// after the header; NULL otherwise
+static FILE* OpenProfile(const char* path, const char* header)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t headerLength = strlen(header);
+    char stored[TUNING_HEADER_LENGTH];
+    if (fread(stored, 1, headerLength, f) != headerLength || memcmp(stored, header, headerLength) != 0)
+    {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+// The problem a profile line is for, without its tuning
+static void ProblemKey(int characters, int categories, DevicePrecision precision, LayoutKind layout, char* key)
+{
+    snprintf(key, TUNING_LINE_LENGTH, "%d %d %s %s ", characters, categories, PrecisionName(precision),
+             LayoutName(layout));
+}
+
+bool LoadKernelTuning(const char* directory, cl_device_id device, int characters, int categories,
+                      DevicePrecision precision, int* layout, KernelTuning* tuning)
+{
+    if (!directory) return false;
+    char header[TUNING_HEADER_LENGTH], path[TUNING_PATH_LENGTH], key[TUNING_LINE_LENGTH], line[TUNING_LINE_LENGTH];
+    TuningHeader(device, header);
+    TuningPath(directory, device, path);
+    FILE* f = OpenProfile(path, header);
+    if (!f) return false;
+    double bestMilliseconds = 0.;
+    int wanted = *layout, kind;
+    bool found = false;
+    while (fgets(line, sizeof(line), f))
+        for (kind = 0; kind < LAYOUT_KINDS; kind++)
+        {
+            if (wanted >= 0 && kind != wanted) continue;
+            ProblemKey(characters, categories, precision, (LayoutKind)kind, key);
+            size_t keyLength = strlen(key);
+            unsigned long localWorkSize;
+            int sitesPerGroup, unroll;
+            double milliseconds;
+            if (strncmp(line, key, keyLength) == 0 &&
+                sscanf(line + keyLength, "%lu %d %d %lf", &localWorkSize, &sitesPerGroup, &unroll,
+                       &milliseconds) == 4 &&
+                sitesPerGroup > 0 && unroll > 0 && (!found || milliseconds < bestMilliseconds))
+            {
+                tuning->localWorkSize = localWorkSize;
+                tuning->sitesPerGroup = sitesPerGroup;
+                tuning->unroll = unroll;
+                bestMilliseconds = milliseconds;
+                found = true;
+                *layout = kind;
+            }
+        }
+    fclose(f);
+    return found;
+}
+
+bool StoreKernelTuning(const char* directory, cl_device_id device, int characters, int categories,
+                       DevicePrecision precision, LayoutKind layout, const KernelTuning* tuning, double seconds)
+{
+    if (!directory) return false;
+    char header[TUNING_HEADER_LENGTH], path[TUNING_PATH_LENGTH], temporary[TUNING_PATH_LENGTH + 32];
+    char key[TUNING_LINE_LENGTH], line[TUNING_LINE_LENGTH];
+    TuningHeader(device, header);
+    TuningPath(directory, device, path);
+    ProblemKey(characters, categories, precision, layout, key);
+    static int storeCount = 0;     // distinct temporaries for stores at once in one process
+    snprintf(temporary, sizeof(temporary), "%s.%d.%d.tmp", path, (int)getpid(), __sync_fetch_and_add(&storeCount, 1));
+    MakeDirectories(directory);
+
+    // the header, every other problem's line, then this one
+    FILE* out = fopen(temporary, "w");
+    bool written = out && fputs(header, out) >= 0;
+    FILE* in = OpenProfile(path, header);
+    if (in)
+    {
+        size_t keyLength = strlen(key);
+        while (written && fgets(line, sizeof(line), in))
+            if (strncmp(line, key, keyLength) != 0) written = fputs(line, out) >= 0;
+        fclose(in);
+    }
+    written = written && fprintf(out, "%s%lu %d %d %.6f\n", key, (unsigned long)tuning->localWorkSize,
+                                 tuning->sitesPerGroup, tuning->unroll, seconds * 1e3) > 0;
+    if (out && fclose(out) != 0) written = false;
+    if (!written || rename(temporary, path) != 0)
+    {
+        remove(temporary);
+        return false;
+    }
+    return true;
+}
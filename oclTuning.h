@@ -0,0 +1,42 @@
+// *********************************************************************
+// oclTuning: per-device profiles of the fastest kernel launch shape
+//
+// The best work group size, sites per group and unroll factor depend on
+// the device (its SIMD width, registers, local memory) as much as on the
+// character count, so the driver's --tune benchmarks candidates on the
+// device and keeps the winner here, for later runs to pick up without
+// benchmarking again.
+//
+// Each device has one text file in the program cache directory, named by
+// a hash of its identity (oclProgramCache.h) and holding that identity and
+// the hash of the kernel source, then one line per problem and layout:
+//
+//   characters categories precision layout workGroupSize sitesPerGroup unroll milliseconds
+//
+// so a run that leaves the layout to the driver can take the fastest
+// stored one along with its launch shape.
+//
+// A file for another driver or kernel source is ignored and replaced on
+// the next store.  Stores go through a temporary file and a rename, as
+// cached binaries do.
+// *********************************************************************
+
+#ifndef OCLTUNING_H
+#define OCLTUNING_H
+
+#include "oclFirstLoop.h"
+#include "oclKernel.h"
+
+// The tuning stored for characters and categories in precision and
+// *layout on device; with *layout -1, the fastest stored in any layout,
+// and *layout set to it.  false when directory is NULL or holds none.
+bool LoadKernelTuning(const char* directory, cl_device_id device, int characters, int categories,
+                      DevicePrecision precision, int* layout, KernelTuning* tuning);
+
+// Store tuning, which took seconds per traversal, in place of any earlier
+// one for the same problem; false if directory is NULL or it could not be
+// written
+bool StoreKernelTuning(const char* directory, cl_device_id device, int characters, int categories,
+                       DevicePrecision precision, LayoutKind layout, const KernelTuning* tuning, double seconds);
+
+#endif